@@ -0,0 +1,205 @@
+#include "sim.h"
+#include <algorithm>
+#include <map>
+#include <sys/time.h>
+
+/*
+ * Replays a fixed mix of app traffic against the firmware and prints the
+ * results as JSON on stdout:
+ *   - bursts of 'S' from a scene being switched
+ *   - 'G' polls from several apps at once
+ *   - timer edits, 'T' followed later by 'Q'
+ *   - switches being removed and added back, 'R' and 'A'
+ * Latency is simulated us from connect until the firmware closes the
+ * connection, so requests that queue behind others in a batch pay for it.
+ * The workload comes from a fixed seed and the clock is simulated, so
+ * every number except the wall_* ones is the same from run to run.
+ *
+ * Environment:
+ *   BENCH_BATCHES=<n>  Number of traffic batches (default 400)
+ *   BENCH_SEED=<n>     Workload seed (default 1)
+ */
+
+#define BENCH_SWITCHES 30     // Switches 10..39 added before the run
+#define BENCH_IDLE_US 1000000 // Quiet time between batches
+#define BENCH_RF_GAP_US 5000  // Edges closer than this belong to one transmission
+
+struct Pending {
+  std::shared_ptr<sim::Connection> c;
+  char command;
+  uint64_t start;
+};
+
+struct CommandStats {
+  std::vector<uint64_t> latency;
+  unsigned long rejected;
+  CommandStats() : rejected(0) {}
+};
+
+static std::map<char, CommandStats> stats;
+static uint64_t busyUs = 0;
+static unsigned long commands = 0;
+static unsigned long seed = 1;
+
+static unsigned long nextRandom(unsigned long n)
+{
+  seed = seed * 1103515245UL + 12345UL;
+  return ((seed >> 16) & 0x7FFF) % n;
+}
+
+static uint64_t wallMicros()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void runFor(uint64_t us)
+{
+  uint64_t end = sim::now() + us;
+  while(sim::now() < end)
+    loop();
+}
+
+// Open all connections at once and run until the firmware closed them
+static void batch(const std::vector<std::string>& lines)
+{
+  std::vector<Pending> pending;
+  uint64_t start = sim::now();
+  for(size_t i = 0; i < lines.size(); ++i){
+    Pending p = { sim::connect(8888, lines[i] + "\n"), lines[i][0], start };
+    pending.push_back(p);
+  }
+  while(!pending.empty()){
+    loop();
+    for(size_t i = 0; i < pending.size(); ){
+      if(pending[i].c->open){
+	++i;
+	continue;
+      }
+      CommandStats& s = stats[pending[i].command];
+      s.latency.push_back(sim::now() - pending[i].start);
+      if(pending[i].c->tx.compare(0, 3, "NOK") == 0)
+	++s.rejected;
+      ++commands;
+      pending.erase(pending.begin() + i);
+    }
+  }
+  busyUs += sim::now() - start;
+}
+
+static std::string switchId()
+{
+  char buf[8];
+  snprintf(buf, sizeof(buf), "%lu", 10 + nextRandom(BENCH_SWITCHES));
+  return buf;
+}
+
+static void trafficBatch(std::vector<int>& timers)
+{
+  std::vector<std::string> lines;
+  unsigned long kind = nextRandom(100);
+  char buf[64];
+  if(kind < 45){ // Scene switched from an app
+    unsigned long n = 4 + nextRandom(9);
+    for(unsigned long i = 0; i < n; ++i)
+      lines.push_back("S:" + switchId() + (nextRandom(2) ? ":1" : ":0"));
+  }
+  else if(kind < 75){ // Apps polling state
+    unsigned long n = 1 + nextRandom(4);
+    for(unsigned long i = 0; i < n; ++i)
+      lines.push_back("G");
+  }
+  else if(kind < 90){ // Timer edited or dropped
+    if(!timers.empty() && nextRandom(2)){
+      snprintf(buf, sizeof(buf), "Q:%d", timers.back());
+      timers.pop_back();
+      lines.push_back(buf);
+    }
+    else{
+      int timerid = 1 + nextRandom(20);
+      snprintf(buf, sizeof(buf), "T:%d:%lu:%lu:%lu:%lu:", timerid,
+	       nextRandom(24), nextRandom(60), nextRandom(24), nextRandom(60));
+      std::string line = buf;
+      unsigned long n = 1 + nextRandom(5);
+      for(unsigned long i = 0; i < n; ++i)
+	line += switchId() + ":";
+      lines.push_back(line);
+      timers.push_back(timerid);
+    }
+  }
+  else{ // Switch replaced
+    std::string id = switchId();
+    lines.push_back("R:" + id);
+    lines.push_back("A:" + id);
+  }
+  batch(lines);
+}
+
+static uint64_t percentile(std::vector<uint64_t>& v, unsigned int pct)
+{
+  if(v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  size_t i = (v.size() * pct + 99) / 100;
+  return v[i ? i - 1 : 0];
+}
+
+int main()
+{
+  unsigned long batches = getenv("BENCH_BATCHES") ? strtoul(getenv("BENCH_BATCHES"), NULL, 10) : 400;
+  seed = getenv("BENCH_SEED") ? strtoul(getenv("BENCH_SEED"), NULL, 10) : 1;
+  unsigned long workloadSeed = seed;
+
+  sim::init();
+  sim::eepromErase();
+  sim::eeprom[0] = 0;
+  setup();
+  for(int id = 10; id < 10 + BENCH_SWITCHES; ++id){
+    char buf[8];
+    snprintf(buf, sizeof(buf), "A:%d", id);
+    batch(std::vector<std::string>(1, buf));
+  }
+  runFor(2000000); // DHCP, NTP and the EEPROM flush settle
+  stats.clear();
+  busyUs = 0;
+  commands = 0;
+
+  sim::traceGpio = true;
+  sim::gpioTrace.clear();
+  unsigned long eepromWrites = sim::eepromWrites;
+  uint64_t simStart = sim::now();
+  uint64_t wallStart = wallMicros();
+  std::vector<int> timers;
+  for(unsigned long i = 0; i < batches; ++i){
+    trafficBatch(timers);
+    runFor(BENCH_IDLE_US);
+  }
+  runFor(5000000); // Let RF and EEPROM drain
+  uint64_t wallUs = wallMicros() - wallStart;
+  uint64_t simUs = sim::now() - simStart;
+
+  printf("{\n");
+  printf("  \"seed\": %lu,\n", workloadSeed);
+  printf("  \"batches\": %lu,\n", batches);
+  printf("  \"commands\": %lu,\n", commands);
+  printf("  \"sim_us\": %llu,\n", (unsigned long long)simUs);
+  printf("  \"busy_us\": %llu,\n", (unsigned long long)busyUs);
+  printf("  \"commands_per_second\": %.1f,\n", busyUs ? commands * 1e6 / busyUs : 0.0);
+  printf("  \"wall_us\": %llu,\n", (unsigned long long)wallUs);
+  printf("  \"wall_commands_per_second\": %.1f,\n", wallUs ? commands * 1e6 / wallUs : 0.0);
+  printf("  \"eeprom_bytes_written\": %lu,\n", sim::eepromWrites - eepromWrites);
+  printf("  \"rf_air_us\": %llu,\n", (unsigned long long)sim::airTime(10, BENCH_RF_GAP_US));
+  printf("  \"latency_us\": {");
+  const char* sep = "\n";
+  for(std::map<char, CommandStats>::iterator it = stats.begin(); it != stats.end(); ++it){
+    std::vector<uint64_t>& v = it->second.latency;
+    printf("%s    \"%c\": { \"count\": %zu, \"rejected\": %lu, \"p50\": %llu, \"p99\": %llu, \"max\": %llu }",
+	   sep, it->first, v.size(), it->second.rejected,
+	   (unsigned long long)percentile(v, 50), (unsigned long long)percentile(v, 99),
+	   (unsigned long long)percentile(v, 100));
+    sep = ",\n";
+  }
+  printf("\n  }\n}\n");
+  return 0;
+}
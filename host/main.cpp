@@ -0,0 +1,37 @@
+#include "sim.h"
+#include <sys/time.h>
+#include <unistd.h>
+
+static uint64_t wallMicros()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Runs the firmware on the host. SIM_RUN_SECONDS stops the loop after
+ * that much simulated time, otherwise it runs until killed. With
+ * SIM_LISTEN the simulated clock is kept in step with the wall clock,
+ * so it can be driven interactively and by other sim processes.
+ */
+int main()
+{
+  sim::init();
+  uint64_t runFor = getenv("SIM_RUN_SECONDS") ? strtoull(getenv("SIM_RUN_SECONDS"), NULL, 10) * 1000000 : 0;
+  bool realTime = getenv("SIM_LISTEN") != NULL;
+  uint64_t start = wallMicros();
+  setup();
+  while(!runFor || sim::now() < runFor){
+    loop();
+    if(realTime){
+      usleep(500);
+      uint64_t elapsed = wallMicros() - start;
+      if(elapsed > sim::now())
+	sim::advance(elapsed - sim::now());
+      else if(sim::now() - elapsed > 1000)
+	usleep(sim::now() - elapsed); // Slept ahead in idle()
+    }
+  }
+  return 0;
+}
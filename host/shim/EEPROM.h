@@ -0,0 +1,19 @@
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <stdint.h>
+#include "avr/io.h"
+
+// In-memory EEPROM, every write is counted (see sim.h).
+class EEPROMClass
+{
+ public:
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+  void update(int address, uint8_t value) { if(read(address) != value) write(address, value); }
+  uint16_t length() { return E2END + 1; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef ethernet_h
+#define ethernet_h
+
+#include "Arduino.h"
+#include "IPAddress.h"
+#include "EthernetClient.h"
+#include "EthernetServer.h"
+
+class EthernetClass
+{
+ public:
+  int begin(uint8_t* mac, unsigned long timeout = 60000, unsigned long responseTimeout = 4000);
+  void begin(uint8_t* mac, IPAddress ip);
+  void begin(uint8_t* mac, IPAddress ip, IPAddress dns);
+  void begin(uint8_t* mac, IPAddress ip, IPAddress dns, IPAddress gateway);
+  void begin(uint8_t* mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet);
+  int maintain() { return 0; }
+
+  IPAddress localIP() { return mIp; }
+  IPAddress subnetMask() { return mSubnet; }
+  IPAddress gatewayIP() { return mGateway; }
+  IPAddress dnsServerIP() { return mDns; }
+
+ private:
+  IPAddress mIp, mDns, mGateway, mSubnet;
+};
+
+extern EthernetClass Ethernet;
+
+#endif
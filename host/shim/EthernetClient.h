@@ -0,0 +1,36 @@
+#ifndef ethernetclient_h
+#define ethernetclient_h
+
+#include "Arduino.h"
+#include "IPAddress.h"
+#include <memory>
+
+namespace sim { struct Connection; }
+
+class EthernetClient : public Print
+{
+ public:
+  EthernetClient() {}
+  EthernetClient(const std::shared_ptr<sim::Connection>& conn) : mConn(conn) {}
+
+  uint8_t connected();
+  int available();
+  int read();
+  int read(uint8_t* buf, size_t size);
+  int peek();
+  void flush() {}
+  void stop();
+  size_t write(uint8_t b);
+  size_t write(const uint8_t* buf, size_t size);
+  using Print::write;
+  int availableForWrite();
+  IPAddress remoteIP();
+  operator bool();
+  bool operator==(const EthernetClient& rhs) const { return mConn == rhs.mConn; }
+  bool operator!=(const EthernetClient& rhs) const { return mConn != rhs.mConn; }
+
+ private:
+  std::shared_ptr<sim::Connection> mConn;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef ethernetserver_h
+#define ethernetserver_h
+
+#include "EthernetClient.h"
+
+class EthernetServer : public Print
+{
+ public:
+  EthernetServer(uint16_t port) : mPort(port) {}
+  void begin();
+  EthernetClient available();
+  size_t write(uint8_t b);
+  size_t write(const uint8_t* buf, size_t size);
+  using Print::write;
+
+ private:
+  uint16_t mPort;
+};
+
+#endif
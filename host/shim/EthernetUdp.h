@@ -0,0 +1,49 @@
+#ifndef ethernetudp_h
+#define ethernetudp_h
+
+#include "Arduino.h"
+#include "IPAddress.h"
+#include <vector>
+
+class EthernetUDP : public Print
+{
+ public:
+  EthernetUDP() : mPort(0), mReadPos(0) {}
+  ~EthernetUDP() { stop(); }
+  uint8_t begin(uint16_t port);
+  void stop();
+
+  int beginPacket(IPAddress ip, uint16_t port);
+  int endPacket();
+  size_t write(uint8_t b);
+  size_t write(const uint8_t* buf, size_t size);
+  using Print::write;
+
+  int parsePacket();
+  int available();
+  int read();
+  int read(unsigned char* buf, size_t len);
+  int read(char* buf, size_t len) { return read((unsigned char*)buf, len); }
+  int peek();
+  void flush();
+  IPAddress remoteIP() { return mRemoteIp; }
+  uint16_t remotePort() { return mRemotePort; }
+
+  uint16_t localPort() { return mPort; }
+  void deliver(IPAddress from, uint16_t fromPort, const std::vector<uint8_t>& data);
+
+ private:
+  uint16_t mPort;
+  IPAddress mDestIp;
+  uint16_t mDestPort;
+  std::vector<uint8_t> mOut;
+  std::vector<std::vector<uint8_t> > mQueue;
+  std::vector<IPAddress> mQueueIp;
+  std::vector<uint16_t> mQueuePort;
+  std::vector<uint8_t> mIn;
+  size_t mReadPos;
+  IPAddress mRemoteIp;
+  uint16_t mRemotePort;
+};
+
+#endif
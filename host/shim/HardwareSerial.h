@@ -0,0 +1,23 @@
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include "Print.h"
+
+// Serial output goes to stderr, or nowhere if SIM_QUIET is set.
+class HardwareSerial : public Print
+{
+ public:
+  void begin(unsigned long baud) { (void)baud; }
+  void end() {}
+  int available() { return 0; }
+  int read() { return -1; }
+  void flush() {}
+  int availableForWrite() { return 63; }
+  size_t write(uint8_t c);
+  using Print::write;
+  operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
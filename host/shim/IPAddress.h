@@ -0,0 +1,31 @@
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+#include <string.h>
+#include "Printable.h"
+
+class IPAddress : public Printable
+{
+ public:
+  IPAddress() { memset(mAddr, 0, 4); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { mAddr[0] = a; mAddr[1] = b; mAddr[2] = c; mAddr[3] = d; }
+  IPAddress(uint32_t address) { memcpy(mAddr, &address, 4); }
+  IPAddress(const uint8_t* address) { memcpy(mAddr, address, 4); }
+
+  operator uint32_t() const { uint32_t a; memcpy(&a, mAddr, 4); return a; }
+  bool operator==(const IPAddress& rhs) const { return memcmp(mAddr, rhs.mAddr, 4) == 0; }
+  bool operator==(const uint8_t* addr) const { return memcmp(mAddr, addr, 4) == 0; }
+  bool operator!=(const IPAddress& rhs) const { return !(*this == rhs); }
+  uint8_t operator[](int index) const { return mAddr[index]; }
+  uint8_t& operator[](int index) { return mAddr[index]; }
+
+  size_t printTo(Print& p) const;
+
+ private:
+  uint8_t mAddr[4];
+};
+
+const IPAddress INADDR_NONE(0, 0, 0, 0);
+
+#endif
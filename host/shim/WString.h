@@ -0,0 +1,46 @@
+#ifndef String_class_h
+#define String_class_h
+
+#include <string>
+#include <stdio.h>
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+/*
+ * Arduino String on top of std::string. Only what the firmware uses.
+ * Like on the device, += with a number appends its decimal form.
+ */
+class String
+{
+ public:
+  String(const char* cstr = "") : s(cstr) {}
+  String(const __FlashStringHelper* str) : s(reinterpret_cast<const char*>(str)) {}
+  String(char c) : s(1, c) {}
+  String(int n) : s(std::to_string(n)) {}
+  String(unsigned int n) : s(std::to_string(n)) {}
+  String(long n) : s(std::to_string(n)) {}
+  String(unsigned long n) : s(std::to_string(n)) {}
+
+  unsigned char reserve(unsigned int size) { s.reserve(size); return 1; }
+  unsigned int length() const { return s.length(); }
+  const char* c_str() const { return s.c_str(); }
+  char operator[](unsigned int i) const { return s[i]; }
+
+  String& operator+=(const String& rhs) { s += rhs.s; return *this; }
+  String& operator+=(const char* rhs) { s += rhs; return *this; }
+  String& operator+=(char c) { s += c; return *this; }
+  String& operator+=(unsigned char n) { s += std::to_string(n); return *this; }
+  String& operator+=(int n) { s += std::to_string(n); return *this; }
+  String& operator+=(unsigned int n) { s += std::to_string(n); return *this; }
+  String& operator+=(long n) { s += std::to_string(n); return *this; }
+  String& operator+=(unsigned long n) { s += std::to_string(n); return *this; }
+
+  bool operator==(const String& rhs) const { return s == rhs.s; }
+  bool operator==(const char* rhs) const { return s == rhs; }
+
+ private:
+  std::string s;
+};
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+// ATmega328P (Uno) memory sizes.
+#define RAMEND 0x8FF
+#define E2END 0x3FF
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _AVR_SLEEP_H_
+#define _AVR_SLEEP_H_
+
+#include <stdint.h>
+
+// Idle sleep, woken by the next timer 0 tick (see sim.cpp).
+#define SLEEP_MODE_IDLE 0
+
+inline void set_sleep_mode(uint8_t mode) { (void)mode; }
+inline void sleep_enable() {}
+inline void sleep_disable() {}
+void sleep_cpu();
+
+#endif
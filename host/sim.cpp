@@ -0,0 +1,751 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+EthernetClass Ethernet;
+
+namespace sim {
+
+  static uint64_t clockUs = 0;
+  uint8_t eeprom[E2END + 1];
+  unsigned long eepromReads = 0;
+  unsigned long eepromWrites = 0;
+  unsigned long sleeps = 0;
+  static const char* eepromFile = NULL;
+  static bool quiet = false;
+
+  bool traceGpio = false;
+  std::vector<Edge> gpioTrace;
+  static uint8_t pins[64];
+  static void (*isrs[2])() = { NULL, NULL };
+  static int isrModes[2];
+
+  unsigned long epoch = 1433160000UL; // 2015-06-01 12:00 UTC
+  bool ntpServer = true;
+  bool dhcpServer = true;
+  IPAddress dhcpAddress(192, 168, 1, 151);
+  unsigned long ntpRequests = 0;
+  unsigned long dhcpRequests = 0;
+
+  static std::vector<std::shared_ptr<Connection> > connections;
+  static std::map<uint16_t, int> listeners; // firmware port -> fd
+  static int listenPort = 0;
+  static std::vector<EthernetUDP*> udpSockets;
+  static int lanPort = 0;   // SIM_LAN, real UDP port of node 0
+  static int lanNode = 0;   // SIM_NODE
+  static int lanNodes = 4;  // SIM_LAN_NODES
+  static int lanFd = -1;
+
+  static std::deque<Edge> pinEdges; // playPin(), in time order
+  static bool playing = false;       // An edge's ISR is running
+
+  uint64_t now() { return clockUs; }
+
+  // Edges due meanwhile interrupt at their time, as they would a slice
+  void advance(uint64_t us)
+  {
+    uint64_t end = clockUs + us;
+    if(!playing){
+      playing = true;
+      while(!pinEdges.empty() && pinEdges.front().t <= end){
+	Edge e = pinEdges.front();
+	pinEdges.pop_front();
+	if(e.t > clockUs)
+	  clockUs = e.t;
+	setPin(e.pin, e.level);
+      }
+      playing = false;
+    }
+    if(end > clockUs)
+      clockUs = end;
+  }
+
+  void playPin(const std::vector<Edge>& edges)
+  {
+    pinEdges.insert(pinEdges.end(), edges.begin(), edges.end());
+  }
+
+  void eepromErase() { memset(eeprom, 0xFF, sizeof(eeprom)); }
+
+  static void eepromSave()
+  {
+    if(!eepromFile)
+      return;
+    FILE* f = fopen(eepromFile, "wb");
+    if(f){
+      fwrite(eeprom, 1, sizeof(eeprom), f);
+      fclose(f);
+    }
+  }
+
+  void setPin(uint8_t pin, uint8_t level)
+  {
+    uint8_t old = pins[pin];
+    pins[pin] = level;
+    int irq = digitalPinToInterrupt(pin);
+    if(irq < 0 || !isrs[irq] || old == level)
+      return;
+    if(isrModes[irq] == CHANGE || (isrModes[irq] == RISING && level) || (isrModes[irq] == FALLING && !level))
+      isrs[irq]();
+  }
+
+  uint64_t airTime(uint8_t pin, uint64_t maxGap)
+  {
+    uint64_t total = 0;
+    uint64_t lastRise = 0;
+    bool high = false;
+    for(size_t i = 0; i < gpioTrace.size(); ++i){
+      const Edge& e = gpioTrace[i];
+      if(e.pin != pin)
+	continue;
+      if(e.level && !high){
+	if(lastRise && e.t - lastRise <= maxGap)
+	  total += e.t - lastRise;
+	high = true;
+	lastRise = e.t;
+      }
+      else if(!e.level && high){
+	high = false;
+      }
+    }
+    return total;
+  }
+
+  std::shared_ptr<Connection> connect(uint16_t port, const std::string& data)
+  {
+    std::shared_ptr<Connection> c(new Connection());
+    c->port = port;
+    c->rx.insert(c->rx.end(), data.begin(), data.end());
+    c->open = true;
+    c->peerClosed = false;
+    c->accepted = false;
+    c->fd = -1;
+    connections.push_back(c);
+    return c;
+  }
+
+  void pollSockets()
+  {
+    for(std::map<uint16_t, int>::iterator it = listeners.begin(); it != listeners.end(); ++it){
+      int fd;
+      while((fd = accept(it->second, NULL, NULL)) >= 0){
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	std::shared_ptr<Connection> c = connect(it->first);
+	c->fd = fd;
+      }
+    }
+    for(size_t i = 0; i < connections.size(); ++i){
+      Connection& c = *connections[i];
+      if(c.fd < 0 || c.peerClosed)
+	continue;
+      uint8_t buf[256];
+      ssize_t n;
+      while((n = ::read(c.fd, buf, sizeof(buf))) > 0)
+	c.rx.insert(c.rx.end(), buf, buf + n);
+      if(n == 0)
+	c.peerClosed = true;
+    }
+    // Forget connections nobody refers to any more
+    for(size_t i = 0; i < connections.size(); ){
+      if(!connections[i]->open && connections[i].use_count() == 1)
+	connections.erase(connections.begin() + i);
+      else
+	++i;
+    }
+  }
+
+  static void listen(uint16_t firmwarePort)
+  {
+    if(!listenPort || listeners.count(firmwarePort))
+      return;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(listenPort + listeners.size());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(fd, 4) < 0){
+      perror("sim: listen");
+      close(fd);
+      return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    listeners[firmwarePort] = fd;
+  }
+
+  static void putLong(std::vector<uint8_t>& p, size_t at, uint32_t v)
+  {
+    p[at] = v >> 24; p[at + 1] = v >> 16; p[at + 2] = v >> 8; p[at + 3] = v;
+  }
+
+  // Answer an NTP request with the simulated wall clock.
+  static void ntpReply(EthernetUDP* from)
+  {
+    ++ntpRequests;
+    std::vector<uint8_t> reply(48, 0);
+    reply[0] = 0x24; // LI 0, version 4, mode 4 (server)
+    putLong(reply, 40, epoch + clockUs / 1000000 + 2208988800UL);
+    from->deliver(IPAddress(132, 163, 4, 101), 123, reply);
+  }
+
+  // Answer DISCOVER with OFFER and REQUEST with ACK, always for dhcpAddress.
+  static void dhcpReply(const std::vector<uint8_t>& req)
+  {
+    if(req.size() < 240)
+      return;
+    ++dhcpRequests;
+    uint8_t type = 0;
+    for(size_t i = 240; i + 1 < req.size() && req[i] != 255; ){
+      if(req[i] == 0){ ++i; continue; }
+      if(req[i] == 53)
+	type = req[i + 2];
+      i += 2 + req[i + 1];
+    }
+    uint8_t replyType = type == 1 ? 2 : (type == 3 ? 5 : 0);
+    if(!replyType)
+      return;
+    std::vector<uint8_t> reply(240, 0);
+    reply[0] = 2; reply[1] = 1; reply[2] = 6;
+    memcpy(&reply[4], &req[4], 4);  // xid
+    memcpy(&reply[28], &req[28], 16); // chaddr
+    for(int i = 0; i < 4; ++i)
+      reply[16 + i] = dhcpAddress[i];
+    reply[236] = 0x63; reply[237] = 0x82; reply[238] = 0x53; reply[239] = 0x63;
+    const uint8_t options[] = {
+      53, 1, replyType,
+      54, 4, 192, 168, 1, 1,
+      51, 4, 0, 0, 0x0E, 0x10, // 3600 s
+      1, 4, 255, 255, 255, 0,
+      3, 4, 192, 168, 1, 1,
+      6, 4, 192, 168, 1, 1,
+      255 };
+    reply.insert(reply.end(), options, options + sizeof(options));
+    for(size_t i = 0; i < udpSockets.size(); ++i)
+      if(udpSockets[i]->localPort() == 68)
+	udpSockets[i]->deliver(IPAddress(192, 168, 1, 1), 67, reply);
+  }
+
+  /*
+   * Units in other processes: node n has address dhcpAddress + n and
+   * gets the datagrams for it on 127.0.0.1:SIM_LAN + n, after a header
+   * with the source and destination ports.
+   */
+  static IPAddress lanAddress(int node)
+  {
+    return IPAddress(192, 168, 1, 151 + node);
+  }
+
+  static void lanSend(int node, uint16_t fromPort, uint16_t toPort, const std::vector<uint8_t>& data)
+  {
+    std::vector<uint8_t> frame(4);
+    frame[0] = fromPort >> 8; frame[1] = fromPort; frame[2] = toPort >> 8; frame[3] = toPort;
+    frame.insert(frame.end(), data.begin(), data.end());
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(lanPort + node);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(lanFd, &frame[0], frame.size(), 0, (sockaddr*)&addr, sizeof(addr));
+  }
+
+  static void lanRoute(EthernetUDP* from, IPAddress ip, uint16_t port, const std::vector<uint8_t>& data)
+  {
+    if(lanFd < 0)
+      return;
+    for(int node = 0; node < lanNodes; ++node)
+      if(node != lanNode && (ip == IPAddress(255, 255, 255, 255) || ip == lanAddress(node)))
+	lanSend(node, from->localPort(), port, data);
+  }
+
+  void pollLan()
+  {
+    if(lanFd < 0)
+      return;
+    uint8_t buf[2048];
+    sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    ssize_t n;
+    while((n = recvfrom(lanFd, buf, sizeof(buf), 0, (sockaddr*)&addr, &length)) >= 4){
+      int node = ntohs(addr.sin_port) - lanPort;
+      uint16_t fromPort = buf[0] << 8 | buf[1];
+      uint16_t toPort = buf[2] << 8 | buf[3];
+      std::vector<uint8_t> data(buf + 4, buf + n);
+      for(size_t i = 0; i < udpSockets.size(); ++i)
+	if(udpSockets[i]->localPort() == toPort)
+	  udpSockets[i]->deliver(lanAddress(node), fromPort, data);
+      length = sizeof(addr);
+    }
+  }
+
+  static void openLan()
+  {
+    lanFd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(lanPort + lanNode);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(lanFd, (sockaddr*)&addr, sizeof(addr)) < 0){
+      perror("sim: lan");
+      close(lanFd);
+      lanFd = -1;
+      return;
+    }
+    fcntl(lanFd, F_SETFL, O_NONBLOCK);
+    dhcpAddress = lanAddress(lanNode);
+  }
+
+  // Route a datagram on the simulated LAN.
+  static void route(EthernetUDP* from, IPAddress ip, uint16_t port, const std::vector<uint8_t>& data)
+  {
+    if(port == 123 && ntpServer){
+      ntpReply(from);
+      return;
+    }
+    if(port == 67 && dhcpServer){
+      dhcpReply(data);
+      return;
+    }
+    lanRoute(from, ip, port, data);
+    IPAddress self = Ethernet.localIP();
+    if(ip != IPAddress(255, 255, 255, 255) && ip != self)
+      return;
+    for(size_t i = 0; i < udpSockets.size(); ++i)
+      if(udpSockets[i] != from && udpSockets[i]->localPort() == port)
+	udpSockets[i]->deliver(self, from->localPort(), data);
+  }
+
+  void init()
+  {
+    eepromErase();
+    if((eepromFile = getenv("SIM_EEPROM"))){
+      FILE* f = fopen(eepromFile, "rb");
+      if(f){
+	if(fread(eeprom, 1, sizeof(eeprom), f) != sizeof(eeprom))
+	  eepromErase();
+	fclose(f);
+      }
+    }
+    if(getenv("SIM_LISTEN"))
+      listenPort = atoi(getenv("SIM_LISTEN"));
+    if(getenv("SIM_EPOCH"))
+      epoch = strtoul(getenv("SIM_EPOCH"), NULL, 10);
+    quiet = getenv("SIM_QUIET") != NULL;
+    if(getenv("SIM_NODE"))
+      lanNode = atoi(getenv("SIM_NODE"));
+    if(getenv("SIM_LAN_NODES"))
+      lanNodes = atoi(getenv("SIM_LAN_NODES"));
+    if(getenv("SIM_LAN")){
+      lanPort = atoi(getenv("SIM_LAN"));
+      openLan();
+    }
+  }
+
+  void registerUdp(EthernetUDP* s)
+  {
+    if(std::find(udpSockets.begin(), udpSockets.end(), s) == udpSockets.end())
+      udpSockets.push_back(s);
+  }
+
+  void unregisterUdp(EthernetUDP* s)
+  {
+    udpSockets.erase(std::remove(udpSockets.begin(), udpSockets.end(), s), udpSockets.end());
+  }
+
+  void sendUdp(EthernetUDP* from, IPAddress ip, uint16_t port, const std::vector<uint8_t>& data)
+  {
+    route(from, ip, port, data);
+  }
+
+  bool isQuiet() { return quiet; }
+  void listenTcp(uint16_t port) { listen(port); }
+  std::vector<std::shared_ptr<Connection> >& allConnections() { return connections; }
+  uint8_t pinLevel(uint8_t pin) { return pins[pin]; }
+  void setIsr(uint8_t irq, void (*isr)(), int mode) { if(irq < 2){ isrs[irq] = isr; isrModes[irq] = mode; } }
+  void eepromWritten() { ++eepromWrites; eepromSave(); }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Arduino core                                                           */
+/* ---------------------------------------------------------------------- */
+
+unsigned long millis()
+{
+  sim::advance(SIM_CALL_COST);
+  return sim::now() / 1000;
+}
+
+unsigned long micros()
+{
+  sim::advance(SIM_CALL_COST);
+  return sim::now();
+}
+
+void delay(unsigned long ms) { sim::advance((uint64_t)ms * 1000); }
+
+// Timer 0 overflows every 1024 us at 16 MHz, the interrupt ends the sleep
+void sleep_cpu()
+{
+  sim::advance(SIM_TICK_US - sim::now() % SIM_TICK_US);
+  ++sim::sleeps;
+}
+void delayMicroseconds(unsigned int us) { sim::advance(us); }
+
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  if(sim::traceGpio && sim::pinLevel(pin) != val){
+    sim::Edge e = { sim::now(), pin, val };
+    sim::gpioTrace.push_back(e);
+  }
+  sim::pins[pin] = val;
+}
+
+int digitalRead(uint8_t pin) { return sim::pins[pin]; }
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode) { sim::setIsr(interrupt, isr, mode); }
+void detachInterrupt(uint8_t interrupt) { sim::setIsr(interrupt, NULL, 0); }
+
+static unsigned long randState = 1;
+void randomSeed(unsigned long seed) { if(seed) randState = seed; }
+long random(long max)
+{
+  randState = randState * 1103515245UL + 12345UL;
+  return max ? (long)((randState >> 16) % (unsigned long)max) : 0;
+}
+long random(long min, long max) { return min >= max ? min : min + random(max - min); }
+
+static char* convert(unsigned long value, char* str, int base, bool negative)
+{
+  char tmp[33];
+  int i = 0;
+  do {
+    int d = value % base;
+    tmp[i++] = d < 10 ? '0' + d : 'a' + d - 10;
+    value /= base;
+  } while(value);
+  char* p = str;
+  if(negative)
+    *p++ = '-';
+  while(i)
+    *p++ = tmp[--i];
+  *p = '\0';
+  return str;
+}
+
+char* itoa(int value, char* str, int base) { return ltoa(value, str, base); }
+char* ltoa(long value, char* str, int base)
+{
+  bool negative = value < 0 && base == 10;
+  return convert(negative ? -(unsigned long)value : (unsigned long)value, str, base, negative);
+}
+char* utoa(unsigned int value, char* str, int base) { return convert(value, str, base, false); }
+char* ultoa(unsigned long value, char* str, int base) { return convert(value, str, base, false); }
+
+/* Print */
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+  size_t n = 0;
+  while(size--)
+    n += write(*buffer++);
+  return n;
+}
+
+size_t Print::printNumber(unsigned long n, int base)
+{
+  char buf[8 * sizeof(long) + 1];
+  return write(ultoa(n, buf, base));
+}
+
+size_t Print::print(const __FlashStringHelper* s) { return write(reinterpret_cast<const char*>(s)); }
+size_t Print::print(const String& s) { return write(s.c_str(), s.length()); }
+size_t Print::print(const char s[]) { return write(s); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(unsigned char n, int base) { return printNumber(n, base); }
+size_t Print::print(int n, int base) { return print((long)n, base); }
+size_t Print::print(unsigned int n, int base) { return printNumber(n, base); }
+size_t Print::print(long n, int base)
+{
+  if(n < 0 && base == 10)
+    return print('-') + printNumber(-(unsigned long)n, base);
+  return printNumber(n, base);
+}
+size_t Print::print(unsigned long n, int base) { return printNumber(n, base); }
+size_t Print::print(double n, int digits)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+size_t Print::print(const Printable& x) { return x.printTo(*this); }
+
+size_t Print::println() { return write("\r\n"); }
+size_t Print::println(const __FlashStringHelper* s) { return print(s) + println(); }
+size_t Print::println(const String& s) { return print(s) + println(); }
+size_t Print::println(const char s[]) { return print(s) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char n, int base) { return print(n, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+size_t Print::println(double n, int digits) { return print(n, digits) + println(); }
+size_t Print::println(const Printable& x) { return print(x) + println(); }
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  if(!sim::isQuiet())
+    fputc(c, stderr);
+  return 1;
+}
+
+size_t IPAddress::printTo(Print& p) const
+{
+  size_t n = 0;
+  for(int i = 0; i < 3; ++i){
+    n += p.print(mAddr[i], DEC);
+    n += p.print('.');
+  }
+  return n + p.print(mAddr[3], DEC);
+}
+
+/* EEPROM */
+
+uint8_t EEPROMClass::read(int address)
+{
+  ++sim::eepromReads;
+  return (address >= 0 && address <= E2END) ? sim::eeprom[address] : 0xFF;
+}
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+  if(address < 0 || address > E2END)
+    return;
+  sim::eeprom[address] = value;
+  sim::advance(3300); // One EEPROM cell takes 3.3 ms on the AVR
+  sim::eepromWritten();
+}
+
+/* Ethernet */
+
+int EthernetClass::begin(uint8_t* mac, unsigned long timeout, unsigned long responseTimeout)
+{
+  (void)mac; (void)timeout; (void)responseTimeout;
+  mIp = sim::dhcpAddress;
+  mGateway = mDns = IPAddress(192, 168, 1, 1);
+  mSubnet = IPAddress(255, 255, 255, 0);
+  return sim::dhcpServer ? 1 : 0;
+}
+
+void EthernetClass::begin(uint8_t* mac, IPAddress ip) { begin(mac, ip, IPAddress(ip[0], ip[1], ip[2], 1)); }
+void EthernetClass::begin(uint8_t* mac, IPAddress ip, IPAddress dns) { begin(mac, ip, dns, IPAddress(ip[0], ip[1], ip[2], 1)); }
+void EthernetClass::begin(uint8_t* mac, IPAddress ip, IPAddress dns, IPAddress gateway)
+{
+  begin(mac, ip, dns, gateway, IPAddress(255, 255, 255, 0));
+}
+void EthernetClass::begin(uint8_t* mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet)
+{
+  (void)mac;
+  mIp = ip;
+  mDns = dns;
+  mGateway = gateway;
+  mSubnet = subnet;
+}
+
+void EthernetServer::begin() { sim::listenTcp(mPort); }
+
+EthernetClient EthernetServer::available()
+{
+  sim::pollSockets();
+  std::vector<std::shared_ptr<sim::Connection> >& conns = sim::allConnections();
+  for(size_t i = 0; i < conns.size(); ++i){
+    sim::Connection& c = *conns[i];
+    if(c.port == mPort && c.open && (!c.rx.empty() || (c.accepted && c.peerClosed))){
+      c.accepted = true;
+      return EthernetClient(conns[i]);
+    }
+  }
+  return EthernetClient();
+}
+
+size_t EthernetServer::write(uint8_t b) { return write(&b, 1); }
+
+size_t EthernetServer::write(const uint8_t* buf, size_t size)
+{
+  std::vector<std::shared_ptr<sim::Connection> >& conns = sim::allConnections();
+  for(size_t i = 0; i < conns.size(); ++i)
+    if(conns[i]->port == mPort && conns[i]->open && conns[i]->accepted)
+      EthernetClient(conns[i]).write(buf, size);
+  return size;
+}
+
+uint8_t EthernetClient::connected()
+{
+  if(!mConn || !mConn->open)
+    return 0;
+  if(mConn->fd >= 0)
+    sim::pollSockets();
+  return !mConn->peerClosed || !mConn->rx.empty();
+}
+
+int EthernetClient::available()
+{
+  if(!mConn || !mConn->open)
+    return 0;
+  if(mConn->fd >= 0 && mConn->rx.empty())
+    sim::pollSockets();
+  return mConn->rx.size();
+}
+
+int EthernetClient::read()
+{
+  if(!available())
+    return -1;
+  uint8_t b = mConn->rx.front();
+  mConn->rx.pop_front();
+  return b;
+}
+
+int EthernetClient::read(uint8_t* buf, size_t size)
+{
+  size_t n = 0;
+  while(n < size && available())
+    buf[n++] = read();
+  return n ? (int)n : -1;
+}
+
+int EthernetClient::peek() { return available() ? mConn->rx.front() : -1; }
+
+size_t EthernetClient::write(uint8_t b) { return write(&b, 1); }
+
+size_t EthernetClient::write(const uint8_t* buf, size_t size)
+{
+  if(!mConn || !mConn->open)
+    return 0;
+  mConn->tx.append((const char*)buf, size);
+  if(mConn->fd >= 0 && ::write(mConn->fd, buf, size) < 0 && errno != EAGAIN)
+    mConn->peerClosed = true;
+  return size;
+}
+
+int EthernetClient::availableForWrite() { return mConn && mConn->open ? 2048 : 0; }
+
+IPAddress EthernetClient::remoteIP() { return IPAddress(127, 0, 0, 1); }
+
+void EthernetClient::stop()
+{
+  if(!mConn)
+    return;
+  mConn->open = false;
+  if(mConn->fd >= 0){
+    close(mConn->fd);
+    mConn->fd = -1;
+  }
+  mConn.reset();
+}
+
+EthernetClient::operator bool() { return mConn && mConn->open; }
+
+/* UDP */
+
+namespace sim {
+  void registerUdp(EthernetUDP* s);
+  void pollLan();
+  void unregisterUdp(EthernetUDP* s);
+  void sendUdp(EthernetUDP* from, IPAddress ip, uint16_t port, const std::vector<uint8_t>& data);
+}
+
+uint8_t EthernetUDP::begin(uint16_t port)
+{
+  mPort = port;
+  sim::registerUdp(this);
+  return 1;
+}
+
+void EthernetUDP::stop()
+{
+  sim::unregisterUdp(this);
+  mQueue.clear();
+  mQueueIp.clear();
+  mQueuePort.clear();
+}
+
+int EthernetUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+  mDestIp = ip;
+  mDestPort = port;
+  mOut.clear();
+  return 1;
+}
+
+size_t EthernetUDP::write(uint8_t b)
+{
+  mOut.push_back(b);
+  return 1;
+}
+
+size_t EthernetUDP::write(const uint8_t* buf, size_t size)
+{
+  mOut.insert(mOut.end(), buf, buf + size);
+  return size;
+}
+
+int EthernetUDP::endPacket()
+{
+  std::vector<uint8_t> data;
+  data.swap(mOut);
+  sim::sendUdp(this, mDestIp, mDestPort, data);
+  return 1;
+}
+
+void EthernetUDP::deliver(IPAddress from, uint16_t fromPort, const std::vector<uint8_t>& data)
+{
+  mQueue.push_back(data);
+  mQueueIp.push_back(from);
+  mQueuePort.push_back(fromPort);
+}
+
+int EthernetUDP::parsePacket()
+{
+  sim::pollLan();
+  mIn.clear();
+  mReadPos = 0;
+  if(mQueue.empty())
+    return 0;
+  mIn = mQueue.front();
+  mRemoteIp = mQueueIp.front();
+  mRemotePort = mQueuePort.front();
+  mQueue.erase(mQueue.begin());
+  mQueueIp.erase(mQueueIp.begin());
+  mQueuePort.erase(mQueuePort.begin());
+  return mIn.size();
+}
+
+int EthernetUDP::available() { return mIn.size() - mReadPos; }
+
+int EthernetUDP::read() { return mReadPos < mIn.size() ? mIn[mReadPos++] : -1; }
+
+int EthernetUDP::read(unsigned char* buf, size_t len)
+{
+  size_t n = 0;
+  while(n < len && mReadPos < mIn.size())
+    buf[n++] = mIn[mReadPos++];
+  return n;
+}
+
+int EthernetUDP::peek() { return mReadPos < mIn.size() ? mIn[mReadPos] : -1; }
+
+void EthernetUDP::flush() { mReadPos = mIn.size(); }
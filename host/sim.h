@@ -0,0 +1,82 @@
+#ifndef SIM_H
+#define SIM_H
+
+/*
+ * Host simulation of the board the firmware runs on.
+ *
+ * Time only moves when the firmware asks for it: every millis()/micros()
+ * call costs SIM_CALL_COST us and delay()/delayMicroseconds() advance the
+ * clock by the requested amount, so runs are reproducible. sleep_cpu()
+ * moves it to the next timer 0 tick.
+ *
+ * Environment:
+ *   SIM_EEPROM=<file>  Load EEPROM from and save it to <file>
+ *   SIM_LISTEN=<port>  Accept real TCP connections on 127.0.0.1:<port>
+ *   SIM_QUIET=1        Drop Serial output
+ *   SIM_EPOCH=<unix>   Time the fake NTP server reports at sim start
+ *   SIM_LAN=<port>     Share the LAN with other sim processes over UDP on
+ *                      127.0.0.1:<port>..<port>+SIM_LAN_NODES-1 (default 4)
+ *   SIM_NODE=<n>       This process is node n, address 192.168.1.151+n
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define SIM_CALL_COST 4 // us per millis()/micros() call
+#define SIM_TICK_US 1024 // Timer 0 overflow, wakes sleep_cpu()
+
+namespace sim {
+
+  // Clock
+  uint64_t now();                 // Simulated us since start
+  void advance(uint64_t us);
+  extern unsigned long sleeps;    // sleep_cpu() calls
+
+  // EEPROM
+  extern uint8_t eeprom[E2END + 1];
+  extern unsigned long eepromReads;
+  extern unsigned long eepromWrites;
+  void eepromErase();
+
+  // GPIO
+  struct Edge {
+    uint64_t t;
+    uint8_t pin;
+    uint8_t level;
+  };
+  extern bool traceGpio;
+  extern std::vector<Edge> gpioTrace;
+  void setPin(uint8_t pin, uint8_t level); // Drive an input, runs attached ISRs
+  void playPin(const std::vector<Edge>& edges); // setPin() each edge when the clock reaches its t
+  uint64_t airTime(uint8_t pin, uint64_t maxGap); // Sum of bursts in trace
+
+  // TCP
+  struct Connection {
+    uint16_t port;
+    std::deque<uint8_t> rx; // Client -> firmware
+    std::string tx;         // Firmware -> client
+    bool open;              // Firmware has not called stop()
+    bool peerClosed;        // Client closed its side
+    bool accepted;          // Handed out by EthernetServer::available()
+    int fd;                 // Real socket, or -1
+  };
+  std::shared_ptr<Connection> connect(uint16_t port, const std::string& data = "");
+  void pollSockets();
+
+  // Fake peers on the UDP bus
+  extern unsigned long epoch;   // Unix time at sim start, reported by NTP
+  extern bool ntpServer;
+  extern bool dhcpServer;
+  extern IPAddress dhcpAddress; // Address handed out by the fake DHCP server
+  extern unsigned long ntpRequests;
+  extern unsigned long dhcpRequests;
+
+  void init(); // Reads environment, called before setup()
+}
+
+#endif
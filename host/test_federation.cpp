@@ -0,0 +1,173 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * A site of three units, each a smarthome_sim process running in real
+ * time with its own TCP port, on one LAN bridged over localhost UDP
+ * (SIM_LAN). Commands go to any unit, the switches are on different ones.
+ */
+
+#define NODES 3
+#define WAIT_MS 5000
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)){ fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+static int tcpPort;
+static int lanPort;
+static pid_t pids[NODES];
+
+static void start(int node)
+{
+  pids[node] = fork();
+  if(pids[node] != 0)
+    return;
+  char value[16];
+  snprintf(value, sizeof(value), "%d", tcpPort + node);
+  setenv("SIM_LISTEN", value, 1);
+  snprintf(value, sizeof(value), "%d", lanPort);
+  setenv("SIM_LAN", value, 1);
+  snprintf(value, sizeof(value), "%d", node);
+  setenv("SIM_NODE", value, 1);
+  snprintf(value, sizeof(value), "%d", NODES);
+  setenv("SIM_LAN_NODES", value, 1);
+  setenv("SIM_QUIET", "1", 1);
+  setenv("SIM_RUN_SECONDS", "120", 1); // In case we are gone
+  execl("./smarthome_sim", "smarthome_sim", (char*)NULL);
+  perror("test_federation: smarthome_sim");
+  _exit(127);
+}
+
+static unsigned long wallMillis()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+// Request line to a unit, its reply once it closes the connection
+static std::string ask(int node, const std::string& line)
+{
+  unsigned long start = wallMillis();
+  int fd = -1;
+  while(wallMillis() - start < WAIT_MS){
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcpPort + node);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0)
+      break;
+    close(fd);
+    fd = -1;
+    usleep(50000); // Still starting
+  }
+  if(fd < 0)
+    return "";
+  struct timeval timeout = { WAIT_MS / 1000, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  std::string out = line + "\n";
+  if(write(fd, out.data(), out.size()) != (ssize_t)out.size()){
+    close(fd);
+    return "";
+  }
+  std::string reply;
+  char buf[512];
+  ssize_t n;
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    reply.append(buf, n);
+  close(fd);
+  return reply;
+}
+
+// Ask until the reply has expect in it
+static bool eventually(int node, const std::string& line, const std::string& expect)
+{
+  unsigned long start = wallMillis();
+  while(wallMillis() - start < WAIT_MS){
+    if(ask(node, line).find(expect) != std::string::npos)
+      return true;
+    usleep(100000);
+  }
+  fprintf(stderr, "unit %d never replied %s to %s\n", node, expect.c_str(), line.c_str());
+  return false;
+}
+
+int main()
+{
+  tcpPort = 20000 + getpid() % 2000 * 16;
+  lanPort = tcpPort + 8;
+  for(int node = 0; node < NODES; ++node)
+    start(node);
+
+  // Each unit owns one switch, and finds the others'
+  CHECK(ask(0, "A:20") == "OK\r\n");
+  CHECK(ask(1, "A:30") == "OK\r\n");
+  CHECK(ask(2, "A:40") == "OK\r\n");
+  CHECK(eventually(0, "G", "30:0:255:"));
+  CHECK(eventually(0, "G", "40:0:255:"));
+  CHECK(eventually(2, "G", "20:0:255:"));
+  CHECK(ask(1, "G").find("30:0:255:0:0:0:0N") == 0); // Own switches first
+
+  // Switching on any unit reaches the owner, and every unit sees it
+  CHECK(ask(2, "S:20:1") == "OK\r\n");
+  CHECK(eventually(0, "G", "20:1:255:"));
+  CHECK(eventually(1, "G", "20:1:255:"));
+
+  // A timer over switches of three units
+  CHECK(ask(1, "T:5:7:30:8:0:20:40:30:") == "OK\r\n");
+  CHECK(eventually(0, "G", "20:1:5:7:30:8:0N"));
+  CHECK(eventually(2, "G", "40:0:5:7:30:8:0N"));
+  CHECK(eventually(1, "G", "30:0:5:7:30:8:0N"));
+  CHECK(eventually(2, "G", "30:0:5:7:30:8:0N"));
+
+  // A timer needing more forwards than the outbox holds is set nowhere
+  for(int id = 41; id <= 53; ++id)
+    CHECK(ask(2, "A:" + std::to_string(id)) == "OK\r\n");
+  CHECK(eventually(0, "G", "53:0:255:"));
+  CHECK(ask(0, "T:7:7:30:8:0:20:41:42:43:44:45:46:47:48:49:50:51:52:53:") == "NOK\r\n");
+  usleep(500000);
+  CHECK(ask(0, "G").find("20:1:5:") != std::string::npos);
+  CHECK(ask(2, "G").find(":7:7:30:8:0N") == std::string::npos);
+
+  // Scenes switch the members other units own through them
+  CHECK(ask(1, "E:6:255:0:20:0:30:1") == "OK\r\n");
+  CHECK(ask(1, "F:6") == "OK\r\n");
+  CHECK(eventually(0, "G", "20:0:5:"));
+  CHECK(ask(1, "G").find("30:1:5:") != std::string::npos);
+
+  // The client is answered once the owner acked, NOK if it never does
+  kill(pids[0], SIGSTOP);
+  CHECK(ask(2, "S:20:0") == "NOK\r\n");
+  CHECK(ask(1, "T:8:9:0:10:0:20:") == "NOK\r\n");
+  kill(pids[0], SIGCONT);
+  CHECK(ask(2, "S:20:0") == "OK\r\n");
+  CHECK(ask(1, "T:8:9:0:10:0:20:") == "OK\r\n");
+  CHECK(eventually(2, "G", "20:0:8:9:0:10:0N"));
+  fprintf(stderr, "0: %s\n1: %s\n", ask(0, "G").c_str(), ask(1, "G").c_str());
+
+  // Switches nobody has are sent with the id as group code, as before
+  CHECK(ask(0, "S:99:1") == "OK\r\n");
+
+  for(int node = 0; node < NODES; ++node){
+    kill(pids[node], SIGTERM);
+    waitpid(pids[node], NULL, 0);
+  }
+  if(failures){
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("Federation OK\n");
+  return 0;
+}
@@ -0,0 +1,463 @@
+#include "sim.h"
+#include <RCReceive.h>
+#include <AVL_tree.h>
+#include <SceneStore.h>
+#include <DHCPLease.h>
+#include <TimerSchedule.h>
+#include <Snapshot.h>
+#include <CoopScheduler.h>
+#include <PerfStats.h>
+#include <algorithm>
+
+/*
+ * End to end checks of the firmware over the simulated network.
+ * Each request opens a connection, runs loop() until the firmware closes
+ * it and returns what it replied.
+ */
+
+static int failures = 0;
+
+// As in smarthome.ino
+#define TIMER_RULE_ADDR (E2END + 1 - DHCP_LEASE_SIZE - SCENE_AREA_SIZE - TIMER_RULE_AREA_SIZE)
+
+#define CHECK(cond) do { if(!(cond)){ fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+static std::string request(const std::string& line)
+{
+  std::shared_ptr<sim::Connection> c = sim::connect(8888, line + "\n");
+  for(int i = 0; i < 100000 && c->open; ++i)
+    loop();
+  return c->tx;
+}
+
+// 'Y' with the image after the line
+static std::string restore(const std::string& image)
+{
+  std::shared_ptr<sim::Connection> c = sim::connect(8888, "Y\n" + image);
+  for(int i = 0; i < 100000 && c->open; ++i)
+    loop();
+  return c->tx;
+}
+
+static std::string datagram(EthernetUDP& udp)
+{
+  std::string data;
+  if(udp.parsePacket() > 0)
+    while(udp.available())
+      data += char(udp.read());
+  return data;
+}
+
+static void runFor(uint64_t us)
+{
+  uint64_t end = sim::now() + us;
+  while(sim::now() < end)
+    loop();
+}
+
+extern RCReceive receiver;
+extern CoopScheduler scheduler;
+extern TimerSchedule schedule;
+
+// Edges of a remote sending what RCTransmit sends, from 20 ms on
+static std::vector<sim::Edge> remote(int controller, bool status)
+{
+  static RCTransmit remote(11);
+  size_t first = sim::gpioTrace.size();
+  if(status)
+    remote.switchOn(controller, 2, false, RC_P2_DEVICE);
+  else
+    remote.switchOff(controller, 2, false, RC_P2_DEVICE);
+  std::vector<sim::Edge> edges(sim::gpioTrace.begin() + first, sim::gpioTrace.end());
+  sim::gpioTrace.resize(first);
+  uint64_t sent = edges.empty() ? 0 : edges[0].t;
+  for(size_t i = 0; i < edges.size(); ++i){
+    edges[i].t = sim::now() + 20000 + edges[i].t - sent;
+    edges[i].pin = 2;
+  }
+  return edges;
+}
+
+// Played on the receive pin (2)
+static void press(int controller, bool status)
+{
+  std::vector<sim::Edge> edges = remote(controller, status);
+  for(size_t i = 0; i < edges.size(); ++i){
+    if(edges[i].t > sim::now())
+      sim::advance(edges[i].t - sim::now());
+    sim::setPin(2, edges[i].level);
+    receiver.poll(); // Keeps up with the edges, as rfTask does between slices
+  }
+  runFor(500000);
+}
+
+int main()
+{
+  sim::init();
+  // The 8 bit id layout without switches, its scenes are moved
+  sim::eeprom[0] = 0;
+  const byte v1Scene[] = { 7, 1, 1, SCENE_NO_TIME, 0, 12 };
+  memcpy(sim::eeprom + E2END + 1 - DHCP_LEASE_SIZE - SCENE_V1_AREA_SIZE, v1Scene, sizeof(v1Scene));
+  sim::traceGpio = true;
+  setup();
+  CHECK(scheduler.refused() == 0); // Every task fits in MAX_TASKS
+  {
+    CoopScheduler full;
+    for(byte i = 0; i < MAX_TASKS; ++i)
+      full.add(loop, 1000, 1000);
+    CHECK(full.add(loop, 1000, 1000) == MAX_TASKS && full.refused() == 1);
+  }
+  {
+    // A reset before loop() boots the new layout, and moves nothing again
+    AVL_tree again(40);
+    CHECK(!again.Upgraded() && sim::eeprom[0] == TREE_FORMAT);
+  }
+  CHECK(request("K:7") == "OK\r\n");
+  CHECK(request("K:7") == "NOK\r\n");
+
+  CHECK(request("C") == "OK\r\n");
+  CHECK(request("A:12") == "OK\r\n");
+  CHECK(request("A:13") == "OK\r\n");
+  CHECK(request("M").find("N2:73N\r\n") != std::string::npos); // Switches and capacity
+  CHECK(request("A:0") == "NOK\r\n");
+  CHECK(request("A:65535") == "NOK\r\n");
+  CHECK(request("G") == "12:0:255:0:0:0:0N13:0:255:0:0:0:0N");
+  CHECK(request("Z") == "NO SUCH COMMAND EXIST\r\n");
+
+  // Switching replies before the RF frames go out
+  size_t edges = sim::gpioTrace.size();
+  CHECK(request("S:12:1") == "OK\r\n");
+  CHECK(request("G") == "12:1:255:0:0:0:0N13:0:255:0:0:0:0N");
+  runFor(2000000);
+  CHECK(sim::gpioTrace.size() > edges);
+
+  // Repeats of a command are merged or dropped instead of sent again
+  CHECK(request("O") == "1:0:0:0\r\n");
+  CHECK(request("S:12:1") == "OK\r\n"); // Sent under 2 s ago, dropped
+  CHECK(request("S:12:0") == "OK\r\n"); // On air from the next frame
+  CHECK(request("S:12:1") == "OK\r\n"); // Waits behind it
+  CHECK(request("S:12:0") == "OK\r\n"); // Cancels the waiting one
+  CHECK(request("S:13:1") == "OK\r\n");
+  CHECK(request("S:13:0") == "OK\r\n"); // Replaces the waiting one
+  runFor(3000000);
+  CHECK(request("O") == "4:2:1:0\r\n");
+
+  // Scheduler stats end with the longest slice, the time slept and the lease
+  {
+    std::string stats = request("P");
+    CHECK(std::count(stats.begin(), stats.end(), 'N') == scheduler.count() + 1);
+    unsigned long slice, idle, bound;
+    size_t last = stats.rfind('N', stats.size() - 4);
+    CHECK(sscanf(stats.c_str() + last + 1, "%lu:%lu:%luN", &slice, &idle, &bound) == 3);
+    CHECK(slice > 0 && idle > 0 && bound == 1);
+  }
+
+  // Slices are timed, a full bucket halves the probe's histogram
+  std::string perf = request("I");
+  CHECK(std::count(perf.begin(), perf.end(), 'N') == PERF_PROBES);
+  CHECK(PerfStats::histogram(PERF_LOOP).count > 0);
+  PerfStats::reset();
+  for(int i = 0; i < 300; ++i)
+    PerfStats::record(PERF_RF_SEND, 40000);
+  PerfStats::record(PERF_RF_SEND, 200000);
+  const PerfHistogram& rf = PerfStats::histogram(PERF_RF_SEND);
+  CHECK(rf.count == 301 && rf.max == 0xFFFF);
+  CHECK(rf.buckets[6] == 300 - 128 && rf.buckets[7] == 1);
+  PerfStats::reset();
+  CHECK(request("G") == "12:0:255:0:0:0:0N13:0:255:0:0:0:0N");
+
+  // Changes reach EEPROM in the background
+  CHECK(sim::eeprom[0] == TREE_FORMAT && sim::eeprom[2] == 2);
+  CHECK(request("R:13") == "OK\r\n");
+  runFor(1000000);
+  CHECK(sim::eeprom[2] == 1);
+  CHECK(sim::eeprom[3] == 0 && sim::eeprom[4] == 12);
+
+  // The fake NTP server starts at 14:00 local time, switch on at 14:01
+  CHECK(request("T:1:14:1:15:0:12:") == "OK\r\n");
+  CHECK(request("S:12:0") == "OK\r\n");
+  runFor(90000000);
+  CHECK(request("G") == "12:1:1:14:1:15:0N");
+
+  // Only what changed after a known sequence is sent again
+  std::string full = request("D:0");
+  unsigned int seq = atoi(full.c_str());
+  CHECK(full == std::to_string(seq) + ":FN12:1:1:14:1:15:0N\r\n");
+  CHECK(request("S:12:0") == "OK\r\n");
+  CHECK(request("A:14") == "OK\r\n");
+  CHECK(request("D:" + std::to_string(seq)) ==
+	std::to_string(seq + 2) + ":DN12:0:1:14:1:15:0N14:0:255:0:0:0:0N\r\n");
+  CHECK(request("R:14") == "OK\r\n");
+  CHECK(request("D:" + std::to_string(seq + 2)) == std::to_string(seq + 3) + ":DN14:-1N\r\n");
+
+  // Conditional G, the sequence above is the tree generation
+  unsigned int gen = seq + 3;
+  CHECK(request("G:" + std::to_string(gen)) == std::to_string(gen) + ":UN\r\n");
+  CHECK(request("Q:1") == "OK\r\n");
+  CHECK(request("G:" + std::to_string(gen)) ==
+	std::to_string(gen + 1) + ":DN12:0:255:14:1:15:0:" + std::to_string(gen + 1) + "N\r\n");
+  CHECK(request("G:" + std::to_string(gen - 1)) ==
+	std::to_string(gen + 1) + ":FN12:0:255:14:1:15:0:" + std::to_string(gen + 1) + "N\r\n");
+  CHECK(request("G:0").compare(0, 4, std::to_string(gen + 1) + ":F") == 0);
+  seq = gen + 1;
+
+  // Subscribed apps get the changes pushed
+  runFor(200000);
+  EthernetUDP app;
+  app.begin(9000);
+  app.beginPacket(Ethernet.localIP(), 8888);
+  app.write('U');
+  app.endPacket();
+  runFor(200000);
+  CHECK(datagram(app) == std::to_string(seq) + ":RN");
+  CHECK(request("S:12:1") == "OK\r\n");
+  runFor(200000);
+  CHECK(datagram(app) == std::to_string(seq + 1) + ":DN12:1:255:14:1:15:0N");
+  runFor(200000);
+  CHECK(datagram(app) == "");
+
+  // Scenes switch several switches with one command, and at a set time
+  CHECK(request("A:13") == "OK\r\n");
+  CHECK(request("E:3:255:0:12:0:13:1") == "OK\r\n");
+  CHECK(request("E:4:14:5:12:1:13:0") == "OK\r\n");
+  CHECK(request("E:5:255:0:12") == "NOK\r\n");
+  {
+    // Entries past the count are stored as 0, the first slot holds scene 3
+    const uint8_t* entries = sim::eeprom + E2END + 1 - DHCP_LEASE_SIZE - SCENE_AREA_SIZE + SCENE_HEADER_SIZE;
+    CHECK(entries[-SCENE_HEADER_SIZE] == 3 && entries[1] == 12 && entries[3] == 13);
+    CHECK(std::count(entries + 4, entries + 2 * SCENE_MAX_SWITCHES, 0) == 2 * SCENE_MAX_SWITCHES - 4);
+  }
+  runFor(20000000); // RF queue drains
+  CHECK(request("F:3") == "OK\r\n");
+  CHECK(request("G") == "12:0:255:14:1:15:0N13:1:255:0:0:0:0N");
+  CHECK(request("F:9") == "NOK\r\n");
+  runFor(240000000); // Past 14:05
+  CHECK(request("G") == "12:1:255:14:1:15:0N13:0:255:0:0:0:0N");
+  CHECK(request("K:4") == "OK\r\n");
+  CHECK(request("F:4") == "NOK\r\n");
+  CHECK(request("F:3") == "OK\r\n");
+
+  // Weekday rules and one-shot timers, the sim starts on a Monday
+  unsigned int at = 14 * 60 + sim::now() / 60000000 + 2;
+  char line[64];
+  CHECK(request("A:15") == "OK\r\n");
+  CHECK(request("A:16") == "OK\r\n");
+  snprintf(line, sizeof(line), "T:2:%u:%u:%u:%u:15:", at / 60, at % 60, (at + 1) / 60, (at + 1) % 60);
+  CHECK(request(line) == "OK\r\n");
+  CHECK(request("W:2:1:0:0:0:0") == "OK\r\n"); // Sundays
+  snprintf(line, sizeof(line), "T:3:%u:%u:%u:%u:16:", at / 60, at % 60, (at + 5) / 60, (at + 5) % 60);
+  CHECK(request(line) == "OK\r\n");
+  CHECK(request("W:3:130:0:0:0:0") == "OK\r\n"); // Once, on a Monday
+  CHECK(request("W:4:0:0:0:0:0") == "NOK\r\n");
+  runFor(3 * 60000000);
+  std::string state = request("G");
+  CHECK(state.find("15:0:2:") != std::string::npos);
+  CHECK(state.find("16:1:3:") != std::string::npos);
+  runFor(5 * 60000000);
+  state = request("G");
+  CHECK(state.find("16:0:255:") != std::string::npos);
+  // A rule edit is a change of the switches on that timer
+  seq = atoi(request("D:0").c_str());
+  CHECK(request("W:2:2:0:0:0:0") == "OK\r\n"); // Mondays
+  CHECK(request("D:" + std::to_string(seq)).find(std::to_string(seq + 1) + ":DN15:0:2:") == 0);
+  CHECK(request("W:2:127:0:0:0:0") == "OK\r\n"); // Every day, no rule
+  CHECK(request("D:" + std::to_string(seq + 1)).find(std::to_string(seq + 2) + ":DN15:0:2:") == 0);
+
+  // Switches given one timer at different times each keep their own
+  at = 14 * 60 + sim::now() / 60000000 + 2;
+  snprintf(line, sizeof(line), "T:8:%u:%u:%u:%u:15:", at / 60, at % 60, (at + 2) / 60, (at + 2) % 60);
+  CHECK(request(line) == "OK\r\n");
+  snprintf(line, sizeof(line), "T:8:%u:%u:%u:%u:16:", (at + 1) / 60, (at + 1) % 60, (at + 3) / 60, (at + 3) % 60);
+  CHECK(request(line) == "OK\r\n");
+  uint64_t start = (uint64_t)(at - 14 * 60) * 60000000;
+  runFor(start + 110000000 - sim::now()); // at + 1 and the 30 s timer check
+  state = request("G");
+  CHECK(state.find("15:1:8:") != std::string::npos);
+  CHECK(state.find("16:1:8:") != std::string::npos);
+  runFor(60000000);
+  state = request("G");
+  CHECK(state.find("15:0:8:") != std::string::npos);
+  CHECK(state.find("16:1:8:") != std::string::npos);
+  runFor(60000000);
+  CHECK(request("G").find("16:0:8:") != std::string::npos);
+
+  // More timers than the old fixed table of 32 transitions held all fire
+  at = 14 * 60 + sim::now() / 60000000 + 2;
+  for(int id = 40; id < 60; ++id){
+    snprintf(line, sizeof(line), "A:%d", id);
+    CHECK(request(line) == "OK\r\n");
+    snprintf(line, sizeof(line), "T:%d:%u:%u:%u:%u:%d:", id, at / 60, at % 60, (at + 1) / 60, (at + 1) % 60, id);
+    CHECK(request(line) == "OK\r\n");
+  }
+  start = (uint64_t)(at - 14 * 60) * 60000000;
+  runFor(start + 50000000 - sim::now());
+  state = request("G");
+  CHECK(schedule.size() >= 40);
+  CHECK(state.find("40:1:40:") != std::string::npos && state.find("59:1:59:") != std::string::npos);
+  runFor(60000000);
+  state = request("G");
+  CHECK(state.find("40:0:40:") != std::string::npos && state.find("59:0:59:") != std::string::npos);
+  for(int id = 40; id < 60; ++id){
+    snprintf(line, sizeof(line), "R:%d", id);
+    CHECK(request(line) == "OK\r\n");
+  }
+
+  // Timers following the sun, hours 24-27 are offsets from sunrise/sunset
+  CHECK(request("T:5:26:30:27:10:15:") == "OK\r\n");
+  CHECK(request("G").find("15:0:5:26:30:27:10N") != std::string::npos);
+  CHECK(request("T:6:28:0:27:10:15:") == "NOK\r\n");
+  CHECK(request("T:6:25:64:27:10:15:") == "NOK\r\n");
+  CHECK(request("T:6:7:62:8:0:15:") == "NOK\r\n"); // Only sun offsets go past 59
+  CHECK(request("T:6:7:0:8:60:15:") == "NOK\r\n");
+  CHECK(request("T:6:25:63:27:10:15:") == "OK\r\n");
+  CHECK(schedule.minuteOf(7, 62) == TIMER_NO_TIME);
+  // Fields missing
+  CHECK(request("T:1") == "NOK\r\n");
+  CHECK(request("T:1:7:30:8") == "NOK\r\n");
+  CHECK(request("S:13") == "NOK\r\n");
+  CHECK(request("S") == "NOK\r\n");
+  CHECK(request("Q") == "NOK\r\n");
+
+  // Remotes keep the cached status in step, 'L' learns new ones
+  CHECK(request("G").find("13:1:") != std::string::npos);
+  press(13, false);
+  CHECK(request("G").find("13:0:") != std::string::npos);
+  {
+    // Switched back by 'S' right after a remote, that is not a repeat
+    unsigned int queued, merged, dropped, pending;
+    CHECK(request("S:13:1") == "OK\r\n");
+    runFor(600000);
+    press(13, false);
+    sscanf(request("O").c_str(), "%u:%u:%u:%u", &queued, &merged, &dropped, &pending);
+    CHECK(request("S:13:1") == "OK\r\n");
+    unsigned int queued2, merged2, dropped2;
+    sscanf(request("O").c_str(), "%u:%u:%u:%u", &queued2, &merged2, &dropped2, &pending);
+    CHECK(queued2 == queued + 1 && dropped2 == dropped && pending == 1);
+    runFor(1000000);
+    press(13, false);
+  }
+  CHECK(request("L") == "-1\r\n");
+  press(88, true);
+  CHECK(request("L") == "88:2:0:1:15\r\n");
+  CHECK(request("G").find("88:1:255:") != std::string::npos);
+  runFor(31000000); // The 'L' above listens for 30 s
+  press(89, true);
+  CHECK(request("G").find("89:") == std::string::npos);
+
+  // Switches with RF addresses, learned from real remote codes
+  CHECK(request("B:13") == "0:0:0\r\n");
+  CHECK(request("B:13:67108864:1:2") == "NOK\r\n"); // 27 bits
+  CHECK(request("B:13:5000:16:2") == "NOK\r\n");
+  CHECK(request("B:13:5000:3:1") == "OK\r\n");
+  CHECK(request("B:13") == "5000:3:1\r\n");
+  CHECK(request("B:99:5000:3:1") == "NOK\r\n");
+  press(13, true); // The id is no longer its group code
+  CHECK(request("G").find("13:0:") != std::string::npos);
+  CHECK(request("L") == "-1\r\n");
+  press(0x2F00042, true);
+  CHECK(request("L") == "49283138:2:0:1:15\r\n");
+  CHECK(request("G").find("1:1:255:") == 0); // Lowest free id
+  CHECK(request("B:1") == "49283138:15:2\r\n");
+  press(0x2F00042, false);
+  CHECK(request("G").find("1:0:255:") == 0);
+  CHECK(request("B:13:0") == "OK\r\n");
+  CHECK(request("B:13") == "0:0:0\r\n");
+
+  // Remotes heard while slices write EEPROM, one byte per slice
+  CHECK(request("A:2") == "OK\r\n"); // Moves every record
+  unsigned long writes = sim::eepromWrites;
+  unsigned int overruns = receiver.overruns();
+  sim::playPin(remote(13, true));
+  runFor(2000000);
+  CHECK(sim::eepromWrites - writes > 20);
+  CHECK(receiver.overruns() == overruns);
+  CHECK(request("G").find("13:1:") != std::string::npos);
+  CHECK(request("R:2") == "OK\r\n");
+  press(13, false);
+
+  // Dimming, a fade sends the levels the channel has time for and ends on time
+  CHECK(request("V:12") == "15\r\n");
+  CHECK(request("V:12:16") == "NOK\r\n");
+  CHECK(request("V:99:3") == "NOK\r\n");
+  CHECK(request("V:12:4") == "OK\r\n");
+  CHECK(request("V:12") == "4\r\n");
+  CHECK(request("G").find("12:1:") != std::string::npos);
+  runFor(1000000);
+  unsigned int queued, merged, dropped, pending;
+  sscanf(request("O").c_str(), "%u:%u:%u:%u", &queued, &merged, &dropped, &pending);
+  CHECK(request("V:12:14:2") == "OK\r\n");
+  runFor(2000000);
+  unsigned int queued2, merged2, dropped2;
+  sscanf(request("O").c_str(), "%u:%u:%u:%u", &queued2, &merged2, &dropped2, &pending);
+  CHECK(pending == 0);
+  CHECK(merged2 > merged); // More steps than air time
+  CHECK(queued2 - queued > 1 && queued2 - queued < 10);
+  CHECK(request("V:12") == "14\r\n");
+  press(12, false);
+  CHECK(request("G").find("12:0:") != std::string::npos);
+
+  // A snapshot restores switches, timers and timer rules in one request
+  runFor(1000000);
+  std::string before = request("G");
+  std::string image = request("X");
+  CHECK(image.size() == SNAPSHOT_SIZE(6));
+  CHECK((byte)image[0] == SNAPSHOT_MAGIC && (byte)image[2] == TREE_FORMAT && image[4] == 6);
+  std::string rules((char*)sim::eeprom + TIMER_RULE_ADDR, TIMER_RULE_AREA_SIZE);
+  CHECK(request("W:9:1:0:0:0:0") == "OK\r\n");
+  CHECK(request("R:13") == "OK\r\n");
+  CHECK(request("A:77") == "OK\r\n");
+  seq = atoi(request("D:0").c_str());
+  CHECK(restore(image) == "OK\r\n");
+  CHECK(request("G") == before);
+  CHECK(request("X") == image);
+  CHECK(std::string((char*)sim::eeprom + TIMER_RULE_ADDR, TIMER_RULE_AREA_SIZE) == rules);
+  CHECK(request("D:" + std::to_string(seq)).find(":FN") != std::string::npos);
+  // A bad image changes nothing
+  CHECK(request("R:13") == "OK\r\n");
+  CHECK(request("W:9:1:0:0:0:0") == "OK\r\n");
+  std::string removed = request("G");
+  std::string newRules((char*)sim::eeprom + TIMER_RULE_ADDR, TIMER_RULE_AREA_SIZE);
+  std::string bad = image;
+  bad[SNAPSHOT_HEADER_SIZE + TREE_HEADER_SIZE + 1] ^= 1; // In the first record
+  CHECK(restore(bad) == "NOK\r\n");
+  CHECK(restore(image.substr(0, image.size() / 2)) == "NOK\r\n"); // Times out
+  runFor(1000000);
+  CHECK(request("G") == removed);
+  CHECK(sim::eeprom[0] == TREE_FORMAT && sim::eeprom[2] == 5);
+  CHECK(std::string((char*)sim::eeprom + TIMER_RULE_ADDR, TIMER_RULE_AREA_SIZE) == newRules);
+  CHECK(restore(image) == "OK\r\n");
+  CHECK(request("G") == before);
+
+  // G:B has the on/off of every switch as bits in id order
+  std::string bits = request("G:B");
+  std::vector<int> status;
+  for(size_t at = 0; at < before.size(); at = before.find('N', at) + 1)
+    status.push_back(before[before.find(':', at) + 1] - '0');
+  CHECK(status.size() == 6 && bits.size() == 4 + 1);
+  CHECK(bits[2] == 0 && bits[3] == 6);
+  for(size_t i = 0; i < status.size(); ++i)
+    CHECK(((bits[4] >> i) & 1) == status[i]);
+  CHECK(request("S:16:1") == "OK\r\n"); // Fifth
+  std::string on = request("G:B");
+  CHECK(on.compare(0, 4, bits, 0, 4) == 0 && on[4] == (bits[4] | 1 << 4));
+  CHECK(request("A:77") == "OK\r\n");
+  std::string added = request("G:B");
+  CHECK(added.compare(0, 2, bits, 0, 2) != 0 && added[3] == 7 && added.size() == 5);
+  CHECK(request("R:77") == "OK\r\n");
+
+  // With nothing queued the MCU sleeps between ticks, and still answers within a network period
+  runFor(1000000);
+  unsigned long sleeps = sim::sleeps;
+  runFor(1000000);
+  CHECK(sim::sleeps - sleeps > 900);
+  uint64_t asked = sim::now();
+  CHECK(request("G").find("12:0:") != std::string::npos);
+  CHECK(sim::now() - asked < 10000);
+
+  if(failures){
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("firmware OK\n");
+  return 0;
+}
@@ -0,0 +1,157 @@
+#include "sim.h"
+#include <RCTransmit.h>
+#include <RCReceive.h>
+
+/*
+ * RCReceive against pulse trains synthesized with RCTransmit: its
+ * output pin is traced, and the edges are played back on the receive
+ * pin with the same timing, through the pin change interrupt.
+ */
+
+#define TX_PIN 11
+#define RX_PIN 2
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)){ fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+static RCTransmit transmitter(TX_PIN);
+static RCReceive receiver(RX_PIN);
+
+// Edges of one transmission, each as the time since the one before
+static std::vector<sim::Edge> trace()
+{
+  std::vector<sim::Edge> edges = sim::gpioTrace;
+  for(size_t i = edges.size(); i-- > 1; )
+    edges[i].t -= edges[i - 1].t;
+  if(!edges.empty())
+    edges[0].t = 20000; // Quiet before the first sync
+  return edges;
+}
+
+static std::vector<sim::Edge> record(int controller, byte protocol, bool status, bool group, int device)
+{
+  sim::gpioTrace.clear();
+  if(status)
+    transmitter.switchOn(controller, protocol, group, device);
+  else
+    transmitter.switchOff(controller, protocol, group, device);
+  return trace();
+}
+
+static std::vector<sim::Edge> recordDim(int controller, byte level)
+{
+  sim::gpioTrace.clear();
+  transmitter.queueDim(controller, level);
+  while(transmitter.pending())
+    transmitter.poll();
+  sim::advance(RC_DEDUP_WINDOW * 1000UL); // The next one is not a repeat
+  return trace();
+}
+
+/*
+ * Play edges on the receive pin. jitter moves every edge up to that
+ * many us, skip drops every skip:th edge. The decoder runs after each
+ * edge, as it would between slices on the board.
+ */
+static void play(const std::vector<sim::Edge>& edges, int jitter = 0, size_t skip = 0)
+{
+  for(size_t i = 0; i < edges.size(); ++i){
+    long t = edges[i].t;
+    if(jitter)
+      t += random(-jitter, jitter + 1);
+    sim::advance(t > 0 ? t : 1);
+    if(skip && i % skip == skip - 1)
+      continue;
+    sim::setPin(RX_PIN, edges[i].level);
+    receiver.poll();
+  }
+  sim::advance(500000); // Next press is a new one
+  receiver.poll();
+}
+
+static int received(RCCommand* commands, int max)
+{
+  int n = 0;
+  while(n < max && receiver.read(commands[n]))
+    ++n;
+  return n;
+}
+
+int main()
+{
+  sim::init();
+  sim::traceGpio = true;
+  pinMode(TX_PIN, OUTPUT);
+  receiver.begin();
+  RCCommand got[4];
+
+  // Protocol 2 as 'S' sends it, reported once for all repeats
+  play(record(13, 2, true, false, RC_P2_DEVICE));
+  CHECK(received(got, 4) == 1);
+  CHECK(got[0].controller == 13 && got[0].protocol == 2 && got[0].status && !got[0].group);
+  CHECK(got[0].device == 15); // Channel and button code 3
+
+  // Real remote codes, 26 bit group code and any unit
+  play(record(0x3ABCDEF, 2, false, true, 6));
+  CHECK(received(got, 4) == 1);
+  CHECK(got[0].controller == 0x3ABCDEFUL && !got[0].status && got[0].group && got[0].device == 6);
+
+  // Protocol 1 as timers send it
+  play(record(1000, 1, false, true, 5));
+  CHECK(received(got, 4) == 1);
+  CHECK(got[0].controller == 1000 && got[0].protocol == 1 && !got[0].status && got[0].group);
+  CHECK(got[0].device == 5);
+
+  // Two presses are two commands
+  std::vector<sim::Edge> on = record(42, 2, true, false, 0);
+  play(on);
+  play(on);
+  CHECK(received(got, 4) == 2);
+
+  // Receiver jitter
+  randomSeed(7);
+  play(record(77, 2, false, false, 0), 80);
+  CHECK(received(got, 4) == 1);
+  CHECK(got[0].controller == 77 && !got[0].status);
+
+  // Dim frames carry the level, and differ from on/off frames
+  play(recordDim(42, 9));
+  CHECK(received(got, 4) == 1);
+  CHECK(got[0].controller == 42 && got[0].protocol == 2 && got[0].status);
+  CHECK(got[0].level == 9 && got[0].device == 15);
+  play(recordDim(42, 0));
+  play(record(42, 2, true, false, 0));
+  CHECK(received(got, 4) == 2);
+  CHECK(got[0].level == 0 && got[1].level == RC_NO_LEVEL);
+
+  // Frames with lost edges are not reported
+  play(record(77, 2, true, false, 0), 0, 50);
+  CHECK(received(got, 4) == 0);
+
+  // Noise between frames does not start a frame
+  std::vector<sim::Edge> noise;
+  for(int i = 0; i < 400; ++i){
+    sim::Edge e = { (uint64_t)(50 + random(3000)), RX_PIN, (uint8_t)(i & 1 ? LOW : HIGH) };
+    noise.push_back(e);
+  }
+  play(noise);
+  CHECK(received(got, 4) == 0);
+  CHECK(receiver.overruns() == 0);
+
+  // Nothing is heard while muted, however long, and it is no overrun
+  receiver.mute(true);
+  play(record(55, 2, true, false, 0));
+  receiver.mute(false);
+  CHECK(received(got, 4) == 0);
+  CHECK(receiver.overruns() == 0);
+  play(record(55, 2, false, false, 0));
+  CHECK(received(got, 4) == 1 && got[0].controller == 55 && !got[0].status);
+
+  if(failures){
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("RCReceive OK\n");
+  return 0;
+}
@@ -0,0 +1,155 @@
+#include <Arduino.h>
+#include <AVL_tree.h>
+#include <TreeRecord.h>
+
+/*
+ * The EEPROM record codec generated from TreeLayout, every value of
+ * every field, on top of nodes with the other fields all clear and all
+ * set. Records are compared with the hand-written codec it replaced, so
+ * EEPROMs saved before still load.
+ */
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)){ fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+enum Field { ID, ADDRESS, TIMER, STATUS, ON_HOUR, ON_MINUTE, OFF_HOUR, OFF_MINUTE, FIELDS };
+
+static const char* names[FIELDS] = { "id", "address", "timer", "status", "onHour", "onMinute", "offHour", "offMinute" };
+
+static void set(TreeNode& node, Field field, unsigned long value)
+{
+  switch(field){
+  case ID: node.d = value; break;
+  case ADDRESS: node.address = value; break;
+  case TIMER: node.timerid = value; break;
+  case STATUS: node.status = value; break;
+  case ON_HOUR: node.onHour = value; break;
+  case ON_MINUTE: node.onMinute = value; break;
+  case OFF_HOUR: node.offHour = value; break;
+  case OFF_MINUTE: node.offMinute = value; break;
+  default: break;
+  }
+}
+
+static bool same(const TreeNode& a, const TreeNode& b)
+{
+  return a.d == b.d && a.address == b.address && a.timerid == b.timerid && a.status == b.status
+    && a.onHour == b.onHour && a.onMinute == b.onMinute
+    && a.offHour == b.offHour && a.offMinute == b.offMinute;
+}
+
+// The shifting and masking AVL_tree::saveEEPROM did before TreeLayout
+static void legacyPack(const TreeNode& node, byte* record)
+{
+  record[0] = node.d >> 8;
+  record[1] = node.d & 0xFF;
+  for(byte i = 0; i < 4; ++i)
+    record[2 + i] = (node.address >> (24 - 8 * i)) & 0xFF;
+  record[6] = node.timerid;
+  record[7] = ((node.onMinute & 3) << 6) | (node.onHour << 1) | (node.status ? 1 : 0);
+  record[8] = ((node.offHour & 15) << 4) | ((node.onMinute & 0x3C) >> 2);
+  record[9] = ((node.offMinute & 63) << 1) | ((node.offHour & 16) >> 4);
+}
+
+static void roundTrip(const TreeNode& node, Field field, unsigned long value)
+{
+  byte record[TREE_RECORD_SIZE] = {0};
+  byte legacy[TREE_RECORD_SIZE];
+  PackRecord<TreeLayout>(node, record);
+  legacyPack(node, legacy);
+  TreeNode back;
+  UnpackRecord<TreeLayout>(record, back);
+  if(memcmp(record, legacy, TREE_RECORD_SIZE) != 0 || !same(node, back)){
+    fprintf(stderr, "%s %lu does not round trip\n", names[field], value);
+    ++failures;
+  }
+
+  if(node.d > 255 || node.address)
+    return;
+  // The 8 bit id layout is bytes 1, 7, 8, 9 and 10
+  byte v1[TREE_V1_RECORD_SIZE] = { legacy[1], legacy[6], legacy[7], legacy[8], legacy[9] };
+  UnpackRecord<TreeLayoutV1>(v1, back);
+  if(!same(node, back)){
+    fprintf(stderr, "%s %lu does not load from the 8 bit id layout\n", names[field], value);
+    ++failures;
+  }
+}
+
+static void every(const TreeNode& base, Field field)
+{
+  unsigned long max = 0;
+  switch(field){
+  case ID: max = 0xFFFF; break;
+  case TIMER: max = 255; break;
+  case STATUS: max = 1; break;
+  case ON_HOUR: case OFF_HOUR: max = 31; break;
+  case ON_MINUTE: case OFF_MINUTE: max = 63; break;
+  default: break;
+  }
+  TreeNode node = base;
+  if(field != ADDRESS){
+    for(unsigned long value = 0; value <= max; ++value){
+      set(node, field, value);
+      roundTrip(node, field, value);
+    }
+    return;
+  }
+  // Too many to try them all: every bit alone, every bit cleared, and runs
+  for(byte bit = 0; bit < 32; ++bit){
+    set(node, field, 1UL << bit);
+    roundTrip(node, field, 1UL << bit);
+    set(node, field, 0xFFFFFFFFUL ^ 1UL << bit);
+    roundTrip(node, field, 0xFFFFFFFFUL ^ 1UL << bit);
+    set(node, field, (2UL << bit) - 1);
+    roundTrip(node, field, (2UL << bit) - 1);
+  }
+  randomSeed(45);
+  for(int i = 0; i < 10000; ++i){
+    unsigned long value = (unsigned long)random(0x10000) << 16 | random(0x10000);
+    set(node, field, value);
+    roundTrip(node, field, value);
+  }
+}
+
+int main()
+{
+  TreeNode clear(0);
+  clear.address = 0;
+  clear.timerid = 0;
+  clear.status = false;
+  TreeNode full(0xFFFF);
+  full.address = 0xFFFFFFFFUL;
+  full.timerid = 255;
+  full.status = true;
+  full.onHour = full.offHour = 31;
+  full.onMinute = full.offMinute = 63;
+
+  for(int field = 0; field < FIELDS; ++field){
+    every(clear, (Field)field);
+    every(full, (Field)field);
+  }
+
+  // Spare bit stays clear, bits outside a field are not written
+  byte record[TREE_RECORD_SIZE];
+  memset(record, 0xFF, sizeof(record));
+  TreeLayout::OnMinute::set(record, 0);
+  CHECK(record[7] == 0x3F && record[8] == 0xF0);
+  CHECK(TreeLayout::OffHour::get(record) == 31 && TreeLayout::OnHour::get(record) == 31);
+  memset(record, 0, sizeof(record));
+  PackRecord<TreeLayout>(full, record);
+  CHECK(record[9] == 0x7F);
+
+  // Compile time sizes
+  CHECK(TreeEepromCapacity(743) == 73);
+  CHECK(TreeEepromCapacity(TREE_EEPROM_SIZE(0)) == 0 && TreeEepromCapacity(0) == 0);
+  CHECK(TreeEepromCapacity(0xFFFF) == (0xFFFF - TREE_EEPROM_SIZE(0)) / TREE_RECORD_SIZE);
+  CHECK((SwitchCache<743, 40>::MaxSwitches == 73));
+
+  if(failures){
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("TreeRecord OK\n");
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <Arduino.h>
+#include <SolarTime.h>
+
+/*
+ * Sunrise and sunset against a reference table, which was computed with
+ * the same NOAA solar calculator equations in double precision, iterated
+ * until the times settled. Times are UTC minutes after midnight, rounded.
+ */
+
+#define SOLAR_TOLERANCE 1 // Minutes
+
+struct Reference {
+  float latitude;
+  float longitude;
+  unsigned int year;
+  byte month;
+  byte day;
+  unsigned int sunrise;
+  unsigned int sunset;
+};
+
+static const Reference references[] = {
+  {  59.33,   18.07, 2015,  1,  1,  464,  838 }, // Stockholm
+  {  59.33,   18.07, 2015,  3, 29,  264, 1042 }, // Stockholm
+  {  59.33,   18.07, 2015,  6, 21,   91, 1208 }, // Stockholm
+  {  59.33,   18.07, 2015,  9, 23,  273, 1006 }, // Stockholm
+  {  59.33,   18.07, 2015, 10, 25,  349,  914 }, // Stockholm
+  {  59.33,   18.07, 2015, 12, 21,  463,  828 }, // Stockholm
+  {  59.33,   18.07, 2016,  2, 29,  347,  975 }, // Stockholm
+  {  59.33,   18.07, 2020,  7, 15,  118, 1188 }, // Stockholm
+  {  59.33,   18.07, 2038, 11,  3,  372,  890 }, // Stockholm
+  {  -0.18,  -78.47, 2015,  1,  1,  673, 1401 }, // Quito
+  {  -0.18,  -78.47, 2015,  3, 29,  675, 1402 }, // Quito
+  {  -0.18,  -78.47, 2015,  6, 21,  672, 1399 }, // Quito
+  {  -0.18,  -78.47, 2015,  9, 23,  663, 1390 }, // Quito
+  {  -0.18,  -78.47, 2015, 10, 25,  654, 1381 }, // Quito
+  {  -0.18,  -78.47, 2015, 12, 21,  668, 1396 }, // Quito
+  {  -0.18,  -78.47, 2016,  2, 29,  683, 1410 }, // Quito
+  {  -0.18,  -78.47, 2020,  7, 15,  677, 1403 }, // Quito
+  {  -0.18,  -78.47, 2038, 11,  3,  654, 1381 }, // Quito
+  { -33.87,  151.21, 2015,  1,  1, 1127,  549 }, // Sydney
+  { -33.87,  151.21, 2015,  3, 29, 1205,  475 }, // Sydney
+  { -33.87,  151.21, 2015,  6, 21, 1260,  414 }, // Sydney
+  { -33.87,  151.21, 2015,  9, 23, 1184,  472 }, // Sydney
+  { -33.87,  151.21, 2015, 10, 25, 1143,  496 }, // Sydney
+  { -33.87,  151.21, 2015, 12, 21, 1121,  545 }, // Sydney
+  { -33.87,  151.21, 2016,  2, 29, 1182,  513 }, // Sydney
+  { -33.87,  151.21, 2020,  7, 15, 1258,  425 }, // Sydney
+  { -33.87,  151.21, 2038, 11,  3, 1133,  505 }, // Sydney
+  {  39.74, -104.99, 2015,  1,  1,  861, 1426 }, // Denver
+  {  39.74, -104.99, 2015,  3, 29,  769,   81 }, // Denver
+  {  39.74, -104.99, 2015,  6, 21,  692,  151 }, // Denver
+  {  39.74, -104.99, 2015,  9, 23,  768,   56 }, // Denver
+  {  39.74, -104.99, 2015, 10, 25,  801,    7 }, // Denver
+  {  39.74, -104.99, 2015, 12, 21,  857, 1419 }, // Denver
+  {  39.74, -104.99, 2016,  2, 29,  814,   52 }, // Denver
+  {  39.74, -104.99, 2020,  7, 15,  705,  147 }, // Denver
+  {  39.74, -104.99, 2038, 11,  3,  811, 1435 }, // Denver
+  {  69.65,   18.96, 2015,  1,  1, SOLAR_NONE, SOLAR_NONE }, // Tromso
+  {  69.65,   18.96, 2015,  3, 29,  244, 1056 }, // Tromso
+  {  69.65,   18.96, 2015,  6, 21, SOLAR_NONE, SOLAR_NONE }, // Tromso
+  {  69.65,   18.96, 2015,  9, 23,  267, 1005 }, // Tromso
+  {  69.65,   18.96, 2015, 10, 25,  396,  859 }, // Tromso
+  {  69.65,   18.96, 2015, 12, 21, SOLAR_NONE, SOLAR_NONE }, // Tromso
+  {  69.65,   18.96, 2016,  2, 29,  373,  942 }, // Tromso
+  {  69.65,   18.96, 2020,  7, 15, SOLAR_NONE, SOLAR_NONE }, // Tromso
+  {  69.65,   18.96, 2038, 11,  3,  441,  813 }, // Tromso
+};
+
+static int failures = 0;
+
+static unsigned int difference(unsigned int a, unsigned int b)
+{
+  if(a == SOLAR_NONE || b == SOLAR_NONE)
+    return a == b ? 0 : 1440;
+  unsigned int d = a > b ? a - b : b - a;
+  return d > 720 ? 1440 - d : d; // Either side of midnight
+}
+
+static void check(const Reference& r, const char* what, unsigned int got, unsigned int want)
+{
+  if(difference(got, want) <= SOLAR_TOLERANCE)
+    return;
+  fprintf(stderr, "%.2f %.2f %u-%02u-%02u: %s %u, expected %u\n",
+	  r.latitude, r.longitude, r.year, r.month, r.day, what, got, want);
+  ++failures;
+}
+
+int main()
+{
+  for(size_t i = 0; i < sizeof(references) / sizeof(references[0]); ++i){
+    const Reference& r = references[i];
+    SolarTime sun(r.latitude, r.longitude);
+    if(!sun.update(r.year, r.month, r.day) && r.sunrise != SOLAR_NONE){
+      fprintf(stderr, "update() on a new date reported no change\n");
+      ++failures;
+    }
+    check(r, "sunrise", sun.sunrise(), r.sunrise);
+    check(r, "sunset", sun.sunset(), r.sunset);
+    if(sun.update(r.year, r.month, r.day)){
+      fprintf(stderr, "update() on the same date reported a change\n");
+      ++failures;
+    }
+  }
+
+  if(failures){
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("SolarTime OK\n");
+  return 0;
+}
@@ -1,9 +1,27 @@
 #include "AVL_tree.h"
+#include "TreeRecord.h"
+#include <PerfStats.h>
+#include <EventLog.h>
+#include <MemStats.h>
 
-AVL_tree::AVL_tree(byte maxSize){
+static_assert(TreeLayoutCheck<TreeLayout, TREE_RECORD_SIZE>::value, "TreeLayout");
+static_assert(TreeLayoutCheck<TreeLayoutV1, TREE_V1_RECORD_SIZE>::value, "TreeLayoutV1");
+
+AVL_tree::AVL_tree(unsigned int maxSize, unsigned int maxRecords){
   mMaxSize = maxSize;
+  mMaxRecords = maxRecords;
   mSize = 0;
+  mUnloaded = 0;
   root = NULL;
+  mDirty = false;
+  mUpgraded = false;
+  mFlushIndex = 0;
+  mFlushNext = 0;
+  mFlushByte = 0;
+  mOnChange = NULL;
+  mGeneration = 0;
+  mRemovedGen = 0;
+  mMembersGen = 0;
   loadEEPROM();
 }
 
@@ -11,6 +29,24 @@ AVL_tree::~AVL_tree(){
   Clear();
 }
 
+/*
+ * Capacity planner: switches that fit in eepromBytes of EEPROM and in
+ * freeRam bytes of RAM, leaving reserve bytes of it to the rest of the
+ * sketch (stack, later allocations). perSwitch is RAM that others set
+ * aside for each switch of the cache, e.g. its timer transitions.
+ * freeRam 0 means not known (off the AVR, see MemStats) and only the
+ * EEPROM counts.
+ */
+unsigned int AVL_tree::Capacity(unsigned int eepromBytes, unsigned int freeRam, unsigned int reserve, unsigned int perSwitch){
+  unsigned int fit = TreeEepromCapacity(eepromBytes);
+  if(freeRam){
+    unsigned int ram = freeRam > reserve ? (freeRam - reserve) / (TREE_NODE_RAM + perSwitch) : 0;
+    if(ram < fit)
+      fit = ram;
+  }
+  return fit;
+}
+
 void AVL_tree::Balance(Node& node)
 {
   if(BalanceFactor(node) == 2) // Unbalance on right side
@@ -28,10 +64,10 @@ void AVL_tree::Balance(Node& node)
 }
 
 boolean AVL_tree::Insert(data d, bool saveEEPROM){
-  if(mMaxSize < mSize)
+  if(mSize >= mMaxSize)
     return false;
   if(IsEmpty()){
-    root = new TreeNode(d);
+    Insert(root, d, saveEEPROM);
     return true;
   }
   else{
@@ -43,11 +79,15 @@ boolean AVL_tree::Insert(data d, bool saveEEPROM){
 Node AVL_tree::Insert(Node& node, data d, bool save){
   if(node == NULL){ // If empty, insert it...
     node = new TreeNode(d);
+    MemStats::countAlloc(MEM_TREE);
     node->status = false;
     node->timerid = 255;
     ++mSize;
-    if(save)
-      saveEEPROM(node);
+    if(save){
+      MarkDirty();
+      Changed(node);
+      mMembersGen = mGeneration;
+    }
     return node;
   }
   /* Now check if we should go left or right */
@@ -62,11 +102,11 @@ Node AVL_tree::Insert(Node& node, data d, bool save){
 }
 
 boolean AVL_tree::Insert(Node node, bool save){
-  if(mMaxSize < mSize)
+  if(mSize >= mMaxSize)
     return false;
 
   if(IsEmpty()){
-    root = node;
+    Insert(root, node, save);
     return true;
   }
   else{
@@ -80,8 +120,11 @@ Node AVL_tree::Insert(Node& node, Node& newNode, bool save){
   if(node == NULL){ // If empty, insert it...
     node = newNode;
     ++mSize;
-    if(save)
-      saveEEPROM(node);
+    if(save){
+      MarkDirty();
+      Changed(node);
+      mMembersGen = mGeneration;
+    }
     return node;
   }
   /* Now check if we should go left or right */
@@ -106,6 +149,7 @@ Node AVL_tree::FindMin(Node node){
 void AVL_tree::RemoveMin(){
   Node min = ExtractMin(root);
   delete(min);
+  MemStats::countFree(MEM_TREE);
   min = NULL;
   --mSize;
 }
@@ -120,14 +164,18 @@ Node AVL_tree::ExtractMin(Node& node){
 }
 
 boolean AVL_tree::Remove(data d){
-  byte s = mSize;
+  unsigned int s = mSize;
   root = Remove(root, d);
   if(s == mSize)
     return false;
-  else{
-    return true;
-    saveEEPROM();
+  if(mUnloaded){
+    // Gone from the read-only image too, and one left out takes its place
+    EraseRecord(d);
+    Reload();
   }
+  MarkDirty();
+  Removed(d);
+  return true;
 }
 
 Node AVL_tree::Remove(Node& node, data d){
@@ -143,6 +191,7 @@ Node AVL_tree::Remove(Node& node, data d){
     Node l = node->left;
     Node r = node->right;
     delete(node);
+    MemStats::countFree(MEM_TREE);
     --mSize;
     if(r == NULL)
       return l; 
@@ -156,9 +205,11 @@ Node AVL_tree::Remove(Node& node, data d){
   return node;
 }
 
+// Empty the cache, what is saved next replaces the EEPROM image
 void AVL_tree::Clear(){
   Clear(root);
   mSize = 0;
+  mUnloaded = 0;
 }
 
 void AVL_tree::Clear(Node& node){
@@ -166,6 +217,7 @@ void AVL_tree::Clear(Node& node){
     Clear(node->left);
     Clear(node->right);
     delete(node);
+    MemStats::countFree(MEM_TREE);
     node = NULL;
   }
 }
@@ -240,259 +292,589 @@ boolean AVL_tree::Contains(data id){
 }
 
 
-void AVL_tree::ForEach(ExternalFunction externalFunc){
-  ForEach(root, externalFunc);
+TreeIterator::TreeIterator(Node root, data from, data to){
+  mDepth = 0;
+  mFrom = from;
+  mTo = to;
+  PushLeft(root);
 }
 
-void AVL_tree::ForEach(Node& node, ExternalFunction externalFunc){
-  if(node != NULL)
-    {
-      ForEach(node->left, externalFunc);
-      ForEach(node->right, externalFunc);
-      externalFunc(node);
+Node TreeIterator::Next(){
+  if(mDepth == 0)
+    return NULL;
+  Node node = mStack[--mDepth];
+  if(node->d > mTo){
+    mDepth = 0;
+    return NULL;
+  }
+  PushLeft(node->right);
+  return node;
+}
+
+// Path down to the smallest id >= mFrom below node
+void TreeIterator::PushLeft(Node node){
+  while(node){
+    if(node->d < mFrom){
+      node = node->right;
+    }
+    else{
+      if(mDepth < TREE_MAX_DEPTH)
+	mStack[mDepth++] = node;
+      node = node->left;
     }
+  }
 }
 
-void AVL_tree::SendNodes(EthernetClient* client){
+void AVL_tree::SendNodes(Print* client){
   //buffer->reserve((sizeof(unsigned char)*15*mSize)+1);
   if(IsEmpty()){
-    client->println("-1");
+    client->println(F("-1"));
   }
-  SendNodes(root, client);
+  ForEach([&](Node& node){ WriteNode(node, *client); });
 }
 
-void AVL_tree::SendNodes(Node node, EthernetClient* client){
+// Decimal value and separator, returns the new length
+static byte appendField(char* buffer, byte length, unsigned int value, char separator)
+{
+  char digits[5];
+  byte n = 0;
+  do{
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  }while(value);
+  while(n)
+    buffer[length++] = digits[--n];
+  buffer[length++] = separator;
+  return length;
+}
+
+void AVL_tree::SendNode(data id, Print& out){
+  Node node = Find(id);
   if(node){
-    SendNodes(node->left, client);
-    // DO STRING
-    String* buffer = new String("");
-    buffer->reserve(sizeof(unsigned char)*20);
-    *buffer += node->d;
-    *buffer += ':';
-    if(node->status)
-      *buffer += '1';
-    else
-      *buffer += '0';
-    *buffer += ':';
-    *buffer += node->timerid;
-    *buffer += ':' ;
-    *buffer +=  node->onHour;
-    *buffer += ':' ;
-    *buffer += node->onMinute;
-    *buffer += ':' ;
-    *buffer += node->offHour;
-    *buffer += ':';
-    *buffer +=  node->offMinute;
-    *buffer += 'N';
-    client->print(*buffer);
-    Serial.println(*buffer);
-    delete buffer;
-    SendNodes(node->right, client);
+    WriteNode(node, out);
+    return;
   }
+  char buffer[10];
+  byte length = appendField(buffer, 0, id, ':');
+  buffer[length++] = '-';
+  buffer[length++] = '1';
+  buffer[length++] = 'N';
+  out.write((const uint8_t*)buffer, length);
+}
+
+void AVL_tree::WriteNode(Node node, Print& out, boolean stamp){
+  // id:status:timerid:onHour:onMinute:offHour:offMinute[:gen] N, at most 30 chars
+  char buffer[30];
+  byte length = 0;
+  length = appendField(buffer, length, node->d, ':');
+  length = appendField(buffer, length, node->status ? 1 : 0, ':');
+  length = appendField(buffer, length, node->timerid, ':');
+  length = appendField(buffer, length, node->onHour, ':');
+  length = appendField(buffer, length, node->onMinute, ':');
+  length = appendField(buffer, length, node->offHour, ':');
+  if(stamp){
+    length = appendField(buffer, length, node->offMinute, ':');
+    length = appendField(buffer, length, node->gen, 'N');
+  }
+  else{
+    length = appendField(buffer, length, node->offMinute, 'N');
+  }
+  // One write per node, each write is a separate packet on the W5100
+  out.write((const uint8_t*)buffer, length);
+}
+
+/*
+ * Conditional 'G'. Replies with a <gen>:<mode>N header, mode being
+ *   U  Nothing changed since the client's generation
+ *   D  Switches changed since then follow
+ *   F  All switches follow, since a switch was removed after the
+ *      client's generation, or the client's generation is unknown
+ * Records carry the generation they were last changed in as an 8th field.
+ */
+void AVL_tree::SendChanges(unsigned int since, Print* client){
+  // Ages count back from mGeneration, so wrapping the counter is harmless
+  unsigned int age = mGeneration - since;
+  char mode = 'D';
+  if(since != 0 && age == 0)
+    mode = 'U';
+  else if(since == 0 || age > mGeneration - mRemovedGen)
+    mode = 'F';
+  client->print(mGeneration);
+  client->print(':');
+  client->print(mode);
+  client->print('N');
+  if(mode == 'F')
+    age = 0; // Everything
+  if(mode == 'U')
+    return;
+  ForEach([&](Node& node){
+      if(age == 0 || (unsigned int)(mGeneration - node->gen) < age)
+	WriteNode(node, *client, true);
+    });
+}
+
+/*
+ * Compact 'G' for apps that only poll on/off: the members generation
+ * and the number of switches (2 bytes each, high byte first), then one
+ * status bit per switch in id order, bit 0 of the first byte being the
+ * lowest id. The ids are those of a full 'G' fetched when the members
+ * generation was the same. One walk over the tree and one write per
+ * TREE_BITMAP_CHUNK bytes, a single packet up to 256 switches.
+ */
+void AVL_tree::SendStatusBits(Print& out){
+  byte buffer[4 + TREE_BITMAP_CHUNK] = { (byte)(mMembersGen >> 8), (byte)(mMembersGen & 0xFF),
+					 (byte)(mSize >> 8), (byte)(mSize & 0xFF) };
+  byte length = 4;
+  byte bit = 0;
+  ForEach([&](Node& node){
+      if(bit == 0){
+	if(length == sizeof(buffer)){
+	  out.write(buffer, length);
+	  length = 0;
+	}
+	buffer[length++] = 0;
+      }
+      if(node->status)
+	buffer[length - 1] |= 1 << bit;
+      bit = (bit + 1) & 7;
+    });
+  out.write(buffer, length);
+}
+
+unsigned int AVL_tree::NextGeneration(){
+  if(++mGeneration == 0)
+    mGeneration = 1;
+  return mGeneration;
+}
+
+void AVL_tree::Changed(Node node){
+  node->gen = NextGeneration();
+  if(mOnChange)
+    mOnChange(node->d);
+}
+
+void AVL_tree::Removed(data id){
+  mRemovedGen = mMembersGen = NextGeneration();
+  if(mOnChange)
+    mOnChange(id);
 }
 
 /*
  * Save switch_cache in cache into EEPROM
  * This is done when any changes have been done to cache.
- *    Bit: |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |
- * Byte 1: | SId | SId | SId | SId | SId | SId | SId | SId | 
- * Byte 2: | TId | TId | TId | TId | TId | TId | TId | TId | 
- * Byte 3: | OnM1| OnM0| OnH4| OnH3| OnH2| OnH1| OnH0|Status| 
- * Byte 4: |OffH3|OffH2|OffH1|OffH0| OnM5| OnM4| OnM3| OnM2|
- * Byte 5: |NONE |OffM5|OffM4|OffM3|OffM2|OffM1|OffM0|OffH4|
- * 
- * OnHour, OffHour = 5 bit
- * OnMinute, OffMinute = 6 bit
- * Status = 1 bit
+ * The record layout is TreeLayout in TreeRecord.h.
  */
 void AVL_tree::saveEEPROM()
 {
-  unsigned int addr = 1;
-  saveAllEEPROM(root, addr);
-  EEPROM.write(0, mSize);
+  if(mUnloaded)
+    return; // Read-only
+  // In order, so the records are sorted by id for loadEEPROM
+  unsigned int addr = TREE_HEADER_SIZE;
+  ForEach([&](Node& node){
+      saveEEPROM(node, addr);
+      ++addr;
+    });
+  SaveChecksum(mSize);
+  mDirty = false;
+  mFlushIndex = 0;
+  mFlushByte = 0;
+}
+
+void AVL_tree::MarkDirty(){
+  if(mUnloaded)
+    return; // Read-only
+  mDirty = true;
+  mFlushIndex = 0; // Start over, the tree may have been restructured
+  mFlushNext = 0;
+  mFlushByte = 0;
 }
 
-void AVL_tree::saveAllEEPROM(Node node, unsigned int& addr){
-  if (node == NULL)
-    return;
+/*
+ * Write the next changed byte to EEPROM. Called from the scheduler so a
+ * full save is spread over slices of one 3.3 ms write each, short
+ * enough for RCReceive's pulse buffer. Bytes that didn't change are
+ * only read. The node of the record being written is found from its
+ * id, one walk down the tree, and packed again each time so a change
+ * to it meanwhile is not half written.
+ */
+boolean AVL_tree::FlushEEPROM(){
+  if(!mDirty)
+    return false;
+  PERF_PROBE(PERF_EEPROM_SAVE);
+  while(mFlushIndex < mSize){
+    Node node = TreeIterator(root, mFlushNext).Next();
+    if(mFlushByte == 0)
+      LOG_DEBUG(EV_TREE_SAVE, node->d);
+    byte record[TREE_RECORD_SIZE] = {0};
+    PackRecord<TreeLayout>(*node, record);
+    unsigned int addr = TREE_EEPROM_SIZE(mFlushIndex) - TREE_CRC_SIZE;
+    while(mFlushByte < TREE_RECORD_SIZE){
+      byte i = mFlushByte++;
+      if(EEPROM.read(addr + i) != record[i]){
+	EEPROM.write(addr + i, record[i]);
+	return true;
+      }
+    }
+    mFlushByte = 0;
+    ++mFlushIndex;
+    mFlushNext = node->d + 1;
+  }
+  if(SaveChecksumByte(mSize))
+    return true;
+  mDirty = false;
+  mFlushIndex = 0;
+  mFlushNext = 0;
+  return false;
+}
+
+static void updateEEPROM(unsigned int addr, byte value)
+{
+  if(EEPROM.read(addr) != value)
+    EEPROM.write(addr, value);
+}
 
-  saveEEPROM(node, addr);
+uint16_t AVL_tree::Crc16(uint16_t crc, byte value)
+{
+  crc ^= (uint16_t)value << 8;
+  for(byte i = 0; i < 8; ++i)
+    crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
+}
+
+static byte readEEPROM(unsigned int& addr, uint16_t& crc)
+{
+  byte value = EEPROM.read(addr++);
+  crc = AVL_tree::Crc16(crc, value);
+  return value;
+}
 
-  saveAllEEPROM(node->left, addr);
-  saveAllEEPROM(node->right, addr);
+// Count and CRC, written after the records so an interrupted save fails the check
+void AVL_tree::SaveChecksum(unsigned int count)
+{
+  while(SaveChecksumByte(count))
+    ;
+}
+
+// First byte of the CRC, count and format that differs, written. False if none did
+boolean AVL_tree::SaveChecksumByte(unsigned int count)
+{
+  uint16_t crc = Crc16(Crc16(0xFFFF, count >> 8), count & 0xFF);
+  unsigned int addr = TREE_HEADER_SIZE;
+  unsigned int end = TREE_EEPROM_SIZE(count) - TREE_CRC_SIZE;
+  while(addr < end)
+    readEEPROM(addr, crc);
+  const unsigned int addrs[] = { addr, addr + 1, 1, 2, 0 };
+  const byte values[] = { (byte)(crc >> 8), (byte)(crc & 0xFF), (byte)(count >> 8), (byte)(count & 0xFF), TREE_FORMAT };
+  for(byte i = 0; i < sizeof(values); ++i){
+    if(EEPROM.read(addrs[i]) != values[i]){
+      EEPROM.write(addrs[i], values[i]);
+      return true;
+    }
+  }
+  return false;
 }
 
+// Records in the EEPROM image of the current layout
+unsigned int AVL_tree::StoredCount()
+{
+  unsigned int count = EEPROM.read(1) << 8 | EEPROM.read(2);
+  return count < mMaxRecords ? count : mMaxRecords; // More is a damaged count
+}
 
-// NEW
-void AVL_tree::saveEEPROM(Node node){
-  byte count = EEPROM.read(0); // How many switches in memory
-  byte bytePerNode = 5;
-  bool found = false;
-  for(unsigned int i = 1; i <= count; ++i){
-    unsigned int startAddr = (i * bytePerNode) - (bytePerNode - 1);
-    if(EEPROM.read(startAddr) == node->d){
-      saveEEPROM(node, startAddr);
-      found = true;
-      break;
+// Clear the id of d's record in place, loading skips id 0, and update the CRC
+void AVL_tree::EraseRecord(data d)
+{
+  unsigned int count = StoredCount();
+  for(unsigned int addr = TREE_HEADER_SIZE; addr < TREE_EEPROM_SIZE(count) - TREE_CRC_SIZE; addr += TREE_RECORD_SIZE){
+    if((data)(EEPROM.read(addr) << 8 | EEPROM.read(addr + 1)) == d){
+      updateEEPROM(addr, 0);
+      updateEEPROM(addr + 1, 0);
     }
   }
-  if(!found){
-    unsigned int addr = (count * bytePerNode) + 1;
-    saveEEPROM(node, addr);
-    EEPROM.write(0, mSize);
+  SaveChecksum(count);
+}
+
+/*
+ * Rewrite the 8 bit id layout as this one in EEPROM, all its switches and
+ * not only those loaded. Last record first, each lands above the old
+ * records not read yet. The format, written last, ends the upgrade.
+ */
+void AVL_tree::ConvertEEPROM()
+{
+  unsigned int count = EEPROM.read(0);
+  if(count > mMaxRecords)
+    count = mMaxRecords; // Never, the 8 bit id layout held 40
+  for(unsigned int i = count; i-- > 0; ){
+    unsigned int from = 1 + TREE_V1_RECORD_SIZE * i;
+    uint16_t crc = 0;
+    TreeNode node;
+    ReadRecord(from, crc, node, true);
+    byte record[TREE_RECORD_SIZE] = {0};
+    PackRecord<TreeLayout>(node, record);
+    for(byte j = 0; j < TREE_RECORD_SIZE; ++j)
+      updateEEPROM(TREE_HEADER_SIZE + TREE_RECORD_SIZE * i + j, record[j]);
   }
+  SaveChecksum(count);
+}
+
+/*
+ * The cache as saveEEPROM() would leave it in EEPROM: header, records
+ * sorted by id, CRC. Packed from RAM, so changes not yet flushed are in.
+ */
+void AVL_tree::WriteImage(Print& out)
+{
+  byte header[TREE_HEADER_SIZE] = { TREE_FORMAT, (byte)(mSize >> 8), (byte)(mSize & 0xFF) };
+  uint16_t crc = Crc16(Crc16(0xFFFF, header[1]), header[2]);
+  out.write(header, TREE_HEADER_SIZE);
+  ForEach([&](Node& node){
+      byte record[TREE_RECORD_SIZE] = {0};
+      PackRecord<TreeLayout>(*node, record);
+      for(byte i = 0; i < TREE_RECORD_SIZE; ++i)
+	crc = Crc16(crc, record[i]);
+      out.write(record, TREE_RECORD_SIZE);
+    });
+  byte check[TREE_CRC_SIZE] = { (byte)(crc >> 8), (byte)(crc & 0xFF) };
+  out.write(check, TREE_CRC_SIZE);
 }
 
 void AVL_tree::saveEEPROM(Node node, unsigned int& addr)
 {
-  Serial.print(F("Saving... ID: "));
-  Serial.print( node->d );
-  Serial.print(F(", First Addr: "));
-  Serial.print( addr );
-  // Byte 1: Write controller
-  EEPROM.write((addr)++, node->d);
-  // Byte 2: | TId | TId | TId | TId | TId | TId | TId | TId | 
-  EEPROM.write((addr)++, node->timerid);
-  // Byte 3: | OnM1| OnM0| OnH4| OnH3| OnH2| OnH1| OnH0|Status| 
-  byte tmp = B00000011 & node->onMinute; // Get 2 least significant bits;
-  tmp = tmp << 5;                  // Get space for onHour
-  tmp = tmp | node->onHour;        // Insert onHour
-  tmp = tmp << 1;                  // Get space for status
-  if(node->status)                 // Insert status
-    tmp = tmp | B00000001;
-  else
-    tmp = tmp | B00000000;
-  EEPROM.write((addr)++, tmp); 
-  // Byte 4: |OffH3|OffH2|OffH1|OffH0| OnM5| OnM4| OnM3| OnM2| 0-3 offHour, 2-5 onMinute
-  tmp = B00001111 & node->offHour; // Insert 4 first bits
-  tmp = tmp << 4;
-  byte rest = B00111100 & node->onMinute;// Parse what's left of onMinute
-  rest = rest >> 2;
-  tmp = tmp | rest;                // Insert rest at front
-  EEPROM.write((addr)++, tmp);
-  //Byte 5: |NONE |OffM5|OffM4|OffM3|OffM2|OffM1|OffM0|OffH4|
-  tmp = B00111111 & node->offMinute;
-  tmp = tmp << 1;
-  rest = B00010000 & node->offHour;
-  rest = rest >> 4;
-  tmp = tmp | rest;
-  EEPROM.write(addr, tmp);
-  Serial.print(F(", Last Addr: "));
-  Serial.print( addr );
-  Serial.println(F(" ... DONE!"));
+  LOG_DEBUG(EV_TREE_SAVE, node->d);
+  byte record[TREE_RECORD_SIZE] = {0};
+  PackRecord<TreeLayout>(*node, record);
+  for(byte i = 0; i < TREE_RECORD_SIZE - 1; ++i)
+    updateEEPROM((addr)++, record[i]);
+  updateEEPROM(addr, record[TREE_RECORD_SIZE - 1]);
 }
 
 /*
  * Load switch_cache in EEPROM into cache.
- * This should only be done at setup state.
+ * This should only be done at setup state. The records are sorted, so
+ * the balanced tree is built in one pass over them, without rotations.
+ * If the CRC or the order is wrong (a save was interrupted, or the
+ * records were saved unsorted by an older version) they are inserted
+ * one at a time instead and saved again. So are more records than fit
+ * in RAM, see Unloaded().
  */
 void AVL_tree::loadEEPROM()
 {
-  byte count = EEPROM.read(0); // How many switch_cache in memory
-  byte loaded_count = 0; // count_pos
-  unsigned int addr = 1; // Current EEPROM address
-  while(loaded_count < count)
-  {
-    Node newNode = new TreeNode();
-     // Read controller
-     // Byte 1: | SId | SId | SId | SId | SId | SId | SId | SId | 
-     newNode->d = EEPROM.read(addr++);
-     // Byte 2: | TId | TId | TId | TId | TId | TId | TId | TId | 
-     newNode->timerid = EEPROM.read(addr++);
-     // Byte 3: | OnM1| OnM0| OnH4| OnH3| OnH2| OnH1| OnH0|Status| 
-     byte in = EEPROM.read(addr++);
-     byte tmp = in & B00000001;
-     if(tmp == 1){
-       newNode->status = true;
-     }else{
-       newNode->status = false;
-     }
-     tmp = in & B00111110;
-     tmp = tmp >> 1;
-     newNode->onHour = tmp;
-     tmp = in & B11000000;
-     tmp = (unsigned int)tmp >> 6;
-     
-     // Byte 4: |OffH3|OffH2|OffH1|OffH0| OnM5| OnM4| OnM3| OnM2|
-     in = EEPROM.read(addr++);
-     byte rest = in & B00001111;
-     rest = rest << 2;
-     tmp = tmp | rest;
-     newNode->onMinute = tmp;
-     tmp = in & B11110000;
-     tmp = (unsigned int)tmp >> 4;
-     
-      // Byte 5: |NONE |OffM5|OffM4|OffM3|OffM2|OffM1|OffM0|OffH4|
-     in = EEPROM.read(addr++);
-     rest = in & B00000001;
-     rest = rest << 4;
-     tmp = tmp | rest;
-     newNode->offHour = tmp;
-     tmp = in & B01111110;
-     tmp = tmp >> 1;
-     newNode->offMinute = tmp;
-     Insert(root, newNode, false);
-     Serial.print(F("Loaded..."));
-     Serial.print(loaded_count);
-     Serial.print(F(" addr..."));
-     Serial.println(addr);
-     ++loaded_count;
-  }
-  Serial.println(F("Load switches from memory... DONE!"));
-}
-
-void AVL_tree::SetStatus(byte id, byte status)
+  mUnloaded = 0;
+  byte format = EEPROM.read(0);
+  if(format == 0xFF)
+    return; // Never written
+  unsigned int addr;
+  uint16_t crc = 0;
+  if(format != TREE_FORMAT){
+    // The count of the 8 bit id layout
+    mUpgraded = true;
+    LOG_INFO(EV_TREE_UPGRADE, format);
+    addr = 1;
+    LoadOneByOne(format, addr, crc, true);
+    return;
+  }
+  unsigned int count = StoredCount();
+  crc = Crc16(Crc16(0xFFFF, count >> 8), count & 0xFF);
+  addr = TREE_HEADER_SIZE; // Current EEPROM address
+  if(count > mMaxSize){
+    LoadOneByOne(count, addr, crc, false);
+    if((uint16_t)(EEPROM.read(addr) << 8 | EEPROM.read(addr + 1)) != crc)
+      LOG_WARN(EV_TREE_CRC, count);
+    return;
+  }
+  data last = 0;
+  boolean sorted = true;
+  root = Build(count, addr, crc, last, sorted);
+  uint16_t stored = EEPROM.read(addr) << 8 | EEPROM.read(addr + 1);
+  if(sorted && stored == crc)
+    return;
+
+  LOG_WARN(EV_TREE_CRC, count);
+  Clear();
+  addr = TREE_HEADER_SIZE;
+  LoadOneByOne(count, addr, crc, false);
+}
+
+/*
+ * Replace the cache with what is in EEPROM now, built in one pass as at
+ * boot. Counts as a removal, so 'G:<gen>' clients fetch everything.
+ */
+void AVL_tree::Reload()
+{
+  Clear();
+  mDirty = false;
+  mFlushIndex = 0;
+  mFlushNext = 0;
+  mFlushByte = 0;
+  loadEEPROM();
+  mRemovedGen = mMembersGen = NextGeneration();
+}
+
+/*
+ * Insert count records from addr, in any order, and have them saved
+ * again. Once the cache is full the rest are only counted in mUnloaded,
+ * and the image is left as it is.
+ */
+void AVL_tree::LoadOneByOne(unsigned int count, unsigned int& addr, uint16_t& crc, boolean v1)
+{
+  for(unsigned int loaded_count = 0; loaded_count < count; ++loaded_count){
+    if(mSize == mMaxSize){
+      TreeNode node;
+      ReadRecord(addr, crc, node, v1);
+      if(node.d != 0 && !Contains(node.d))
+	++mUnloaded;
+      continue;
+    }
+    Node newNode = ReadNode(addr, crc, v1);
+    unsigned int size = mSize;
+    if(newNode->d != 0)
+      Insert(root, newNode, false);
+    if(mSize == size){ // Same id twice
+      delete newNode;
+      MemStats::countFree(MEM_TREE);
+    }
+  }
+  if(mUnloaded)
+    LOG_WARN(EV_TREE_OVERFLOW, mUnloaded);
+  MarkDirty();
+}
+
+// Balanced subtree of the next count records, read in order
+Node AVL_tree::Build(unsigned int count, unsigned int& addr, uint16_t& crc, data& last, boolean& sorted)
+{
+  if(count == 0)
+    return NULL;
+  Node left = Build(count / 2, addr, crc, last, sorted);
+  Node node = ReadNode(addr, crc);
+  if(node->d <= last)
+    sorted = false;
+  last = node->d;
+  ++mSize;
+  node->left = left;
+  node->right = Build(count - count / 2 - 1, addr, crc, last, sorted);
+  return node;
+}
+
+// A record of the current layout, or of the 8 bit id one if v1
+Node AVL_tree::ReadNode(unsigned int& addr, uint16_t& crc, boolean v1)
+{
+  Node newNode = new TreeNode();
+  MemStats::countAlloc(MEM_TREE);
+  ReadRecord(addr, crc, *newNode, v1);
+  LOG_DEBUG(EV_TREE_LOAD, newNode->d);
+  return newNode;
+}
+
+void AVL_tree::ReadRecord(unsigned int& addr, uint16_t& crc, TreeNode& node, boolean v1)
+{
+  byte record[TREE_RECORD_SIZE];
+  byte size = v1 ? TREE_V1_RECORD_SIZE : TREE_RECORD_SIZE;
+  for(byte i = 0; i < size; ++i)
+    record[i] = readEEPROM(addr, crc);
+  if(v1)
+    UnpackRecord<TreeLayoutV1>(record, node);
+  else
+    UnpackRecord<TreeLayout>(record, node);
+}
+
+void AVL_tree::SetStatus(data id, byte status)
 {
   TreeNode* node = Find(id);
   if(node == NULL){
-    Serial.println(F("Node NOT Found!"));
+    LOG_WARN(EV_TREE_NOT_FOUND, id);
     return;
   }
-  Serial.println(F("Node Found! ID: "));
-  Serial.println(node->d);
+  boolean old = node->status;
   if (status == 1){
     node->status = true;
-    Serial.println(F("Status true!"));
   }
   else{
     node->status = false;
-    Serial.println(F("Status false!"));
   }
+  LOG_DEBUG(EV_TREE_STATUS, node->d * 2 + node->status);
+  if(node->status != old)
+    Changed(node);
+}
+
+boolean AVL_tree::SetLevel(data id, byte level)
+{
+  TreeNode* node = Find(id);
+  if(node == NULL){
+    LOG_WARN(EV_TREE_NOT_FOUND, id);
+    return false;
+  }
+  boolean changed = !node->status || node->level != level;
+  node->status = true;
+  node->level = level;
+  LOG_DEBUG(EV_TREE_LEVEL, id);
+  if(changed)
+    Changed(node);
+  return true;
+}
+
+boolean AVL_tree::SetAddress(data id, unsigned long address)
+{
+  Node node = Find(id);
+  if(node == NULL){
+    LOG_WARN(EV_TREE_NOT_FOUND, id);
+    return false;
+  }
+  if(node->address != address){
+    node->address = address;
+    MarkDirty();
+    Changed(node);
+  }
+  return true;
+}
+
+/*
+ * Walks all switches, the tree is sorted by id. Only used for what is
+ * heard from remotes, once per button press.
+ */
+Node AVL_tree::FindAddress(unsigned long address)
+{
+  if(address == 0)
+    return NULL;
+  TreeIterator it(root);
+  Node node;
+  while((node = it.Next()) && node->address != address)
+    ;
+  return node;
 }
 
 // Set Timer => timerid:onHour:onMinute:offHour:offMinute:switchidN:switchidK:....:switchidZ:
-void AVL_tree::SetTimer(byte*& id_arr, byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute)
+void AVL_tree::SetTimer(data*& id_arr, byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute)
 {
   while(*id_arr != 0 || id_arr == NULL)
     {
       Node node = Find(*id_arr);
       if( node != NULL)
 	{
-	  Serial.print(F("Setting timer on node: "));
-	  Serial.println(node->d);
+	  LOG_DEBUG(EV_TREE_TIMER, node->d);
 	  node->timerid = timerid;
 	  node->onHour = onHour;
 	  node->onMinute = onMinute;
 	  node->offHour = offHour;
 	  node->offMinute = offMinute;
+	  Changed(node);
 	}
       id_arr++;
     }
-  saveEEPROM();
+  MarkDirty();
 }
 
 void AVL_tree::RemoveTimer(const byte& timerid){
-  RemoveTimer(root, timerid);
-  saveEEPROM();
-}
-
-void AVL_tree::RemoveTimer(Node node, const byte& timerid){
-  if(node == NULL){
-    return;
-  }
-  if(node->timerid == timerid){
-    node->timerid = 255;
-  }
-  RemoveTimer(node->left, timerid);
-  RemoveTimer(node->right, timerid);
+  ForEach([&](Node& node){
+      if(node->timerid == timerid){
+	node->timerid = 255;
+	Changed(node);
+      }
+    });
+  MarkDirty();
+}
+
+void AVL_tree::TimerChanged(const byte& timerid){
+  ForEach([&](Node& node){
+      if(node->timerid == timerid)
+	Changed(node);
+    });
 }
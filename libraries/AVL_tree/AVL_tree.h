@@ -5,29 +5,102 @@
 #include <EEPROM.h>
 #include <Ethernet.h>
 
-typedef byte data;
+typedef uint16_t data; // Switch id, 1..TREE_MAX_ID
+#define TREE_MAX_ID 0xFFFE
+
+/*
+ * EEPROM: TREE_FORMAT at address 0, the switch count (2 bytes), then
+ * TREE_RECORD_SIZE bytes per switch sorted by id, then a CRC-16 over
+ * count and records. Any other value at address 0 is the count of the
+ * layout with 8 bit ids and no address (TREE_V1_RECORD_SIZE bytes per
+ * switch from address 1), which is loaded and saved again in this one.
+ *
+ * When EEPROM holds more switches than fit in RAM (a build with less
+ * free RAM than the one that saved them) the first ones that fit are
+ * loaded and the image is left read-only: saving the shorter set would
+ * lose the others. Changes then stay in RAM. Remove() clears the id of
+ * the switch's record in place, and the next one left out is loaded in
+ * its stead; once all fit the image is saved again as usual.
+ */
+/*
+ * Never a count of the 8 bit id layout: its EEPROM had room for 161
+ * switches, but its sketch kept at most 41 (CACHE_SIZE 40, and one more
+ * through an off-by-one in Insert()).
+ */
+#define TREE_FORMAT 0xA2
+#define TREE_HEADER_SIZE 3
+#define TREE_RECORD_SIZE 10
+#define TREE_V1_RECORD_SIZE 5
+#define TREE_CRC_SIZE 2
+#define TREE_EEPROM_SIZE(n) (TREE_HEADER_SIZE + TREE_RECORD_SIZE * (n) + TREE_CRC_SIZE) // Bytes used for n switches
+
+// Switches that fit in eepromBytes, at compile time when it is constant
+constexpr unsigned int TreeEepromCapacity(unsigned int eepromBytes){
+  return eepromBytes <= TREE_EEPROM_SIZE(0) ? 0
+    : (eepromBytes - TREE_EEPROM_SIZE(0)) / TREE_RECORD_SIZE < TREE_MAX_ID
+    ? (eepromBytes - TREE_EEPROM_SIZE(0)) / TREE_RECORD_SIZE : TREE_MAX_ID;
+}
+
+/*
+ * RAM per switch, avr-libc's malloc keeps the size of each block in
+ * front of it. See AVL_tree::Capacity().
+ */
+#define TREE_MALLOC_OVERHEAD 2
+#define TREE_NODE_RAM (sizeof(TreeNode) + TREE_MALLOC_OVERHEAD)
+
+#define TREE_BITMAP_CHUNK 32 // Status bytes per write of 'G:B', 256 switches
+
+#define TREE_FULL_LEVEL 15 // Dim level of a switch never dimmed, RC_DIM_LEVELS - 1
+
 //typedef struct TreeNode* Node;
 
 typedef struct TreeNode{
   data d;
+  unsigned long address; // RF address (see RC_ADDRESS), 0 to use the id as group code
   boolean status;
   byte timerid;
   byte offHour;
   byte offMinute;
   byte onHour;
   byte onMinute;
+  byte level;       // Last dim level, not saved to EEPROM
+  unsigned int gen; // Tree generation of last change, 0 if unchanged since boot
   struct TreeNode *left;
   struct TreeNode *right;
-  TreeNode(data k) { d = k; left = right = NULL; }
-  TreeNode() { left = right = NULL; }
+  TreeNode(data k) { d = k; address = 0; status = false; timerid = 255;
+    offHour = offMinute = onHour = onMinute = 0; level = TREE_FULL_LEVEL; gen = 0; left = right = NULL; }
+  TreeNode() { address = 0; level = TREE_FULL_LEVEL; gen = 0; left = right = NULL; }
 } *Node;
 
-typedef void(*ExternalFunction)(Node&);
+typedef void(*ChangeFunction)(data id); // Switch added, removed, switched or its timer edited
+
+/*
+ * In-order walk over the switches with ids from..to, without recursion.
+ * The stack holds the path from the root, an AVL tree of n nodes is at
+ * most 1.44 log2(n) high: 12 for 255 nodes, 16 for 2000, more than the
+ * RAM of a Mega holds. The tree must not be restructured (Insert,
+ * Remove) while walking it, changing node fields is fine.
+ */
+#define TREE_MAX_DEPTH 16
+
+class TreeIterator{
+ public:
+  TreeIterator(Node root, data from = 0, data to = TREE_MAX_ID);
+  Node Next(); // NULL after the last one
+
+ private:
+  void PushLeft(Node node);
+  Node mStack[TREE_MAX_DEPTH];
+  byte mDepth;
+  data mFrom;
+  data mTo;
+};
 
 class AVL_tree{
  public:
 
-  AVL_tree(byte maxSize);
+  AVL_tree(unsigned int maxSize, unsigned int maxRecords = TreeEepromCapacity(E2END + 1));
+  static unsigned int Capacity(unsigned int eepromBytes, unsigned int freeRam, unsigned int reserve, unsigned int perSwitch = 0);
   ~AVL_tree();
 
   boolean Insert(Node node, bool save = true);
@@ -38,21 +111,56 @@ class AVL_tree{
   void Clear();
   data FindMin();
   void RemoveMin();
-  void ForEach(ExternalFunction externalFunc);
+  // Call visit(Node&) for every switch (with id from..to), in id order
+  template<typename F> void ForEach(F&& visit){ ForEach(0, TREE_MAX_ID, visit); }
+  template<typename F> void ForEach(data from, data to, F&& visit){
+    TreeIterator it(root, from, to);
+    Node node;
+    while((node = it.Next()))
+      visit(node);
+  }
+  TreeIterator Range(data from, data to){ return TreeIterator(root, from, to); }
   boolean IsEmpty() const;
   // TODO: Add saveEEPROM(Node node) ( and use it where it could be used )
   void saveEEPROM(); // Saves all nodes in cache to EEPROM
   void loadEEPROM(); // Loads all nodes from EEPROM
-  void SendNodes(EthernetClient* client);
-  void SetStatus(byte id, byte status);
-  byte Size(){return mSize;}
-  void SetTimer(byte*& id_arr, byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute);
+  boolean FlushEEPROM(); // Writes one changed byte, true while more remain
+  boolean IsDirty(){return mDirty;}
+  boolean Upgraded(){return mUpgraded;} // Loaded from the 8 bit id layout
+  void ConvertEEPROM(); // Rewrite the 8 bit id layout in this one, all its switches
+  unsigned int Unloaded(){return mUnloaded;} // Switches left in EEPROM, read-only while any
+  void MarkDirty(); // Have FlushEEPROM save the cache, e.g. after SetStatus
+  void WriteImage(Print& out); // What saveEEPROM() leaves in EEPROM, from RAM
+  void Reload(); // Load again after the EEPROM was replaced, see Snapshot.h
+  static uint16_t Crc16(uint16_t crc, byte value); // CRC-16/CCITT, one byte
+  void SendNodes(Print* client);
+  void SendNode(data id, Print& out); // One G record, "id:-1N" if the switch is gone
+  static void WriteNode(Node node, Print& out, boolean stamp = false); // G record of any node
+  void SendChanges(unsigned int since, Print* client); // 'G:<gen>'
+  void SendStatusBits(Print& out); // 'G:B'
+  unsigned int Generation(){return mGeneration;}
+  unsigned int MembersGeneration(){return mMembersGen;} // Of the last add or remove
+  void OnChange(ChangeFunction func){mOnChange = func;}
+  void SetStatus(data id, byte status);
+  boolean SetLevel(data id, byte level); // Dimmed to level, which also means on
+  boolean SetAddress(data id, unsigned long address);
+  Node FindAddress(unsigned long address); // Switch with the RF address, NULL if none
+  unsigned int Size(){return mSize;}
+  unsigned int MaxSize(){return mMaxSize;}
+  void SetTimer(data*& id_arr, byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute);
   void RemoveTimer(const byte& timerid);
+  void TimerChanged(const byte& timerid); // Its rule did, the records stay as they are
 
  private:
-  void saveAllEEPROM(Node node, unsigned int& addr);
   void saveEEPROM(Node node, unsigned int& addr);
-  void saveEEPROM(Node node);
+  void SaveChecksum(unsigned int count);
+  boolean SaveChecksumByte(unsigned int count);
+  Node ReadNode(unsigned int& addr, uint16_t& crc, boolean v1 = false);
+  void ReadRecord(unsigned int& addr, uint16_t& crc, TreeNode& node, boolean v1);
+  Node Build(unsigned int count, unsigned int& addr, uint16_t& crc, data& last, boolean& sorted);
+  void LoadOneByOne(unsigned int count, unsigned int& addr, uint16_t& crc, boolean v1);
+  void EraseRecord(data d);
+  unsigned int StoredCount();
   Node Insert(Node& node, Node& newNode, bool save);
   Node Insert(Node& node, data d, bool save);
   int Height(Node node);
@@ -65,12 +173,39 @@ class AVL_tree{
   Node ExtractMin(Node& node);
   Node Remove(Node& node, data d);
   Node& Find(Node& node, data d);
-  void ForEach(Node& node, ExternalFunction externalFunc);
-  void SendNodes(Node node, EthernetClient* client);
-  void RemoveTimer(Node node, const byte& timerid);
+  void Changed(Node node);
+  void Removed(data id);
+  unsigned int NextGeneration();
   Node root; 
-  byte mMaxSize;
-  byte mSize;
+  unsigned int mMaxSize;
+  unsigned int mMaxRecords; // Records the EEPROM has room for
+  unsigned int mSize;
+  unsigned int mUnloaded;   // Records that didn't fit in RAM
+  boolean mDirty;   // Cache differs from EEPROM
+  boolean mUpgraded;
+  unsigned int mFlushIndex; // Record FlushEEPROM writes next
+  data mFlushNext;          // Lowest id it may hold
+  byte mFlushByte;          // Of that record
+  ChangeFunction mOnChange;
+  unsigned int mGeneration; // Bumped by every change, never 0 once bumped
+  unsigned int mRemovedGen; // Generation of the last Remove
+  unsigned int mMembersGen; // Generation of the last Insert or Remove
+};
+
+/*
+ * The cache in the first EepromBytes of EEPROM. MaxSwitches is known at
+ * compile time, and a board with room for fewer than MinSwitches does
+ * not compile. At boot the size is lowered to what the free RAM holds,
+ * see AVL_tree::Capacity().
+ */
+template<unsigned int EepromBytes, unsigned int MinSwitches>
+class SwitchCache : public AVL_tree{
+ public:
+  static const unsigned int MaxSwitches = TreeEepromCapacity(EepromBytes);
+  static_assert(MinSwitches <= MaxSwitches, "Too little EEPROM for MinSwitches");
+
+  SwitchCache(unsigned int freeRam, unsigned int reserve, unsigned int perSwitch = 0)
+    : AVL_tree(Capacity(EepromBytes, freeRam, reserve, perSwitch), MaxSwitches) {}
 };
 
 
@@ -0,0 +1,166 @@
+#ifndef __TREE_RECORD__
+#define __TREE_RECORD__
+
+#include <Arduino.h>
+
+/*
+ * EEPROM record layout of a switch, as types. A field is
+ *   TreeBytes<offset, count>  count whole bytes from byte offset, high byte first
+ *   TreeBits<offset, width>   width bits from bit offset, low bit first, bit
+ *                             offset k being bit k % 8 of byte k / 8
+ *   TreeNoneAt<offset>        not stored, reads 0, ordered at bit offset
+ * Each has get(record) and set(record, value). The byte loops are
+ * template recursion over constants, so every field compiles to the
+ * loads, shifts and masks of its own bytes, without loops or tables.
+ *
+ * A layout lists the fields of a node, see TreeLayout below, and
+ * PackRecord()/UnpackRecord() are generated from it. static_asserts check
+ * that its fields are in order, don't overlap and fill the record size.
+ */
+
+// Byte i of the spanned bytes of a bit field, and the ones after it
+template<unsigned int First, byte Shift, unsigned long Mask, byte I, byte Count>
+struct TreeBitBytes{
+  static const byte ByteMask = ((Mask << Shift) >> (8 * I)) & 0xFF;
+  static unsigned long get(const byte* record){
+    return ((unsigned long)record[First + I] << (8 * I)) | TreeBitBytes<First, Shift, Mask, I + 1, Count>::get(record);
+  }
+  static void set(byte* record, unsigned long value){
+    record[First + I] = (record[First + I] & ~ByteMask) | (((value << Shift) >> (8 * I)) & ByteMask);
+    TreeBitBytes<First, Shift, Mask, I + 1, Count>::set(record, value);
+  }
+};
+
+template<unsigned int First, byte Shift, unsigned long Mask, byte Count>
+struct TreeBitBytes<First, Shift, Mask, Count, Count>{
+  static unsigned long get(const byte*){ return 0; }
+  static void set(byte*, unsigned long){}
+};
+
+template<unsigned int Offset, byte Width>
+struct TreeBits{
+  static const unsigned int Start = Offset;
+  static const unsigned int End = Offset + Width; // Bit after the field
+  static const unsigned long Mask = Width == 32 ? 0xFFFFFFFFUL : (1UL << (Width % 32)) - 1;
+  static_assert(Width > 0 && Offset % 8 + Width <= 32, "Bit field spans more than 4 bytes");
+  typedef TreeBitBytes<Offset / 8, Offset % 8, Mask, 0, (End + 7) / 8 - Offset / 8> Span;
+  static unsigned long get(const byte* record){ return (Span::get(record) >> (Offset % 8)) & Mask; }
+  static void set(byte* record, unsigned long value){ Span::set(record, value & Mask); }
+};
+
+// Byte i of a high byte first field, and the ones after it
+template<unsigned int Offset, byte I, byte Count>
+struct TreeByteOrder{
+  static unsigned long get(const byte* record){
+    return ((unsigned long)record[Offset + I] << (8 * (Count - 1 - I))) | TreeByteOrder<Offset, I + 1, Count>::get(record);
+  }
+  static void set(byte* record, unsigned long value){
+    record[Offset + I] = (value >> (8 * (Count - 1 - I))) & 0xFF;
+    TreeByteOrder<Offset, I + 1, Count>::set(record, value);
+  }
+};
+
+template<unsigned int Offset, byte Count>
+struct TreeByteOrder<Offset, Count, Count>{
+  static unsigned long get(const byte*){ return 0; }
+  static void set(byte*, unsigned long){}
+};
+
+template<unsigned int Offset, byte Count>
+struct TreeBytes{
+  static const unsigned int Start = 8 * Offset;
+  static const unsigned int End = 8 * (Offset + Count);
+  static_assert(Count > 0 && Count <= 4, "Byte field of more than 4 bytes");
+  static unsigned long get(const byte* record){ return TreeByteOrder<Offset, 0, Count>::get(record); }
+  static void set(byte* record, unsigned long value){ TreeByteOrder<Offset, 0, Count>::set(record, value); }
+};
+
+template<unsigned int At>
+struct TreeNoneAt{
+  static const unsigned int Start = At;
+  static const unsigned int End = At;
+  static unsigned long get(const byte*){ return 0; }
+  static void set(byte*, unsigned long){}
+};
+
+// Fields in order and apart, the last one ending in the last byte of size
+template<class A, class B> struct TreeFollows{
+  static const bool value = A::End <= B::Start;
+};
+
+template<class L, byte Size> struct TreeLayoutCheck{
+  static_assert(TreeFollows<typename L::Id, typename L::Address>::value
+		&& TreeFollows<typename L::Address, typename L::Timer>::value
+		&& TreeFollows<typename L::Timer, typename L::Status>::value
+		&& TreeFollows<typename L::Status, typename L::OnHour>::value
+		&& TreeFollows<typename L::OnHour, typename L::OnMinute>::value
+		&& TreeFollows<typename L::OnMinute, typename L::OffHour>::value
+		&& TreeFollows<typename L::OffHour, typename L::OffMinute>::value,
+		"Record fields overlap or are out of order");
+  static_assert((L::OffMinute::End + 7) / 8 == Size, "Record fields don't fill the record size");
+  static const bool value = true;
+};
+
+/*
+ *     Bit: |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |
+ * Byte 1-2:  Switch id, high byte first
+ * Byte 3-6:  RF address, high byte first
+ * Byte 7:  | TId | TId | TId | TId | TId | TId | TId | TId |
+ * Byte 8:  | OnM1| OnM0| OnH4| OnH3| OnH2| OnH1| OnH0|Status|
+ * Byte 9:  |OffH3|OffH2|OffH1|OffH0| OnM5| OnM4| OnM3| OnM2|
+ * Byte 10: |NONE |OffM5|OffM4|OffM3|OffM2|OffM1|OffM0|OffH4|
+ *
+ * OnHour, OffHour = 5 bit
+ * OnMinute, OffMinute = 6 bit
+ * Status = 1 bit
+ */
+struct TreeLayout{
+  typedef TreeBytes<0, 2> Id;
+  typedef TreeBytes<2, 4> Address;
+  typedef TreeBytes<6, 1> Timer;
+  typedef TreeBits<56, 1> Status;
+  typedef TreeBits<57, 5> OnHour;
+  typedef TreeBits<62, 6> OnMinute;
+  typedef TreeBits<68, 5> OffHour;
+  typedef TreeBits<73, 6> OffMinute;
+};
+
+// The 8 bit id layout: bytes 1, 7, 8, 9 and 10 of the one above
+struct TreeLayoutV1{
+  typedef TreeBytes<0, 1> Id;
+  typedef TreeNoneAt<8> Address;
+  typedef TreeBytes<1, 1> Timer;
+  typedef TreeBits<16, 1> Status;
+  typedef TreeBits<17, 5> OnHour;
+  typedef TreeBits<22, 6> OnMinute;
+  typedef TreeBits<28, 5> OffHour;
+  typedef TreeBits<33, 6> OffMinute;
+};
+
+template<class L, class Node>
+void PackRecord(const Node& node, byte* record)
+{
+  L::Id::set(record, node.d);
+  L::Address::set(record, node.address);
+  L::Timer::set(record, node.timerid);
+  L::Status::set(record, node.status ? 1 : 0);
+  L::OnHour::set(record, node.onHour);
+  L::OnMinute::set(record, node.onMinute);
+  L::OffHour::set(record, node.offHour);
+  L::OffMinute::set(record, node.offMinute);
+}
+
+template<class L, class Node>
+void UnpackRecord(const byte* record, Node& node)
+{
+  node.d = L::Id::get(record);
+  node.address = L::Address::get(record);
+  node.timerid = L::Timer::get(record);
+  node.status = L::Status::get(record);
+  node.onHour = L::OnHour::get(record);
+  node.onMinute = L::OnMinute::get(record);
+  node.offHour = L::OffHour::get(record);
+  node.offMinute = L::OffMinute::get(record);
+}
+
+#endif
@@ -1,9 +1,247 @@
 #include <iostream>
+#include <string>
 #include "AVL_tree.h"
-using namespace std;
 
+// Keeps what was printed, and in how many writes
+class CapturePrint : public Print {
+ public:
+  CapturePrint() : writes(0) {}
+  size_t write(uint8_t value){ return write(&value, 1); }
+  size_t write(const uint8_t* buffer, size_t size){
+    text.append((const char*)buffer, size);
+    ++writes;
+    return size;
+  }
+  std::string text;
+  int writes;
+};
+
+/*
+ * Host check of the cache, built by host/Makefile. EEPROM starts out
+ * empty there.
+ */
 int main()
 {
-  AVL_tree* tree = new AVL_tree();
+  AVL_tree* tree = new AVL_tree(40);
+  for(int id = 10; id < 40; ++id)
+    tree->Insert(id);
+  for(int id = 10; id < 40; ++id){
+    if(!tree->Contains(id)){
+      std::cout << "Missing " << int(id) << std::endl;
+      return 1;
+    }
+  }
+  tree->Remove(20);
+  if(tree->Contains(20) || tree->Size() != 29){
+    std::cout << "Remove failed" << std::endl;
+    return 1;
+  }
+  if(tree->FindMin() != 10){
+    std::cout << "FindMin failed" << std::endl;
+    return 1;
+  }
+
+  // Visits in id order, ranges start and stop at the nearest ids
+  int last = 0;
+  int visited = 0;
+  tree->ForEach([&](Node& node){
+      if(node->d <= last)
+	visited = -1000;
+      last = node->d;
+      ++visited;
+    });
+  if(visited != 29){
+    std::cout << "ForEach failed" << std::endl;
+    return 1;
+  }
+  TreeIterator it = tree->Range(18, 22);
+  const int expected[] = { 18, 19, 21, 22 };
+  for(int i = 0; i < 4; ++i){
+    Node node = it.Next();
+    if(!node || node->d != expected[i]){
+      std::cout << "Range failed" << std::endl;
+      return 1;
+    }
+  }
+  visited = 0;
+  tree->ForEach(0, 9, [&](Node&){ ++visited; });
+  tree->ForEach(40, 255, [&](Node&){ ++visited; });
+  if(it.Next() || visited != 0){
+    std::cout << "Range end failed" << std::endl;
+    return 1;
+  }
+
+  // Saved sorted with a CRC, loaded back without inserting one by one
+  tree->SetStatus(31, 1);
+  tree->SetAddress(32, 0x8F000123UL);
+  tree->saveEEPROM();
+  delete tree;
+  tree = new AVL_tree(40);
+  if(tree->Size() != 29 || tree->Contains(20) || tree->IsDirty()){
+    std::cout << "Load failed" << std::endl;
+    return 1;
+  }
+  for(int id = 10; id < 40; ++id){
+    if(id != 20 && !tree->Contains(id)){
+      std::cout << "Not loaded " << id << std::endl;
+      return 1;
+    }
+  }
+  if(!tree->Find(31)->status || tree->Find(30)->status){
+    std::cout << "Status not loaded" << std::endl;
+    return 1;
+  }
+  if(tree->Find(32)->address != 0x8F000123UL || tree->FindAddress(0x8F000123UL) != tree->Find(32)){
+    std::cout << "Address not loaded" << std::endl;
+    return 1;
+  }
+
+  // A damaged block still loads, and is saved again
+  EEPROM.write(TREE_HEADER_SIZE + TREE_RECORD_SIZE * 3 + 1, 77);
+  delete tree;
+  tree = new AVL_tree(40);
+  if(tree->Size() != 29 || !tree->Contains(77) || !tree->IsDirty()){
+    std::cout << "Load after CRC error failed" << std::endl;
+    return 1;
+  }
+  while(tree->FlushEEPROM())
+    ;
+  delete tree;
+  tree = new AVL_tree(40);
+  if(tree->Size() != 29 || !tree->Contains(77) || tree->IsDirty()){
+    std::cout << "Flush after CRC error failed" << std::endl;
+    return 1;
+  }
+  delete tree;
+
+  // Full means full, ids past 255
+  tree = new AVL_tree(3);
+  tree->Clear();
+  bool inserted = tree->Insert(300) && tree->Insert(65000) && tree->Insert(1);
+  if(!inserted || tree->Insert(2) || tree->Size() != 3 || tree->FindMin() != 1){
+    std::cout << "Capacity failed" << std::endl;
+    return 1;
+  }
+  tree->saveEEPROM();
+  delete tree;
+  tree = new AVL_tree(40);
+  if(tree->Size() != 3 || !tree->Contains(300) || !tree->Contains(65000)){
+    std::cout << "Wide ids not loaded" << std::endl;
+    return 1;
+  }
+  delete tree;
+
+  // The 8 bit id layout is read and saved again in this one
+  const byte v1[] = { 2,  12, 255, 1, 0, 0,  40, 3, 0x2C, 0x22, 0x15 };
+  for(unsigned int i = 0; i < sizeof(v1); ++i)
+    EEPROM.write(i, v1[i]);
+  tree = new AVL_tree(40);
+  Node timed = tree->Find(40);
+  if(!tree->Upgraded() || !tree->IsDirty() || tree->Size() != 2 || !tree->Find(12)->status
+     || !timed || timed->timerid != 3 || timed->onHour != 22 || timed->onMinute != 8
+     || timed->offHour != 18 || timed->offMinute != 10){
+    std::cout << "Upgrade failed" << std::endl;
+    return 1;
+  }
+  while(tree->FlushEEPROM())
+    ;
+  delete tree;
+  tree = new AVL_tree(40);
+  if(tree->Upgraded() || tree->IsDirty() || tree->Size() != 2 || tree->Find(40)->offMinute != 10){
+    std::cout << "Save after upgrade failed" << std::endl;
+    return 1;
+  }
+  delete tree;
+
+  // More switches than fit in RAM: the rest stay in EEPROM, left as it is
+  tree = new AVL_tree(40);
+  tree->Clear();
+  for(int id = 1; id <= 40; ++id)
+    tree->Insert(id);
+  tree->saveEEPROM();
+  delete tree;
+  tree = new AVL_tree(15);
+  tree->SetStatus(3, 1);
+  tree->MarkDirty();
+  while(tree->FlushEEPROM())
+    ;
+  if(tree->Size() != 15 || tree->Unloaded() != 25 || tree->IsDirty() || EEPROM.read(2) != 40){
+    std::cout << "Overflow load failed" << std::endl;
+    return 1;
+  }
+  // Removing one loads one left out, and the image loses it too
+  tree->Remove(2);
+  if(tree->Size() != 15 || tree->Unloaded() != 24 || tree->Contains(2) || !tree->Contains(16) || tree->Contains(17)){
+    std::cout << "Remove in overflow failed" << std::endl;
+    return 1;
+  }
+  delete tree;
+  tree = new AVL_tree(73);
+  if(tree->Size() != 39 || tree->Unloaded() || tree->Contains(2) || !tree->Contains(40) || !tree->IsDirty()){
+    std::cout << "Load after overflow failed" << std::endl;
+    return 1;
+  }
+  while(tree->FlushEEPROM())
+    ;
+  delete tree;
+  tree = new AVL_tree(73);
+  if(tree->Size() != 39 || tree->IsDirty()){
+    std::cout << "Save after overflow failed" << std::endl;
+    return 1;
+  }
+  delete tree;
+
+  // So is the 8 bit id layout, converted in EEPROM with all its switches
+  EEPROM.write(0, 20);
+  for(int i = 0; i < 20; ++i){
+    const byte record[] = { (byte)(10 + i), 255, 0, 0, 0 };
+    for(int j = 0; j < TREE_V1_RECORD_SIZE; ++j)
+      EEPROM.write(1 + TREE_V1_RECORD_SIZE * i + j, record[j]);
+  }
+  tree = new AVL_tree(15);
+  if(!tree->Upgraded() || tree->Size() != 15 || tree->Unloaded() != 5 || tree->IsDirty()){
+    std::cout << "Upgrade in overflow failed" << std::endl;
+    return 1;
+  }
+  tree->ConvertEEPROM();
+  delete tree;
+  tree = new AVL_tree(73);
+  if(tree->Upgraded() || tree->Size() != 20 || !tree->Contains(29) || tree->Find(29)->timerid != 255){
+    std::cout << "Conversion failed" << std::endl;
+    return 1;
+  }
+  delete tree;
+
+  // Status bits in id order, one write per 256 switches
+  tree = new AVL_tree(300);
+  tree->Clear(); // Those saved above
+  for(int id = 300; id > 0; --id)
+    tree->Insert(id);
+  for(int id = 3; id <= 300; id += 3)
+    tree->SetStatus(id, 1);
+  CapturePrint bits;
+  tree->SendStatusBits(bits);
+  unsigned int gen = tree->MembersGeneration();
+  boolean match = bits.writes == 2 && bits.text.size() == 4 + 38
+    && (byte)bits.text[0] == gen >> 8 && (byte)bits.text[1] == (gen & 0xFF)
+    && bits.text[2] == 1 && bits.text[3] == 300 - 256;
+  for(int id = 1; id <= 300 && match; ++id)
+    match = ((bits.text[4 + (id - 1) / 8] >> ((id - 1) % 8)) & 1) == (id % 3 == 0);
+  tree->SetStatus(1, 1);
+  if(!match || gen != 300 || tree->MembersGeneration() != gen){
+    std::cout << "Status bits failed" << std::endl;
+    return 1;
+  }
+  delete tree;
+
+  // The planner takes the smaller of what EEPROM and RAM hold
+  if(AVL_tree::Capacity(TREE_EEPROM_SIZE(50), 0, 300) != 50
+     || AVL_tree::Capacity(TREE_EEPROM_SIZE(50), 300 + 10 * TREE_NODE_RAM, 300) != 10
+     || AVL_tree::Capacity(TREE_EEPROM_SIZE(50), 300 + 10 * (TREE_NODE_RAM + 6), 300, 6) != 10
+     || AVL_tree::Capacity(4, 200, 300) != 0){
+    std::cout << "Capacity planner failed" << std::endl;
+    return 1;
+  }
+  std::cout << "AVL_tree OK" << std::endl;
   return 0;
 }
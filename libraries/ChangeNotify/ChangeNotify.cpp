@@ -0,0 +1,171 @@
+#include "ChangeNotify.h"
+#include <EventLog.h>
+
+ChangeNotify::ChangeNotify()
+{
+  mTree = NULL;
+  mOnDatagram = NULL;
+  mHead = 0;
+  mCount = 0;
+  mSeq = 0;
+  mPushed = 0;
+  memset(mSubscribers, 0, sizeof(mSubscribers));
+}
+
+/*
+ * (Re)open the socket, also needed after the interface was
+ * re-initialized for a new address.
+ */
+void ChangeNotify::begin(AVL_tree* tree)
+{
+  mTree = tree;
+  mUdp.stop();
+  mUdp.begin(NOTIFY_PORT);
+}
+
+// Called by the tree for every change to switch id, after its generation was bumped
+void ChangeNotify::record(data id)
+{
+  mSeq = mTree->Generation();
+  mHead = (mHead + 1) % NOTIFY_LOG_SIZE;
+  mIds[mHead] = id;
+  if(mCount < NOTIFY_LOG_SIZE)
+    ++mCount;
+}
+
+/*
+ * The cache was replaced (a snapshot restored). The changes are not
+ * known, subscribers get an R datagram and 'D' the full state.
+ */
+void ChangeNotify::reset()
+{
+  mSeq = mTree->Generation();
+  mCount = 0;
+}
+
+/*
+ * Handle waiting datagrams and push what changed since the last
+ * call to every subscriber, one datagram each.
+ */
+void ChangeNotify::poll()
+{
+  readRequest();
+  for(byte i = 0; i < NOTIFY_SUBSCRIBERS; ++i){
+    Subscriber& s = mSubscribers[i];
+    if(s.port && millis() - s.since >= NOTIFY_LEASE * 1000UL)
+      s.port = 0;
+  }
+  if(mPushed == mSeq)
+    return;
+  for(byte i = 0; i < NOTIFY_SUBSCRIBERS; ++i){
+    if(mSubscribers[i].port)
+      push(IPAddress(mSubscribers[i].ip), mSubscribers[i].port);
+  }
+#if NOTIFY_BROADCAST
+  push(IPAddress(255, 255, 255, 255), NOTIFY_PORT);
+#endif
+  mPushed = mSeq;
+}
+
+// 'D': changes after seq, or everything if they are no longer known
+void ChangeNotify::sendSince(unsigned int seq, Print& out)
+{
+  if(seq != 0 && (unsigned int)(mSeq - seq) <= mCount){
+    writeChanges(seq, out);
+  }
+  else{
+    writeHeader('F', out);
+    mTree->SendNodes(&out);
+  }
+}
+
+void ChangeNotify::readRequest()
+{
+  for(byte n = 0; n < NOTIFY_READS && mUdp.parsePacket() > 0; ++n){
+    int command = mUdp.peek();
+    if(command != 'U' && command != 'N'){
+      if(mOnDatagram)
+	mOnDatagram(mUdp);
+      mUdp.flush();
+      continue;
+    }
+    IPAddress ip = mUdp.remoteIP();
+    unsigned int port = mUdp.remotePort();
+    mUdp.flush();
+    if(command == 'U')
+      subscribe(ip, port);
+    else
+      unsubscribe(ip, port);
+  }
+}
+
+void ChangeNotify::subscribe(IPAddress ip, unsigned int port)
+{
+  Subscriber* slot = NULL;
+  for(byte i = 0; i < NOTIFY_SUBSCRIBERS; ++i){
+    Subscriber& s = mSubscribers[i];
+    if(s.port == port && ip == s.ip){
+      slot = &s; // Renewal
+      break;
+    }
+    if(!s.port && !slot)
+      slot = &s;
+  }
+  if(!slot){
+    LOG_WARN(EV_NOTIFY_FULL, port);
+    return;
+  }
+  for(byte i = 0; i < 4; ++i)
+    slot->ip[i] = ip[i];
+  slot->port = port;
+  slot->since = millis();
+  LOG_INFO(EV_NOTIFY_SUBSCRIBE, port);
+
+  mUdp.beginPacket(ip, port);
+  writeHeader('R', mUdp);
+  mUdp.endPacket();
+}
+
+void ChangeNotify::unsubscribe(IPAddress ip, unsigned int port)
+{
+  for(byte i = 0; i < NOTIFY_SUBSCRIBERS; ++i){
+    Subscriber& s = mSubscribers[i];
+    if(s.port == port && ip == s.ip){
+      s.port = 0;
+      LOG_INFO(EV_NOTIFY_UNSUBSCRIBE, port);
+    }
+  }
+}
+
+void ChangeNotify::push(IPAddress ip, unsigned int port)
+{
+  mUdp.beginPacket(ip, port);
+  if((unsigned int)(mSeq - mPushed) <= mCount)
+    writeChanges(mPushed, mUdp);
+  else
+    writeHeader('R', mUdp);
+  mUdp.endPacket();
+}
+
+// Header and one record per switch changed after seq, oldest first
+void ChangeNotify::writeChanges(unsigned int seq, Print& out)
+{
+  writeHeader('D', out);
+  byte n = mSeq - seq;
+  for(byte k = n; k-- > 0; ){
+    data id = mIds[(mHead + NOTIFY_LOG_SIZE - k) % NOTIFY_LOG_SIZE];
+    boolean later = false; // Sent with a newer change instead
+    for(byte j = 0; j < k && !later; ++j)
+      later = mIds[(mHead + NOTIFY_LOG_SIZE - j) % NOTIFY_LOG_SIZE] == id;
+    if(!later)
+      mTree->SendNode(id, out);
+  }
+}
+
+void ChangeNotify::writeHeader(char mode, Print& out)
+{
+  out.print(mSeq);
+  out.print(':');
+  out.print(mode);
+  out.print('N');
+}
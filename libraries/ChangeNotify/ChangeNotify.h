@@ -0,0 +1,89 @@
+#ifndef _CHANGE_NOTIFY_
+#define _CHANGE_NOTIFY_
+
+#include "Arduino.h"
+#include <SPI.h>
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+#include <AVL_tree.h>
+
+/**
+ *
+ * #### Change notifications ####
+ *
+ * Every change to a switch (added, removed, switched, timer edited) bumps
+ * the tree's generation, which is used as sequence number here. The last
+ * NOTIFY_LOG_SIZE changes are kept so a client that knows sequence N can
+ * ask for what changed after it instead of fetching every switch with
+ * 'G'. Unlike 'G:<gen>', 'D' also reports removed switches without
+ * falling back to the full state.
+ *
+ * Changes reply, used for the 'D' command and for pushed datagrams:
+ *   <seq>:D N <records>   Switches changed after the asked sequence
+ *   <seq>:F N <records>   Too far behind, every switch follows (as 'G')
+ *   <seq>:R N             Changes were lost, ask with 'D'
+ * Records are the 'G' records, a removed switch is sent as <id>:-1N.
+ * Sequence 0 is never used, asking for changes after 0 always gives the
+ * full state.
+ *
+ * Subscribing: send a UDP datagram "U" to NOTIFY_PORT. The changes then
+ * come as datagrams to the port it was sent from, each covering what
+ * happened since the previous one. The reply to "U" is an R datagram.
+ * Subscriptions end after NOTIFY_LEASE seconds unless renewed with
+ * another "U", or at once with "N".
+ *
+ * A reboot starts over from sequence 0, clients seeing a sequence lower
+ * than their own should fetch the full state.
+ *
+ * Other datagrams to NOTIFY_PORT go to the onDatagram() function, so
+ * other modules can share the socket (see Federation.h).
+ */
+#define NOTIFY_PORT 8888       // UDP
+#define NOTIFY_LOG_SIZE 16     // Changes kept for 'D'
+#define NOTIFY_SUBSCRIBERS 4
+#define NOTIFY_LEASE 600       // Seconds
+#define NOTIFY_BROADCAST 0     // 1: also push every change to the LAN broadcast address
+#define NOTIFY_READS 4         // Datagrams handled per poll()
+
+typedef struct {
+  byte ip[4];
+  unsigned int port;    // 0 if the slot is free
+  unsigned long since;  // millis() of last "U"
+} Subscriber;
+
+typedef void (*DatagramFunction)(EthernetUDP& udp); // Read from the start of the datagram
+
+class ChangeNotify {
+ public:
+
+  ChangeNotify();
+
+  void begin(AVL_tree* tree);
+  void record(data id);
+  void reset(); // Every switch may have changed
+  void poll();
+  void sendSince(unsigned int seq, Print& out);
+  unsigned int sequence(){return mSeq;}
+  void onDatagram(DatagramFunction func){mOnDatagram = func;}
+  EthernetUDP* udp(){return &mUdp;}
+
+ private:
+  void readRequest();
+  void subscribe(IPAddress ip, unsigned int port);
+  void unsubscribe(IPAddress ip, unsigned int port);
+  void push(IPAddress ip, unsigned int port);
+  void writeChanges(unsigned int seq, Print& out);
+  void writeHeader(char mode, Print& out);
+
+  AVL_tree* mTree;
+  EthernetUDP mUdp;
+  DatagramFunction mOnDatagram;
+  data mIds[NOTIFY_LOG_SIZE]; // Switch id per change, ring
+  byte mHead;                 // Newest change
+  byte mCount;
+  unsigned int mSeq;          // Sequence of newest change
+  unsigned int mPushed;       // Sequence subscribers have been sent
+  Subscriber mSubscribers[NOTIFY_SUBSCRIBERS];
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "CoopScheduler.h"
+#include <avr/sleep.h>
+#include <EventLog.h>
+
+CoopScheduler::CoopScheduler(){
+  mCount = 0;
+  mRefused = 0;
+  mNextBackground = 0;
+  mIdleMicros = 0;
+}
+
+/*
+ * Register a task. Returns its id, which is also its index in the stats,
+ * or MAX_TASKS if the table is full. The table has no spare room, a task
+ * left out is logged and counted in refused().
+ */
+byte CoopScheduler::add(TaskFunction func, unsigned long period, unsigned long deadline, ReadyFunction ready)
+{
+  if(mCount >= MAX_TASKS){
+    ++mRefused;
+    LOG_WARN(EV_TASKS_FULL, mCount);
+    return MAX_TASKS;
+  }
+  Task& task = mTasks[mCount];
+  task.func = func;
+  task.ready = ready;
+  task.period = period;
+  task.deadline = deadline;
+  task.release = millis();
+  task.runs = 0;
+  task.overruns = 0;
+  task.maxMicros = 0;
+  task.maxLate = 0;
+  return mCount++;
+}
+
+bool CoopScheduler::run()
+{
+  unsigned long now = millis();
+
+  // Earliest deadline first among released periodic tasks
+  Task* next = NULL;
+  for(byte i = 0; i < mCount; ++i){
+    Task& task = mTasks[i];
+    if(task.period == 0 || (long)(now - task.release) < 0)
+      continue;
+    if(next == NULL || (long)((task.release + task.deadline) - (next->release + next->deadline)) < 0)
+      next = &task;
+  }
+  if(next){
+    execute(*next, now);
+    next->release += next->period;
+    // Don't try to catch up on releases that were missed entirely
+    if((long)(now - next->release) >= (long)next->period)
+      next->release = now + next->period;
+    return true;
+  }
+
+  // Nothing due, give the slice to the next background task
+  for(byte i = 0; i < mCount; ++i){
+    Task& task = mTasks[mNextBackground];
+    mNextBackground = (mNextBackground + 1) % mCount;
+    if(task.period == 0 && (task.ready == NULL || task.ready())){
+      execute(task, now);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Sleep until a periodic task is released or a background task is ready
+void CoopScheduler::idle()
+{
+  unsigned long start = micros();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while(!due(millis()) && !ready()){
+    sleep_enable();
+    sleep_cpu();
+    sleep_disable();
+  }
+  mIdleMicros += micros() - start;
+}
+
+bool CoopScheduler::due(unsigned long now)
+{
+  for(byte i = 0; i < mCount; ++i)
+    if(mTasks[i].period && (long)(now - mTasks[i].release) >= 0)
+      return true;
+  return false;
+}
+
+bool CoopScheduler::ready()
+{
+  for(byte i = 0; i < mCount; ++i)
+    if(mTasks[i].period == 0 && (mTasks[i].ready == NULL || mTasks[i].ready()))
+      return true;
+  return false;
+}
+
+void CoopScheduler::execute(Task& task, unsigned long now)
+{
+  if(task.period && now - task.release > task.maxLate)
+    task.maxLate = now - task.release;
+  unsigned long start = micros();
+  task.func();
+  unsigned long elapsed = micros() - start;
+  ++task.runs;
+  if(elapsed > task.maxMicros)
+    task.maxMicros = elapsed;
+  if(task.period && (long)(millis() - (task.release + task.deadline)) > 0)
+    ++task.overruns;
+}
+
+void CoopScheduler::resetStats()
+{
+  for(byte i = 0; i < mCount; ++i){
+    mTasks[i].runs = 0;
+    mTasks[i].overruns = 0;
+    mTasks[i].maxMicros = 0;
+    mTasks[i].maxLate = 0;
+  }
+  mIdleMicros = 0;
+}
+
+unsigned long CoopScheduler::maxSlice()
+{
+  unsigned long longest = 0;
+  for(byte i = 0; i < mCount; ++i)
+    if(mTasks[i].maxMicros > longest)
+      longest = mTasks[i].maxMicros;
+  return longest;
+}
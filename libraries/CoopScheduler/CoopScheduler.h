@@ -0,0 +1,78 @@
+#ifndef _COOP_SCHEDULER_
+#define _COOP_SCHEDULER_
+
+#include "Arduino.h"
+
+/**
+ *
+ * #### Cooperative scheduler ####
+ *
+ * Runs one task per call to run(), so loop() never does more than one
+ * slice of work before it comes back. Tasks must return quickly and keep
+ * their own state between calls.
+ *
+ * Periodic tasks (period > 0) are released every period ms and must
+ * finish within deadline ms of their release. When several are due the
+ * one with the earliest deadline runs first.
+ *
+ * Background tasks (period = 0) run round robin whenever no periodic task
+ * is due, which is where the old delay(100) used to be. A background
+ * task with a ready function is skipped while it returns false.
+ *
+ * A run that ends after its deadline counts as an overrun.
+ *
+ * When run() finds nothing to do, idle() sleeps the MCU until the next
+ * periodic release. Idle mode only stops the CPU clock: timer 0 keeps
+ * millis() counting and its tick (every 1.024 ms), pin change, UART and
+ * SPI interrupts all wake it, after which the ready functions are
+ * checked again. So the sleep ends at the latest one tick after work
+ * turns up.
+ */
+#ifndef MAX_TASKS
+#define MAX_TASKS 8 // Task is 28 bytes of RAM on the AVR
+#endif
+
+typedef void(*TaskFunction)();
+typedef bool(*ReadyFunction)(); // Background task has work
+
+typedef struct {
+  TaskFunction func;
+  ReadyFunction ready;     // NULL = always
+  unsigned long period;    // ms, 0 = background
+  unsigned long deadline;  // ms after release
+  unsigned long release;   // millis() of next release
+  unsigned int runs;
+  unsigned int overruns;
+  unsigned long maxMicros; // Longest run
+  unsigned long maxLate;   // ms, longest start delay after release
+} Task;
+
+class CoopScheduler {
+ public:
+
+  CoopScheduler();
+
+  byte add(TaskFunction func, unsigned long period, unsigned long deadline, ReadyFunction ready = NULL);
+  bool run(); // false if nothing was due or ready
+  void idle();
+
+  byte count(){return mCount;}
+  byte refused(){return mRefused;} // Tasks add() had no room for
+  const Task& task(byte id){return mTasks[id];}
+  void resetStats();
+  unsigned long maxSlice(); // Longest run of any task, in us
+  unsigned long idleMillis(){return mIdleMicros / 1000;} // Slept since resetStats()
+
+ private:
+  void execute(Task& task, unsigned long now);
+  bool due(unsigned long now);
+  bool ready();
+
+  Task mTasks[MAX_TASKS];
+  byte mCount;
+  byte mRefused;
+  byte mNextBackground;
+  unsigned long mIdleMicros;
+};
+
+#endif
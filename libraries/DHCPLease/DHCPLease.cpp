@@ -0,0 +1,320 @@
+#include "DHCPLease.h"
+#include <EEPROM.h>
+#include <EventLog.h>
+
+// DHCP message types (option 53)
+#define DHCP_DISCOVER 1
+#define DHCP_OFFER 2
+#define DHCP_REQUEST 3
+#define DHCP_ACK 5
+#define DHCP_NAK 6
+
+// DHCP options
+#define OPT_PAD 0
+#define OPT_SUBNET 1
+#define OPT_ROUTER 3
+#define OPT_DNS 6
+#define OPT_REQUESTED_IP 50
+#define OPT_LEASE_TIME 51
+#define OPT_MESSAGE_TYPE 53
+#define OPT_SERVER_ID 54
+#define OPT_PARAM_LIST 55
+#define OPT_RENEW_TIME 58
+#define OPT_CLIENT_ID 61
+#define OPT_END 255
+
+#define DHCP_HEADER_SIZE 236 // Fixed part, before magic cookie
+
+static const byte magicCookie[] = { 0x63, 0x82, 0x53, 0x63 };
+
+DHCPLease::DHCPLease(const byte* mac, unsigned int eepromAddr)
+  : mMac(mac), mEepromAddr(eepromAddr)
+{
+  mState = INIT;
+  mConfigured = false;
+  mLeaseTime = DHCP_DEFAULT_LEASE;
+  mRenewTime = DHCP_DEFAULT_LEASE / 2;
+  memset(&mLease, 0, sizeof(mLease));
+  memset(&mReply, 0, sizeof(mReply));
+  memset(mServer, 0, sizeof(mServer));
+}
+
+/*
+ * Bring up the interface without waiting for a DHCP server.
+ * With a cached lease the server is reachable right away on the old
+ * address, otherwise the interface starts on 0.0.0.0 until the first ACK.
+ */
+void DHCPLease::begin()
+{
+  loadLease();
+  Ethernet.begin((byte*)mMac, IPAddress(mLease.ip), IPAddress(mLease.dns),
+                 IPAddress(mLease.gateway), IPAddress(mLease.subnet));
+  mUdp.begin(DHCP_CLIENT_PORT);
+  mXid = micros() ^ ((unsigned long)mMac[4] << 24) ^ ((unsigned long)mMac[5] << 16);
+  mRetry = DHCP_RETRY_MIN;
+  if(mConfigured){
+    // INIT-REBOOT: ask to keep the cached address
+    mReply = mLease;
+    mState = REQUESTING;
+    sendMessage(DHCP_REQUEST);
+  }
+  else{
+    mState = INIT;
+  }
+}
+
+/*
+ * Drive the state machine one step. Sends at most one packet and reads
+ * at most one reply, never waits.
+ */
+byte DHCPLease::maintain()
+{
+  byte reply;
+  switch(mState)
+    {
+    case INIT:
+      ++mXid;
+      memset(mServer, 0, sizeof(mServer));
+      mRetry = DHCP_RETRY_MIN;
+      mState = SELECTING;
+      sendMessage(DHCP_DISCOVER);
+      break;
+    case SELECTING:
+      if(readReply() == DHCP_OFFER){
+	mRetry = DHCP_RETRY_MIN;
+	mState = REQUESTING;
+	sendMessage(DHCP_REQUEST);
+      }
+      else if(timedOut()){
+	retransmitLater();
+	sendMessage(DHCP_DISCOVER);
+      }
+      break;
+    case REQUESTING:
+    case RENEWING:
+      reply = readReply();
+      if(reply == DHCP_ACK){
+	mState = BOUND;
+	reply = apply();
+	// The W5100 has only four sockets, give this one back until T1
+	mUdp.stop();
+	return reply;
+      }
+      if(reply == DHCP_NAK){
+	LOG_WARN(EV_DHCP_NAK, 0);
+	mState = INIT;
+      }
+      else if(timedOut()){
+	if(mState == REQUESTING && mRetry >= DHCP_RETRY_MAX){
+	  mState = INIT;
+	}
+	else if(mState == RENEWING && (millis() - mBoundAt)/1000 >= mLeaseTime){
+	  // Lease expired. Keep running on the old address and start over.
+	  LOG_WARN(EV_DHCP_EXPIRED, 0);
+	  mState = INIT;
+	}
+	else{
+	  retransmitLater();
+	  sendMessage(DHCP_REQUEST);
+	}
+      }
+      break;
+    case BOUND:
+      if((millis() - mBoundAt)/1000 >= mRenewTime){
+	++mXid;
+	mRetry = DHCP_RETRY_MIN;
+	mState = RENEWING;
+	mUdp.begin(DHCP_CLIENT_PORT);
+	sendMessage(DHCP_REQUEST);
+      }
+      break;
+    }
+  return DHCP_NOTHING;
+}
+
+boolean DHCPLease::isBound()
+{
+  return mState == BOUND || mState == RENEWING;
+}
+
+IPAddress DHCPLease::localIP()
+{
+  return IPAddress(mLease.ip);
+}
+
+boolean DHCPLease::timedOut()
+{
+  return (millis() - mSentAt)/1000 >= mRetry;
+}
+
+void DHCPLease::retransmitLater()
+{
+  if(mRetry < DHCP_RETRY_MAX)
+    mRetry *= 2;
+}
+
+void DHCPLease::sendMessage(byte type)
+{
+  byte i;
+  mUdp.beginPacket(IPAddress(255, 255, 255, 255), DHCP_SERVER_PORT);
+  mUdp.write((byte)1); // op: BOOTREQUEST
+  mUdp.write((byte)1); // htype: ethernet
+  mUdp.write((byte)6); // hlen
+  mUdp.write((byte)0); // hops
+  mUdp.write((byte)(mXid >> 24));
+  mUdp.write((byte)(mXid >> 16));
+  mUdp.write((byte)(mXid >> 8));
+  mUdp.write((byte)mXid);
+  mUdp.write((byte)0); // secs
+  mUdp.write((byte)0);
+  mUdp.write((byte)0x80); // flags: broadcast reply
+  mUdp.write((byte)0);
+  // ciaddr is only filled in when renewing an address we already use
+  if(mState == RENEWING)
+    mUdp.write(mLease.ip, 4);
+  else
+    for(i = 0; i < 4; ++i) mUdp.write((byte)0);
+  for(i = 0; i < 12; ++i) mUdp.write((byte)0); // yiaddr, siaddr, giaddr
+  mUdp.write(mMac, 6);                          // chaddr
+  for(i = 0; i < 10; ++i) mUdp.write((byte)0);
+  for(i = 0; i < 192; ++i) mUdp.write((byte)0); // sname, file
+  mUdp.write(magicCookie, 4);
+
+  mUdp.write((byte)OPT_MESSAGE_TYPE);
+  mUdp.write((byte)1);
+  mUdp.write(type);
+  mUdp.write((byte)OPT_CLIENT_ID);
+  mUdp.write((byte)7);
+  mUdp.write((byte)1);
+  mUdp.write(mMac, 6);
+  if(type == DHCP_REQUEST && mState == REQUESTING){
+    mUdp.write((byte)OPT_REQUESTED_IP);
+    mUdp.write((byte)4);
+    mUdp.write(mReply.ip, 4);
+    if(mServer[0] | mServer[1] | mServer[2] | mServer[3]){
+      mUdp.write((byte)OPT_SERVER_ID);
+      mUdp.write((byte)4);
+      mUdp.write(mServer, 4);
+    }
+  }
+  mUdp.write((byte)OPT_PARAM_LIST);
+  mUdp.write((byte)4);
+  mUdp.write((byte)OPT_SUBNET);
+  mUdp.write((byte)OPT_ROUTER);
+  mUdp.write((byte)OPT_DNS);
+  mUdp.write((byte)OPT_LEASE_TIME);
+  mUdp.write((byte)OPT_END);
+  mUdp.endPacket();
+  mSentAt = millis();
+}
+
+/*
+ * Read one pending reply, if any. Returns the DHCP message type, or 0 if
+ * there was nothing for us. Parsed options end up in mReply.
+ */
+byte DHCPLease::readReply()
+{
+  if(mUdp.parsePacket() <= 0)
+    return 0;
+
+  byte header[20];
+  if(mUdp.read(header, sizeof(header)) != sizeof(header) || header[0] != 2){
+    mUdp.flush();
+    return 0;
+  }
+  unsigned long xid = ((unsigned long)header[4] << 24) | ((unsigned long)header[5] << 16)
+    | ((unsigned long)header[6] << 8) | header[7];
+  if(xid != mXid){
+    mUdp.flush();
+    return 0;
+  }
+  memcpy(mReply.ip, &header[16], 4); // yiaddr
+
+  // Skip rest of fixed header and check magic cookie
+  for(unsigned int i = sizeof(header); i < DHCP_HEADER_SIZE; ++i)
+    mUdp.read();
+  for(byte i = 0; i < 4; ++i){
+    if(mUdp.read() != magicCookie[i]){
+      mUdp.flush();
+      return 0;
+    }
+  }
+
+  byte type = 0;
+  unsigned long renewTime = 0;
+  mLeaseTime = DHCP_DEFAULT_LEASE;
+  while(mUdp.available()){
+    byte option = mUdp.read();
+    if(option == OPT_PAD)
+      continue;
+    if(option == OPT_END)
+      break;
+    byte len = mUdp.read();
+    byte value[4] = { 0, 0, 0, 0 };
+    for(byte i = 0; i < len; ++i){
+      byte b = mUdp.read();
+      if(i < 4)
+	value[i] = b;
+    }
+    unsigned long seconds = ((unsigned long)value[0] << 24) | ((unsigned long)value[1] << 16)
+      | ((unsigned long)value[2] << 8) | value[3];
+    switch(option)
+      {
+      case OPT_MESSAGE_TYPE: type = value[0]; break;
+      case OPT_SUBNET: memcpy(mReply.subnet, value, 4); break;
+      case OPT_ROUTER: memcpy(mReply.gateway, value, 4); break;
+      case OPT_DNS: memcpy(mReply.dns, value, 4); break;
+      case OPT_SERVER_ID: memcpy(mServer, value, 4); break;
+      case OPT_LEASE_TIME: mLeaseTime = seconds; break;
+      case OPT_RENEW_TIME: renewTime = seconds; break;
+      }
+  }
+  mUdp.flush();
+  mRenewTime = renewTime ? renewTime : mLeaseTime / 2;
+  return type;
+}
+
+/*
+ * Take the acknowledged lease into use. The interface is only
+ * re-initialized if the config actually changed, since that resets all
+ * open sockets.
+ */
+byte DHCPLease::apply()
+{
+  mBoundAt = millis();
+  if(mConfigured && memcmp(&mLease, &mReply, sizeof(LeaseConfig)) == 0){
+    LOG_DEBUG(EV_DHCP_RENEWED, 0);
+    return DHCP_RENEWED;
+  }
+  mLease = mReply;
+  mConfigured = true;
+  Ethernet.begin((byte*)mMac, IPAddress(mLease.ip), IPAddress(mLease.dns),
+                 IPAddress(mLease.gateway), IPAddress(mLease.subnet));
+  saveLease();
+  LOG_INFO(EV_DHCP_ADDRESS, (mLease.ip[2] << 8) | mLease.ip[3]);
+  return DHCP_CHANGED;
+}
+
+void DHCPLease::loadLease()
+{
+  if(EEPROM.read(mEepromAddr) != DHCP_LEASE_MAGIC){
+    mConfigured = false;
+    return;
+  }
+  byte* p = (byte*)&mLease;
+  for(byte i = 0; i < sizeof(LeaseConfig); ++i)
+    p[i] = EEPROM.read(mEepromAddr + 1 + i);
+  mConfigured = true;
+}
+
+// Only bytes that changed are written, to spare the EEPROM.
+void DHCPLease::saveLease()
+{
+  if(EEPROM.read(mEepromAddr) != DHCP_LEASE_MAGIC)
+    EEPROM.write(mEepromAddr, DHCP_LEASE_MAGIC);
+  const byte* p = (const byte*)&mLease;
+  for(byte i = 0; i < sizeof(LeaseConfig); ++i){
+    if(EEPROM.read(mEepromAddr + 1 + i) != p[i])
+      EEPROM.write(mEepromAddr + 1 + i, p[i]);
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef _DHCP_LEASE_
+#define _DHCP_LEASE_
+
+#include "Arduino.h"
+#include <SPI.h>
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+
+/**
+ *
+ * #### Non-blocking DHCP client ####
+ *
+ * Ethernet.begin(mac) and Ethernet.maintain() block until the DHCP
+ * exchange is done (or times out), during which nothing else runs.
+ * This client sends one packet at a time and checks for the reply on
+ * the next call to maintain(), so loop() keeps running timers and RF
+ * commands even when the DHCP server is gone.
+ *
+ * At boot the last leased address is read from EEPROM and the interface
+ * is brought up on it as a static config. The lease is then confirmed
+ * (INIT-REBOOT) in the background.
+ *
+ * EEPROM (DHCP_LEASE_SIZE bytes from the address given to the constructor):
+ * Byte 0:     DHCP_LEASE_MAGIC if a lease is stored
+ * Byte 1-4:   Local IP
+ * Byte 5-8:   Gateway
+ * Byte 9-12:  DNS server
+ * Byte 13-16: Subnet mask
+ */
+#define DHCP_LEASE_SIZE 17
+#define DHCP_LEASE_MAGIC 0x4C
+
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+
+#define DHCP_RETRY_MIN 4     // Seconds before first retransmit
+#define DHCP_RETRY_MAX 64    // Seconds, retransmit backoff ceiling
+#define DHCP_DEFAULT_LEASE 3600 // Seconds, if server gives no lease time
+
+// Return codes from maintain()
+#define DHCP_NOTHING 0
+#define DHCP_RENEWED 1 // Lease confirmed, address unchanged
+#define DHCP_CHANGED 2 // New address, interface was re-initialized
+
+typedef struct {
+  byte ip[4];
+  byte gateway[4];
+  byte dns[4];
+  byte subnet[4];
+} LeaseConfig;
+
+class DHCPLease {
+ public:
+
+  DHCPLease(const byte* mac, unsigned int eepromAddr);
+
+  void begin();
+  byte maintain();
+
+  boolean isBound();
+  IPAddress localIP();
+
+ private:
+  enum State {
+    INIT,        // No lease, send DISCOVER
+    SELECTING,   // Waiting for OFFER
+    REQUESTING,  // Waiting for ACK
+    BOUND,       // Lease valid, waiting for T1
+    RENEWING     // REQUEST sent, waiting for ACK
+  };
+
+  void sendMessage(byte type);
+  byte readReply();
+  boolean timedOut();
+  void retransmitLater();
+  byte apply();
+  void loadLease();
+  void saveLease();
+
+  const byte* mMac;
+  const unsigned int mEepromAddr;
+  EthernetUDP mUdp;
+
+  State mState;
+  unsigned long mXid;
+  unsigned long mSentAt;     // millis()
+  unsigned int mRetry;       // Seconds until retransmit
+  unsigned long mBoundAt;    // millis()
+  unsigned long mLeaseTime;  // Seconds
+  unsigned long mRenewTime;  // Seconds (T1)
+
+  LeaseConfig mLease;  // What the interface is running on
+  LeaseConfig mReply;  // Parsed from the last OFFER/ACK
+  byte mServer[4];     // Server identifier, zero for INIT-REBOOT
+  boolean mConfigured; // mLease is applied to the interface
+};
+
+#endif
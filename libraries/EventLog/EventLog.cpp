@@ -0,0 +1,52 @@
+#include "EventLog.h"
+
+#define LOG_LINE_MAX 12 // "D255:65535\r\n"
+
+LogRecord EventLog::sBuffer[LOG_BUFFER_SIZE];
+byte EventLog::sHead = 0;
+byte EventLog::sCount = 0;
+unsigned int EventLog::sDropped = 0;
+
+static const char levelChar[] = { '-', 'E', 'W', 'I', 'D' };
+
+// Store a record, or count it as dropped if the buffer is full.
+void EventLog::write(byte level, byte event, unsigned int arg)
+{
+  if(sCount >= LOG_BUFFER_SIZE){
+    if(sDropped != 0xFFFF)
+      ++sDropped;
+    return;
+  }
+  LogRecord& record = sBuffer[(sHead + sCount) % LOG_BUFFER_SIZE];
+  record.level = level;
+  record.event = event;
+  record.arg = arg;
+  ++sCount;
+}
+
+/*
+ * Print buffered records for as long as the output can take a whole line
+ * without blocking.
+ */
+void EventLog::drain(Print& out)
+{
+  while(out.availableForWrite() >= LOG_LINE_MAX){
+    if(sDropped){
+      out.print('W');
+      out.print((byte)EV_LOG_DROPPED);
+      out.print(':');
+      out.println(sDropped);
+      sDropped = 0;
+      continue;
+    }
+    if(sCount == 0)
+      return;
+    const LogRecord& record = sBuffer[sHead];
+    out.print(levelChar[record.level]);
+    out.print(record.event);
+    out.print(':');
+    out.println(record.arg);
+    sHead = (sHead + 1) % LOG_BUFFER_SIZE;
+    --sCount;
+  }
+}
@@ -0,0 +1,133 @@
+#ifndef _EVENT_LOG_
+#define _EVENT_LOG_
+
+#include "Arduino.h"
+
+/**
+ *
+ * #### Event log ####
+ *
+ * Replaces Serial.print debugging. A log call stores a one byte event
+ * code and a 16 bit argument in a RAM ring buffer and returns at once;
+ * drain() later writes as many records to Serial as fit in its TX buffer
+ * without waiting. RF timing and request handling never wait for the
+ * UART.
+ *
+ * Levels above LOG_LEVEL compile to nothing.
+ *
+ * Serial output, one line per record:
+ *   <level><event>:<argument>    e.g. "I12:151"
+ * Level is E, W, I or D. Records that didn't fit in the buffer are
+ * reported as EV_LOG_DROPPED with the number lost.
+ */
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#define LOG_LEVEL LOG_LEVEL_INFO
+#define LOG_BUFFER_SIZE 16 // Records, 4 bytes each
+
+/*
+ * Event codes. Argument in parentheses. Never renumber, host side tools
+ * decode the numbers.
+ */
+enum {
+  EV_LOG_DROPPED = 0,     // (records lost)
+  EV_SETUP_START = 1,
+  EV_SETUP_DONE = 2,
+  EV_SERVER_ADDRESS = 3,  // (last two octets of IP)
+  EV_CACHE_LOADED = 4,    // (switches)
+  EV_CLIENT_CONNECTED = 5,
+  EV_CLIENT_DISCONNECTED = 6,
+  EV_COMMAND = 7,         // (command character)
+  EV_RESPONSE_OK = 8,
+  EV_RESPONSE_NOK = 9,
+  EV_TIME = 10,           // (hour * 100 + minute)
+  EV_TIMER_SET = 11,      // (timer id)
+  EV_TIMER_SWITCH = 12,   // (switch id)
+  EV_TIMER_CHECK = 13,    // (switch id)
+  EV_TIMER_ON = 14,       // (switch id)
+  EV_TIMER_OFF = 15,      // (switch id)
+  EV_DHCP_NAK = 16,
+  EV_DHCP_EXPIRED = 17,
+  EV_DHCP_RENEWED = 18,
+  EV_DHCP_ADDRESS = 19,   // (last two octets of IP)
+  EV_NTP_SYNC = 20,
+  EV_RF_SEND = 21,        // (controller)
+  EV_TREE_SAVE = 22,      // (switch id)
+  EV_TREE_LOAD = 23,      // (switch id)
+  EV_TREE_NOT_FOUND = 24, // (switch id)
+  EV_TREE_STATUS = 25,    // (switch id * 2 + status)
+  EV_TREE_TIMER = 26,     // (switch id)
+  EV_UNKNOWN_COMMAND = 27, // (command character)
+  EV_NOTIFY_SUBSCRIBE = 28,   // (port)
+  EV_NOTIFY_UNSUBSCRIBE = 29, // (port)
+  EV_NOTIFY_FULL = 30,        // (port refused)
+  EV_SCENE_SAVED = 31,        // (scene id)
+  EV_SCENE_REMOVED = 32,      // (scene id)
+  EV_SCENE_TRIGGERED = 33,    // (scene id)
+  EV_SCHEDULE_FULL = 34,      // (timer id left out, 255 no table at boot)
+  EV_TIMER_EXPIRED = 35,      // (timer id)
+  EV_TREE_CRC = 36,           // (switches in EEPROM, loaded one by one)
+  EV_RF_RECEIVED = 37,        // (controller)
+  EV_RF_LEARNED = 38,         // (switch id added)
+  EV_TREE_LEVEL = 39,         // (switch id)
+  EV_DIM = 40,                // (switch id)
+  EV_TREE_UPGRADE = 41,       // (switches in the 8 bit id layout)
+  EV_EEPROM_MOVED = 42,       // (0)
+  EV_FED_PEER = 43,           // (last two octets of the unit found)
+  EV_FED_PEER_LOST = 44,      // (last two octets)
+  EV_FED_FORWARD = 45,        // (switch id)
+  EV_FED_LOST = 46,           // (last two octets of the unit that never acked)
+  EV_FED_REFUSED = 47,        // (last two octets of the unit that refused)
+  EV_FED_FULL = 48,           // (last two octets of the unit left out)
+  EV_SNAPSHOT_SENT = 49,      // (switches)
+  EV_SNAPSHOT_LOADED = 50,    // (switches)
+  EV_SNAPSHOT_FAILED = 51,    // (image bytes read)
+  EV_TASKS_FULL = 52,         // (tasks registered)
+  EV_TREE_OVERFLOW = 53       // (switches left in EEPROM, it is read-only)
+};
+
+typedef struct {
+  byte level;
+  byte event;
+  unsigned int arg;
+} LogRecord;
+
+class EventLog {
+ public:
+  static void write(byte level, byte event, unsigned int arg);
+  static void drain(Print& out);
+  static bool pending(){return sCount || sDropped;}
+
+ private:
+  static LogRecord sBuffer[LOG_BUFFER_SIZE];
+  static byte sHead;
+  static byte sCount;
+  static unsigned int sDropped;
+};
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(event, arg) EventLog::write(LOG_LEVEL_ERROR, event, arg)
+#else
+#define LOG_ERROR(event, arg) do {} while(0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(event, arg) EventLog::write(LOG_LEVEL_WARN, event, arg)
+#else
+#define LOG_WARN(event, arg) do {} while(0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(event, arg) EventLog::write(LOG_LEVEL_INFO, event, arg)
+#else
+#define LOG_INFO(event, arg) do {} while(0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(event, arg) EventLog::write(LOG_LEVEL_DEBUG, event, arg)
+#else
+#define LOG_DEBUG(event, arg) do {} while(0)
+#endif
+
+#endif
@@ -0,0 +1,389 @@
+#include "Federation.h"
+#include <ChangeNotify.h>
+#include <EventLog.h>
+
+#if FED_ENABLED
+
+static_assert(TreeLayoutCheck<FedRecordLayout, FED_RECORD_SIZE>::value, "FedRecordLayout");
+
+// Enough of an address to tell units apart in the log
+static unsigned int ipTail(IPAddress ip)
+{
+  return (ip[2] << 8) | ip[3];
+}
+
+Federation::Federation()
+{
+  mTree = NULL;
+  mUdp = NULL;
+  mOnSwitch = NULL;
+  mOnTimer = NULL;
+  memset(mPeers, 0, sizeof(mPeers));
+  for(byte i = 0; i < FED_REMOTE_SWITCHES; ++i)
+    mSwitches[i].peer = FED_NONE;
+  mRemoteCount = 0;
+  memset(mOutbox, 0, sizeof(mOutbox));
+  mSeq = 0;
+  mWaiting = 0;
+  mRefused = false;
+  mAnnouncedGen = 0;
+  mAnnouncedAt = 0;
+}
+
+// udp is the change notification socket, see ChangeNotify::onDatagram
+void Federation::begin(AVL_tree* tree, EthernetUDP* udp, FedSwitchFunction onSwitch, FedTimerFunction onTimer)
+{
+  mTree = tree;
+  mUdp = udp;
+  mOnSwitch = onSwitch;
+  mOnTimer = onTimer;
+  mAnnouncedAt = millis() - FED_ANNOUNCE_INTERVAL; // Announce at once
+}
+
+void Federation::receive(EthernetUDP& udp)
+{
+  if(udp.read() != FED_MAGIC)
+    return;
+  IPAddress ip = udp.remoteIP();
+  if(ip == Ethernet.localIP())
+    return; // Our own broadcast
+  switch(udp.read()){
+  case FED_ANNOUNCE:
+    readAnnounce(udp, findPeer(ip, true));
+    break;
+  case FED_SWITCH:
+    readSwitch(udp);
+    break;
+  case FED_TIMER:
+    readTimer(udp);
+    break;
+  case FED_ACK:
+    readAck(udp, findPeer(ip, false));
+    break;
+  }
+}
+
+/*
+ * Drop peers that went quiet, announce our switches when they changed
+ * or it is time to, and send forwards again that weren't acked.
+ */
+void Federation::poll()
+{
+  unsigned long now = millis();
+  for(byte i = 0; i < FED_PEERS; ++i)
+    if(mPeers[i].live && now - mPeers[i].seen > FED_PEER_TIMEOUT)
+      dropPeer(i);
+  if((mTree->Generation() != mAnnouncedGen && now - mAnnouncedAt >= FED_ANNOUNCE_GAP)
+     || now - mAnnouncedAt >= FED_ANNOUNCE_INTERVAL)
+    announce();
+  for(byte i = 0; i < FED_OUTBOX; ++i){
+    FedMessage& message = mOutbox[i];
+    if(!message.tries || now - message.sent < FED_ACK_TIMEOUT)
+      continue;
+    if(message.tries >= FED_RETRIES){
+      LOG_WARN(EV_FED_LOST, ipTail(IPAddress(mPeers[message.peer].ip)));
+      answered(message, false);
+    }
+    else{
+      send(message);
+    }
+  }
+}
+
+byte Federation::owner(data id)
+{
+  if(mTree->Contains(id))
+    return FED_NONE;
+  FedSwitch* s = findSwitch(id);
+  return s && !(s->peer & FED_STALE) ? s->peer : FED_NONE;
+}
+
+boolean Federation::forwardSwitch(data id, boolean on)
+{
+  byte peer = owner(id);
+  if(peer == FED_NONE)
+    return false;
+  byte payload[] = { FED_SWITCH, 0, (byte)(id >> 8), (byte)(id & 0xFF), (byte)(on ? 1 : 0) };
+  if(!queue(peer, payload, sizeof(payload)))
+    return false;
+  // Shown at once, the owner's next announcement confirms it
+  FedRecordLayout::Status::set(findSwitch(id)->record, on ? 1 : 0);
+  LOG_INFO(EV_FED_FORWARD, id);
+  return true;
+}
+
+/*
+ * Forward the ids (ending with 0) that peers own to them, at most
+ * FED_TIMER_IDS per datagram, and remove them from ids. False, and
+ * nothing sent, unless all the forwards fit in the outbox: units must
+ * not disagree on the timer.
+ */
+boolean Federation::forwardTimer(data* ids, byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute)
+{
+  byte needed = 0;
+  for(byte peer = 0; peer < FED_PEERS; ++peer){
+    byte owned = 0;
+    for(byte i = 0; ids[i]; ++i)
+      if(owner(ids[i]) == peer)
+	++owned;
+    needed += (owned + FED_TIMER_IDS - 1) / FED_TIMER_IDS;
+  }
+  if(needed > freeSlots())
+    return false;
+  for(byte peer = 0; peer < FED_PEERS; ){
+    byte payload[FED_PAYLOAD] = { FED_TIMER, 0, timerid, onHour, onMinute, offHour, offMinute };
+    byte length = 7;
+    byte kept = 0;
+    for(byte i = 0; ids[i]; ++i){
+      if(length + 2 <= 7 + 2 * FED_TIMER_IDS && owner(ids[i]) == peer){
+	payload[length++] = ids[i] >> 8;
+	payload[length++] = ids[i] & 0xFF;
+	LOG_INFO(EV_FED_FORWARD, ids[i]);
+      }
+      else{
+	ids[kept++] = ids[i];
+      }
+    }
+    ids[kept] = 0;
+    if(length > 7)
+      queue(peer, payload, length);
+    if(length < 7 + 2 * FED_TIMER_IDS)
+      ++peer; // Otherwise the same peer may own more of them
+  }
+  return true;
+}
+
+void Federation::sendSwitches(Print& out)
+{
+  for(byte i = 0; i < FED_REMOTE_SWITCHES; ++i){
+    if(mSwitches[i].peer == FED_NONE)
+      continue;
+    TreeNode node(0);
+    UnpackRecord<FedRecordLayout>(mSwitches[i].record, node);
+    AVL_tree::WriteNode(&node, out);
+  }
+}
+
+byte Federation::peers()
+{
+  byte n = 0;
+  for(byte i = 0; i < FED_PEERS; ++i)
+    if(mPeers[i].live)
+      ++n;
+  return n;
+}
+
+void Federation::announce()
+{
+  mUdp->beginPacket(IPAddress(255, 255, 255, 255), NOTIFY_PORT);
+  mUdp->write(FED_MAGIC);
+  mUdp->write(FED_ANNOUNCE);
+  byte n = 0;
+  mTree->ForEach([&](Node& node){
+      if(n == FED_REMOTE_SWITCHES)
+	return;
+      byte record[FED_RECORD_SIZE] = {0};
+      PackRecord<FedRecordLayout>(*node, record);
+      mUdp->write(record, FED_RECORD_SIZE);
+      ++n;
+    });
+  mUdp->endPacket();
+  if(mTree->Size() > FED_REMOTE_SWITCHES && mTree->Generation() != mAnnouncedGen)
+    LOG_WARN(EV_FED_FULL, ipTail(Ethernet.localIP())); // Once per change
+  mAnnouncedGen = mTree->Generation();
+  mAnnouncedAt = millis();
+}
+
+// The peer's switches are replaced by those in the announcement
+void Federation::readAnnounce(EthernetUDP& udp, byte peer)
+{
+  if(peer == FED_NONE)
+    return;
+  mPeers[peer].seen = millis();
+  for(byte i = 0; i < FED_REMOTE_SWITCHES; ++i)
+    if(mSwitches[i].peer == peer)
+      mSwitches[i].peer = peer | FED_STALE;
+  byte record[FED_RECORD_SIZE];
+  boolean full = false;
+  while(udp.read(record, FED_RECORD_SIZE) == FED_RECORD_SIZE){
+    data id = FedRecordLayout::Id::get(record);
+    FedSwitch* s = findSwitch(id);
+    if(s && (s->peer & ~FED_STALE) != peer)
+      continue; // Another unit has it
+    if(!s)
+      s = findSwitch(0);
+    if(!s){
+      full = true;
+      continue;
+    }
+    memcpy(s->record, record, FED_RECORD_SIZE);
+    s->peer = peer;
+  }
+  mRemoteCount = 0;
+  for(byte i = 0; i < FED_REMOTE_SWITCHES; ++i){
+    if(mSwitches[i].peer == (peer | FED_STALE))
+      mSwitches[i].peer = FED_NONE;
+    if(mSwitches[i].peer != FED_NONE)
+      ++mRemoteCount;
+  }
+  if(full)
+    LOG_WARN(EV_FED_FULL, ipTail(IPAddress(mPeers[peer].ip)));
+}
+
+void Federation::readSwitch(EthernetUDP& udp)
+{
+  byte in[4]; // seq, id, on
+  if(udp.read(in, sizeof(in)) != sizeof(in))
+    return;
+  data id = in[1] << 8 | in[2];
+  ack(udp, in[0], mOnSwitch && mTree->Contains(id) && mOnSwitch(id, in[3] == 1));
+}
+
+void Federation::readTimer(EthernetUDP& udp)
+{
+  byte in[6]; // seq, timerid, onHour, onMinute, offHour, offMinute
+  if(udp.read(in, sizeof(in)) != sizeof(in))
+    return;
+  data ids[FED_TIMER_IDS + 1];
+  byte n = 0;
+  byte id[2];
+  while(n < FED_TIMER_IDS && udp.read(id, 2) == 2)
+    ids[n++] = id[0] << 8 | id[1];
+  ids[n] = 0;
+  ack(udp, in[0], mOnTimer && n && mOnTimer(in[1], in[2], in[3], in[4], in[5], ids));
+}
+
+void Federation::readAck(EthernetUDP& udp, byte peer)
+{
+  byte in[2]; // seq, ok
+  if(peer == FED_NONE || udp.read(in, sizeof(in)) != sizeof(in))
+    return;
+  for(byte i = 0; i < FED_OUTBOX; ++i){
+    FedMessage& message = mOutbox[i];
+    if(message.tries && message.peer == peer && message.payload[1] == in[0]){
+      if(!in[1])
+	LOG_WARN(EV_FED_REFUSED, ipTail(IPAddress(mPeers[peer].ip)));
+      answered(message, in[1]);
+    }
+  }
+}
+
+void Federation::ack(EthernetUDP& udp, byte seq, boolean ok)
+{
+  byte out[] = { FED_MAGIC, FED_ACK, seq, (byte)(ok ? 1 : 0) };
+  udp.beginPacket(udp.remoteIP(), udp.remotePort());
+  udp.write(out, sizeof(out));
+  udp.endPacket();
+}
+
+// Peer with the address, added if add and there is room, FED_NONE if not found
+byte Federation::findPeer(IPAddress ip, boolean add)
+{
+  byte free = FED_NONE;
+  for(byte i = 0; i < FED_PEERS; ++i){
+    if(mPeers[i].live && ip == mPeers[i].ip)
+      return i;
+    if(!mPeers[i].live && free == FED_NONE)
+      free = i;
+  }
+  if(!add)
+    return FED_NONE;
+  if(free == FED_NONE){
+    LOG_WARN(EV_FED_FULL, ipTail(ip));
+    return FED_NONE;
+  }
+  FedPeer& peer = mPeers[free];
+  for(byte i = 0; i < 4; ++i)
+    peer.ip[i] = ip[i];
+  peer.live = true;
+  peer.seen = millis();
+  LOG_INFO(EV_FED_PEER, ipTail(IPAddress(peer.ip)));
+  mAnnouncedAt = millis() - FED_ANNOUNCE_INTERVAL; // Let it know our switches
+  return free;
+}
+
+void Federation::dropPeer(byte peer)
+{
+  LOG_WARN(EV_FED_PEER_LOST, ipTail(IPAddress(mPeers[peer].ip)));
+  mPeers[peer].live = false;
+  for(byte i = 0; i < FED_REMOTE_SWITCHES; ++i){
+    if((mSwitches[i].peer & ~FED_STALE) == peer){
+      mSwitches[i].peer = FED_NONE;
+      --mRemoteCount;
+    }
+  }
+  for(byte i = 0; i < FED_OUTBOX; ++i)
+    if(mOutbox[i].tries && mOutbox[i].peer == peer)
+      answered(mOutbox[i], false);
+}
+
+// Replica slot of the switch, id 0 finds a free one
+FedSwitch* Federation::findSwitch(data id)
+{
+  for(byte i = 0; i < FED_REMOTE_SWITCHES; ++i){
+    FedSwitch& s = mSwitches[i];
+    if(id == 0 ? s.peer == FED_NONE : (s.peer != FED_NONE && FedRecordLayout::Id::get(s.record) == id))
+      return &s;
+  }
+  return NULL;
+}
+
+// Earlier forwards still in the outbox are sent on, their answers no longer count
+void Federation::await()
+{
+  for(byte i = 0; i < FED_OUTBOX; ++i)
+    mOutbox[i].awaited = false;
+  mWaiting = 0;
+  mRefused = false;
+}
+
+// Acked, refused or given up on: the slot is free
+void Federation::answered(FedMessage& message, boolean ok)
+{
+  message.tries = 0;
+  if(!message.awaited)
+    return;
+  message.awaited = false;
+  --mWaiting;
+  if(!ok)
+    mRefused = true;
+}
+
+boolean Federation::queue(byte peer, const byte* payload, byte length)
+{
+  for(byte i = 0; i < FED_OUTBOX; ++i){
+    FedMessage& message = mOutbox[i];
+    if(message.tries)
+      continue;
+    message.peer = peer;
+    message.length = length;
+    memcpy(message.payload, payload, length);
+    message.payload[1] = ++mSeq;
+    message.awaited = true;
+    ++mWaiting;
+    send(message);
+    return true;
+  }
+  return false;
+}
+
+byte Federation::freeSlots()
+{
+  byte n = 0;
+  for(byte i = 0; i < FED_OUTBOX; ++i)
+    if(!mOutbox[i].tries)
+      ++n;
+  return n;
+}
+
+void Federation::send(FedMessage& message)
+{
+  mUdp->beginPacket(IPAddress(mPeers[message.peer].ip), NOTIFY_PORT);
+  mUdp->write(FED_MAGIC);
+  mUdp->write(message.payload, message.length);
+  mUdp->endPacket();
+  ++message.tries;
+  message.sent = millis();
+}
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef _FEDERATION_
+#define _FEDERATION_
+
+#include "Arduino.h"
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+#include <AVL_tree.h>
+#include <TreeRecord.h>
+
+/**
+ *
+ * #### Federation ####
+ *
+ * Several units on one LAN act as one site. Each unit owns the switches
+ * in its own tree. Any unit accepts 'S' and 'T' for switches owned by
+ * another one and forwards them, and 'G' on any unit also lists the
+ * switches of the others.
+ *
+ * All datagrams go through the change notification socket (UDP
+ * NOTIFY_PORT): the W5100 has four sockets and the server, DHCP, NTP and
+ * notifications use them all. Federation datagrams start with FED_MAGIC,
+ * which no notification request does.
+ *
+ *   FED_MAGIC 'H' <records>             Announce, broadcast
+ *   FED_MAGIC 'S' seq id(2) on          Switch, to the owner
+ *   FED_MAGIC 'T' seq timerid onHour onMinute offHour offMinute id(2)...
+ *                                       Timer, to the owner
+ *   FED_MAGIC 'A' seq ok                Ack of 'S'/'T'
+ *
+ * Announcements carry the switches of the sender as FED_RECORD_SIZE
+ * records (FedRecordLayout, the switch record without the RF address),
+ * the first FED_REMOTE_SWITCHES of them: all a peer keeps, in one
+ * datagram of 146 bytes. The switches of a unit with more than that are
+ * not seen by the others (EV_FED_FULL).
+ * A unit announces when its tree changed, at most every
+ * FED_ANNOUNCE_GAP ms, and otherwise every FED_ANNOUNCE_INTERVAL ms.
+ * That is also how units find each other. A peer that hasn't announced
+ * for FED_PEER_TIMEOUT ms is dropped together with its switches.
+ *
+ * Forwarded commands are sent again every FED_ACK_TIMEOUT ms until acked,
+ * at most FED_RETRIES times. Both are idempotent, a repeat whose ack was
+ * lost does no harm. A request is answered once the owners acked the
+ * forwards it made (await(), then waiting() and refused()): OK, or NOK
+ * if one refused or never acked, within FED_RETRIES * FED_ACK_TIMEOUT
+ * ms. NOK at once if no live peer owns the switch or too many forwards
+ * are waiting for acks. Scenes are forwarded switch by switch.
+ *
+ * Switch ids are assumed to be unique on the site. A switch in the
+ * local tree is never forwarded.
+ *
+ * The tables take about 265 bytes of RAM, more than an Uno can spare
+ * (see the RAM budget in smarthome.ino). Federation is built where RAM
+ * allows unless FED_ENABLED says otherwise; without it the unit is a
+ * site of its own, owner() knows no switches and nothing is forwarded.
+ */
+#ifndef FED_ENABLED
+#define FED_ENABLED (RAMEND > 0x8FF)
+#endif
+#define FED_MAGIC 0xF5
+#define FED_PEERS 3
+#define FED_REMOTE_SWITCHES 24  // Switches of peers kept for 'G'
+#define FED_OUTBOX 2            // Forwards waiting for an ack
+#define FED_PAYLOAD 20          // Bytes of a forward, after FED_MAGIC
+#define FED_TIMER_IDS 6         // Switch ids per forwarded 'T'
+#define FED_ANNOUNCE_INTERVAL 5000 // ms
+#define FED_ANNOUNCE_GAP 200       // ms
+#define FED_PEER_TIMEOUT 15000     // ms
+#define FED_ACK_TIMEOUT 250        // ms
+#define FED_RETRIES 3
+#define FED_NONE 255            // No peer
+
+#define FED_ANNOUNCE 'H'
+#define FED_SWITCH 'S'
+#define FED_TIMER 'T'
+#define FED_ACK 'A'
+
+#define FED_RECORD_SIZE 6
+#define FED_STALE 0x80          // In FedSwitch.peer while an announcement is read
+
+// Switch record on the wire and in the replica, see TreeRecord.h
+struct FedRecordLayout{
+  typedef TreeBytes<0, 2> Id;
+  typedef TreeNoneAt<16> Address;
+  typedef TreeBytes<2, 1> Timer;
+  typedef TreeBits<24, 1> Status;
+  typedef TreeBits<25, 5> OnHour;
+  typedef TreeBits<30, 6> OnMinute;
+  typedef TreeBits<36, 5> OffHour;
+  typedef TreeBits<41, 6> OffMinute;
+};
+
+typedef struct {
+  byte ip[4];
+  unsigned long seen; // millis() of last announcement
+  boolean live;
+} FedPeer;
+
+typedef struct {
+  byte record[FED_RECORD_SIZE];
+  byte peer;          // FED_NONE if the slot is free
+} FedSwitch;
+
+typedef struct {
+  byte peer;
+  byte tries;         // 0 if the slot is free
+  unsigned long sent; // millis() of last try
+  boolean awaited;    // Sent since the last await()
+  byte length;
+  byte payload[FED_PAYLOAD];
+} FedMessage;
+
+typedef boolean (*FedSwitchFunction)(data id, boolean on);
+// ids end with 0
+typedef boolean (*FedTimerFunction)(byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute, data* ids);
+
+#if FED_ENABLED
+
+class Federation {
+ public:
+
+  Federation();
+
+  void begin(AVL_tree* tree, EthernetUDP* udp, FedSwitchFunction onSwitch, FedTimerFunction onTimer);
+  void receive(EthernetUDP& udp); // Datagram on NOTIFY_PORT, ignored unless it is one of ours
+  void poll();
+  byte owner(data id);            // Peer with the switch, FED_NONE if it is local or unknown
+  boolean forwardSwitch(data id, boolean on);
+  boolean forwardTimer(data* ids, byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute);
+  void sendSwitches(Print& out);  // 'G' records of the peers' switches
+  byte peers();                   // Live peers
+  byte remoteSwitches(){return mRemoteCount;}
+  void await();                   // Forwards from now on are those waiting() and refused() tell of
+  boolean waiting(){return mWaiting;}   // Not all of them acked yet
+  boolean refused(){return mRefused;}   // One was refused or never acked
+  byte freeSlots();               // Forwards the outbox takes now
+
+ private:
+  void announce();
+  void readAnnounce(EthernetUDP& udp, byte peer);
+  void readSwitch(EthernetUDP& udp);
+  void readTimer(EthernetUDP& udp);
+  void readAck(EthernetUDP& udp, byte peer);
+  void ack(EthernetUDP& udp, byte seq, boolean ok);
+  byte findPeer(IPAddress ip, boolean add);
+  void dropPeer(byte peer);
+  FedSwitch* findSwitch(data id);
+  void answered(FedMessage& message, boolean ok);
+  boolean queue(byte peer, const byte* payload, byte length);
+  void send(FedMessage& message);
+
+  AVL_tree* mTree;
+  EthernetUDP* mUdp;
+  FedSwitchFunction mOnSwitch;
+  FedTimerFunction mOnTimer;
+  FedPeer mPeers[FED_PEERS];
+  FedSwitch mSwitches[FED_REMOTE_SWITCHES];
+  byte mRemoteCount;
+  FedMessage mOutbox[FED_OUTBOX];
+  byte mSeq;
+  byte mWaiting;
+  boolean mRefused;
+  unsigned int mAnnouncedGen;  // Tree generation of the last announcement
+  unsigned long mAnnouncedAt;
+};
+
+#else
+
+class Federation {
+ public:
+  void begin(AVL_tree*, EthernetUDP*, FedSwitchFunction, FedTimerFunction){}
+  void receive(EthernetUDP&){}
+  void poll(){}
+  byte owner(data){return FED_NONE;}
+  boolean forwardSwitch(data, boolean){return false;}
+  boolean forwardTimer(data*, byte, byte, byte, byte, byte){return true;}
+  void sendSwitches(Print&){}
+  byte peers(){return 0;}
+  byte remoteSwitches(){return 0;}
+  void await(){}
+  boolean waiting(){return false;}
+  boolean refused(){return false;}
+  byte freeSlots(){return 0;}
+};
+
+#endif
+
+#endif
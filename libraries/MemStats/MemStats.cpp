@@ -0,0 +1,114 @@
+#include "MemStats.h"
+
+unsigned int MemStats::sAllocs[MEM_SUBSYSTEMS];
+unsigned int MemStats::sFrees[MEM_SUBSYSTEMS];
+
+#ifdef __AVR__
+
+extern uint8_t _end;
+extern uint8_t __stack;
+extern char __heap_start;
+extern char* __brkval;
+extern size_t __malloc_margin;
+
+struct __freelist {
+  size_t sz;
+  struct __freelist* nx;
+};
+extern struct __freelist* __flp;
+
+// Runs before the stack is set up, so it must not use any.
+void paintStack() __attribute__ ((naked)) __attribute__ ((used)) __attribute__ ((section (".init1")));
+void paintStack()
+{
+  uint8_t* p = &_end;
+  while(p <= &__stack){
+    *p = MEM_CANARY;
+    ++p;
+  }
+}
+
+static char* heapEnd()
+{
+  return __brkval ? __brkval : &__heap_start;
+}
+
+unsigned int MemStats::freeRam()
+{
+  char top;
+  return &top - heapEnd();
+}
+
+unsigned int MemStats::stackHighWater()
+{
+  const uint8_t* p = (const uint8_t*)heapEnd();
+  while(p <= &__stack && *p == MEM_CANARY)
+    ++p;
+  return &__stack - p + 1;
+}
+
+unsigned int MemStats::largestFreeBlock()
+{
+  size_t largest = 0;
+  for(struct __freelist* f = __flp; f; f = f->nx)
+    if(f->sz > largest)
+      largest = f->sz;
+  // Never handed out space above the heap, minus what malloc keeps free
+  // for the stack
+  unsigned int top = freeRam();
+  top = top > __malloc_margin ? top - __malloc_margin : 0;
+  return top > largest ? top : largest;
+}
+
+byte MemStats::fragmentation()
+{
+  unsigned long total = 0;
+  for(struct __freelist* f = __flp; f; f = f->nx)
+    total += f->sz;
+  unsigned int top = freeRam();
+  total += top > __malloc_margin ? top - __malloc_margin : 0;
+  if(total == 0)
+    return 0;
+  return 100 - (largestFreeBlock() * 100UL) / total;
+}
+
+#else
+
+unsigned int MemStats::freeRam() { return 0; }
+unsigned int MemStats::stackHighWater() { return 0; }
+unsigned int MemStats::largestFreeBlock() { return 0; }
+byte MemStats::fragmentation() { return 0; }
+
+#endif
+
+void MemStats::countAlloc(byte subsystem)
+{
+  ++sAllocs[subsystem];
+}
+
+void MemStats::countFree(byte subsystem)
+{
+  ++sFrees[subsystem];
+}
+
+/*
+ * freeRam:stackHighWater:largestFreeBlock:fragmentation, then one
+ * allocs:frees block per subsystem. Blocks end with 'N'.
+ */
+void MemStats::print(Print& out)
+{
+  out.print(freeRam());
+  out.print(':');
+  out.print(stackHighWater());
+  out.print(':');
+  out.print(largestFreeBlock());
+  out.print(':');
+  out.print(fragmentation());
+  out.print('N');
+  for(byte i = 0; i < MEM_SUBSYSTEMS; ++i){
+    out.print(sAllocs[i]);
+    out.print(':');
+    out.print(sFrees[i]);
+    out.print('N');
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef _MEM_STATS_
+#define _MEM_STATS_
+
+#include "Arduino.h"
+
+/**
+ *
+ * #### Memory monitor ####
+ *
+ * RAM between the static data and the top of the stack is painted with
+ * MEM_CANARY before main() runs (.init1). Stack that has been used since
+ * boot no longer holds the canary, which gives the high-water mark.
+ *
+ * Heap numbers come from avr-libc's malloc: the free list (__flp) and the
+ * gap between the heap end (__brkval) and the stack.
+ *
+ * Allocations are counted per subsystem where new/delete are called.
+ * allocs - frees is what the subsystem holds right now.
+ *
+ * Off the AVR only the allocation counters are kept.
+ */
+#define MEM_CANARY 0xC5
+
+enum {
+  MEM_TREE,    // TreeNode
+  MEM_RF,      // RCTransmit code buffers
+  MEM_SNAPSHOT, // Timer rules of an image being restored
+  MEM_SCHEDULE, // Transition table of TimerSchedule
+  MEM_SUBSYSTEMS
+};
+
+class MemStats {
+ public:
+  static unsigned int freeRam();          // Between heap end and stack pointer
+  static unsigned int stackHighWater();   // Most stack used since boot
+  static unsigned int largestFreeBlock(); // Biggest malloc() that would succeed
+  static byte fragmentation();            // Percent of free heap not in largest block
+  static void countAlloc(byte subsystem);
+  static void countFree(byte subsystem);
+  static void print(Print& out);
+
+ private:
+  static unsigned int sAllocs[MEM_SUBSYSTEMS];
+  static unsigned int sFrees[MEM_SUBSYSTEMS];
+};
+
+#endif
@@ -1,5 +1,7 @@
 
 #include "NTPRealTime.h"
+#include <PerfStats.h>
+#include <EventLog.h>
 
 // leap year calulator expects year argument as years offset from 1970
 #define LEAP_YEAR(Y)     ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
@@ -9,13 +11,23 @@ static  const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31}; // API
 NTPRealTime::NTPRealTime(){
   mLastSync=0;
   mTimezone=1;
+  mOffset = 60;
   mSummertime = true;
   mSyncInterval=300;
+  mSynced = false;
+  mWaiting = false;
 }
 
 void NTPRealTime::refreshCache(time_t t) {
   if (t != cacheTime) { // If more than one second passed
-    breakTime(t); 
+    // Local date and time, not only the hour, so Wday and Day are right too
+    time_t local = t + (long)mTimezone * 3600;
+    breakTime(local);
+    mOffset = mTimezone * 60;
+    if(mSummertime && isSummertime()){
+      breakTime(local + 3600);
+      mOffset += 60;
+    }
     cacheTime = t; 
   }
 }
@@ -31,47 +43,62 @@ void NTPRealTime::summertime(bool summertime){
 void NTPRealTime::init(IPAddress timeserver, int port){
   mUdp.begin(port);
   mTimeServer = timeserver;
-  fetchNTPTime();
+  mWaiting = false;
+  poll();
 }
 
 void NTPRealTime::setSyncInterval(int seconds){
   mSyncInterval = seconds;
 }
 
+/*
+ * Keep the clock synced without waiting for the server. Sends a request
+ * when a sync is due and picks up the answer on a later call.
+ */
+void NTPRealTime::poll(){
+  if(fetchNTPTime())
+    return;
+  if(mWaiting && millis() - mSentAt < NTP_TIMEOUT)
+    return;
+  if(!mSynced || (millis() - mLastSync)/1000 >= mSyncInterval){
+    sendNTPpacket(mTimeServer);
+    mSentAt = millis();
+    mWaiting = true;
+  }
+}
+
+bool NTPRealTime::isSynced(){
+  return mSynced;
+}
+
+// Read the answer to the last request, if it has arrived
 bool NTPRealTime::fetchNTPTime(){
-  sendNTPpacket(mTimeServer);
-  delay(300); // 
-  // Test for answer 10 times before exit
-  Serial.print("Trying to reach NTP server...");
-  for(int i = 0; i < 10; ++i)
-    {
-      Serial.println(i);
-      if( mUdp.parsePacket() )
-	{
-	  //buffer to hold incoming and outgoing packets 
-	  byte buffer[NTP_PACKET_SIZE]; 
-	  // Read packet into the buffer
-	  mUdp.read(buffer, NTP_PACKET_SIZE);
-	  //the timestamp starts at byte 40 of the received packet and is four bytes,
-	  // or two words, long. First, esxtract the two words:
-	  unsigned long highWord = word(buffer[40], buffer[41]);
-	  unsigned long lowWord = word(buffer[42], buffer[43]);  
-	  // combine the four bytes (two words) into a long integer
-	  // this is NTP time (seconds since Jan 1 1900):
-	  unsigned long secsSince1900 = highWord << 16 | lowWord;               
-
-	  // now convert NTP time into everyday time:
-	  // Unix time starts on Jan 1 1970. In seconds, that's 2208988800:
-	  const unsigned long seventyYears = 2208988800UL;     
-	  // subtract seventy years:                            
-	  mUnixTime = secsSince1900 - seventyYears;
-	  mLastSync = millis();
-	  Serial.println("NTP server OK!...");
-	  return true;
-	}
-      delay(300); 
-    }
-  return false;
+  if( !mUdp.parsePacket() )
+    return false;
+  PERF_PROBE(PERF_NTP_FETCH); // Only answers, not the polls for one
+  //buffer to hold incoming and outgoing packets 
+  byte buffer[NTP_PACKET_SIZE]; 
+  // Read packet into the buffer
+  if( mUdp.read(buffer, NTP_PACKET_SIZE) < NTP_PACKET_SIZE )
+    return false;
+  //the timestamp starts at byte 40 of the received packet and is four bytes,
+  // or two words, long. First, esxtract the two words:
+  unsigned long highWord = word(buffer[40], buffer[41]);
+  unsigned long lowWord = word(buffer[42], buffer[43]);  
+  // combine the four bytes (two words) into a long integer
+  // this is NTP time (seconds since Jan 1 1900):
+  unsigned long secsSince1900 = highWord << 16 | lowWord;               
+
+  // now convert NTP time into everyday time:
+  // Unix time starts on Jan 1 1970. In seconds, that's 2208988800:
+  const unsigned long seventyYears = 2208988800UL;     
+  // subtract seventy years:                            
+  mUnixTime = secsSince1900 - seventyYears;
+  mLastSync = millis();
+  mSynced = true;
+  mWaiting = false;
+  LOG_INFO(EV_NTP_SYNC, 0);
+  return true;
 }
 
 // send an NTP request to the time server at the given address 
@@ -117,10 +144,19 @@ uint8_t NTPRealTime::getSec(){
   return tm.Second;
 }
 
+// Local calendar date, Wday 1 is Sunday and Year is offset from 1970
+const tmElements_t& NTPRealTime::getDate(){
+  refreshCache(now());
+  return tm;
+}
+
+// Minutes local time is ahead of UTC, summer time included
+int NTPRealTime::utcOffset(){
+  refreshCache(now());
+  return mOffset;
+}
+
 time_t NTPRealTime::now(){
-  if((millis() - mLastSync)/1000 >= mSyncInterval){
-    fetchNTPTime();
-  }
   return mUnixTime + (millis() - mLastSync)/1000;
 }
 
@@ -139,7 +175,7 @@ void NTPRealTime::breakTime(time_t timeInput){
   time /= 60; // now it is minutes
   tm.Minute = time % 60;
   time /= 60; // now it is hours
-  tm.Hour = ((time + mTimezone) % 24);
+  tm.Hour = time % 24;
   time /= 24; // now it is days
   tm.Wday = ((time + 4) % 7) + 1;  // Sunday is day 1 
   
@@ -175,39 +211,24 @@ void NTPRealTime::breakTime(time_t timeInput){
   }
   tm.Month = month + 1;  // jan is month 1  
   tm.Day = time + 1;     // day of month
-
-  if(mSummertime){
-    if(tm.Month >= 3 && tm.Month <= 10){
-      switch(tm.Year){
-      case 2015:
-	if (!((tm.Month == 3 && tm.Day < 29) || (tm.Month == 10 && tm.Day >= 25)))
-	  adjustToSummerTime();
-	break;
-      case 2016:
-	if (!((tm.Month == 3 && tm.Day < 27) || (tm.Month == 10 && tm.Day >= 30)))
-	  adjustToSummerTime();
-	break;
-      case 2017:
-	if (!((tm.Month == 3 && tm.Day < 26) || (tm.Month == 10 && tm.Day >= 29)))
-	  adjustToSummerTime();
-	break;
-      case 2018:
-	if (!((tm.Month == 3 && tm.Day < 25) || (tm.Month == 10 && tm.Day >= 28)))
-	  adjustToSummerTime();
-	break;
-      default:
-	if (!((tm.Month == 3 && tm.Day < 31) || (tm.Month == 10 && tm.Day >= 27)))
-	  adjustToSummerTime();
-	break;
-      }
-    }
-  }
 }
 
-void NTPRealTime::adjustToSummerTime(){
-  tm.Hour += 1;
-  tm.Hour = tm.Hour % 24;
+/*
+ * EU summer time: from 01:00 UTC the last Sunday of March to 01:00 UTC
+ * the last Sunday of October. tm holds local standard time.
+ */
+bool NTPRealTime::isSummertime(){
+  unsigned int year = 1970 + tm.Year;
+  uint8_t lastSunday; // Day of month, formula holds 1900-2099
+  if(tm.Month < 3 || tm.Month > 10)
+    return false;
+  if(tm.Month > 3 && tm.Month < 10)
+    return true;
+  uint8_t switchHour = (1 + mTimezone + 24) % 24;
+  if(tm.Month == 3){
+    lastSunday = 31 - (5 * year / 4 + 4) % 7;
+    return tm.Day > lastSunday || (tm.Day == lastSunday && tm.Hour >= switchHour);
+  }
+  lastSunday = 31 - (5 * year / 4 + 1) % 7;
+  return tm.Day < lastSunday || (tm.Day == lastSunday && tm.Hour < switchHour);
 }
-
-
-
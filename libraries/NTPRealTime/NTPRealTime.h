@@ -24,6 +24,8 @@ typedef unsigned long time_t;
 
 // NTP time stamp is in the first 48 bytes of the message
 const int NTP_PACKET_SIZE=48;
+// Resend the request if no answer within this many ms
+#define NTP_TIMEOUT 3000
 
 class NTPRealTime {
  public:
@@ -34,15 +36,19 @@ class NTPRealTime {
   void setSyncInterval(int seconds);
   void setTimezone(int8_t timezone);
   void summertime(bool summertime);
+  void poll();
+  bool isSynced();
 
   uint8_t getHour();
   uint8_t getMin();
   uint8_t getSec();
+  const tmElements_t& getDate();
+  int utcOffset();
 
   time_t now();
 
  private:
-  void adjustToSummerTime();
+  bool isSummertime();
   bool fetchNTPTime();
   time_t sendNTPpacket(IPAddress& address);
 
@@ -54,10 +60,14 @@ class NTPRealTime {
   time_t mUnixTime;
   unsigned int mSyncInterval; // In second
   time_t mLastSync;
+  bool mSynced;
+  bool mWaiting;       // Request sent, no answer yet
+  unsigned long mSentAt; // millis() of last request
 
   tmElements_t tm;
   time_t cacheTime;
   int8_t mTimezone;
+  int mOffset;         // Minutes, of the time in tm
   bool mSummertime;
 };
 
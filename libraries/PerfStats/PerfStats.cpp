@@ -0,0 +1,50 @@
+#include "PerfStats.h"
+
+#if PERF_ENABLED
+
+PerfHistogram PerfStats::sHistograms[PERF_PROBES];
+
+void PerfStats::record(byte probe, unsigned long elapsed)
+{
+  PerfHistogram& h = sHistograms[probe];
+  byte bucket = 0;
+  for(unsigned long t = elapsed >> 5; t && bucket < PERF_BUCKETS - 1; t >>= 2)
+    ++bucket;
+  if(h.buckets[bucket] == 0xFF){
+    for(byte b = 0; b < PERF_BUCKETS; ++b)
+      h.buckets[b] >>= 1;
+  }
+  ++h.buckets[bucket];
+  if(h.count != 0xFFFF)
+    ++h.count;
+  if(elapsed > h.max)
+    h.max = elapsed < 0xFFFF ? elapsed : 0xFFFF;
+}
+
+/*
+ * One count:max:b0,b1,...,b7 block per probe, blocks end with 'N' like
+ * the nodes in SendNodes.
+ */
+void PerfStats::print(Print& out)
+{
+  for(byte i = 0; i < PERF_PROBES; ++i){
+    const PerfHistogram& h = sHistograms[i];
+    out.print(h.count);
+    out.print(':');
+    out.print(h.max);
+    out.print(':');
+    for(byte b = 0; b < PERF_BUCKETS; ++b){
+      if(b)
+	out.print(',');
+      out.print(h.buckets[b]);
+    }
+    out.print('N');
+  }
+}
+
+void PerfStats::reset()
+{
+  memset(sHistograms, 0, sizeof(sHistograms));
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef _PERF_STATS_
+#define _PERF_STATS_
+
+#include "Arduino.h"
+
+/**
+ *
+ * #### Operation timing ####
+ *
+ * PERF_PROBE(id) at the top of a block times it with micros() until the
+ * end of the block. Each probe keeps a count, the longest time and a
+ * log4 histogram:
+ *
+ * Bucket 0:  < 32 us
+ * Bucket n:  32 * 4^(n-1) us to 32 * 4^n us
+ * Bucket 7:  >= 131072 us
+ *
+ * The count and the longest time stop at 65535 instead of wrapping. A
+ * bucket holds up to 255, when one is full all of the probe's buckets
+ * are halved: the histogram keeps its shape and favours recent times.
+ * 84 bytes of RAM in all, see the RAM budget in smarthome.ino. Built
+ * with PERF_ENABLED 0 the probes are left out and 'I' replies an empty
+ * line.
+ */
+#ifndef PERF_ENABLED
+#define PERF_ENABLED 1
+#endif
+#define PERF_BUCKETS 8
+
+enum {
+  PERF_LOOP,             // One loop() pass (one scheduler slice)
+  PERF_READ_REQUEST,
+  PERF_EXECUTE_REQUEST,
+  PERF_RF_SEND,          // One RF frame
+  PERF_EEPROM_SAVE,      // One FlushEEPROM() slice, a byte written at most
+  PERF_NTP_FETCH,        // Reading an NTP answer
+  PERF_CHECK_TIMERS,     // One pass over all timers
+  PERF_PROBES
+};
+
+typedef struct {
+  byte buckets[PERF_BUCKETS];
+  unsigned int count;
+  unsigned int max; // us
+} PerfHistogram;
+
+#if PERF_ENABLED
+
+class PerfStats {
+ public:
+  static void record(byte probe, unsigned long elapsed);
+  static const PerfHistogram& histogram(byte probe){return sHistograms[probe];}
+  static void print(Print& out);
+  static void reset();
+
+ private:
+  static PerfHistogram sHistograms[PERF_PROBES];
+};
+
+class PerfProbe {
+ public:
+  PerfProbe(byte probe) : mProbe(probe), mStart(micros()) {}
+  ~PerfProbe() { PerfStats::record(mProbe, micros() - mStart); }
+
+ private:
+  byte mProbe;
+  unsigned long mStart;
+};
+
+#define PERF_PROBE(probe) PerfProbe perfProbe_(probe)
+
+#else
+
+class PerfStats {
+ public:
+  static void print(Print&){}
+  static void reset(){}
+};
+
+#define PERF_PROBE(probe)
+
+#endif
+
+#endif
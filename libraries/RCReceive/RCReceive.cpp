@@ -0,0 +1,216 @@
+#include "RCReceive.h"
+#include <EventLog.h>
+
+// Only one receiver, the interrupt handler has no context
+static RCReceive* receiver = NULL;
+
+RCReceive::RCReceive(int receivePin)
+  : mReceivePin(receivePin)
+{
+  mPulseHead = 0;
+  mPulseCount = 0;
+  mLastEdge = 0;
+  mOverruns = 0;
+  mOverrun = false;
+  mMuted = false;
+  mMutedEdges = false;
+  mLastCode = 0;
+  mLastLevel = RC_NO_LEVEL;
+  mLastProtocol = 0;
+  mLastFrameAt = 0;
+  mRepeats = 0;
+  mHead = 0;
+  mCount = 0;
+  reset();
+}
+
+void RCReceive::begin()
+{
+  receiver = this;
+  pinMode(mReceivePin, INPUT);
+  mLastEdge = micros();
+  attachInterrupt(digitalPinToInterrupt(mReceivePin), handleInterrupt, CHANGE);
+}
+
+void RCReceive::handleInterrupt()
+{
+  receiver->capture();
+}
+
+// Length of the pulse that just ended, and its level
+void RCReceive::capture()
+{
+  unsigned long now = micros();
+  unsigned long length = now - mLastEdge;
+  mLastEdge = now;
+  if(mMuted){
+    mMutedEdges = true;
+    return;
+  }
+  if(mPulseCount >= RC_RX_BUFFER){
+    ++mOverruns;
+    mOverrun = true;
+    return;
+  }
+  if(length > RC_RX_LEVEL - 1)
+    length = RC_RX_LEVEL - 1;
+  // The pin has just changed, the pulse had the other level
+  unsigned int pulse = length | (digitalRead(mReceivePin) ? 0 : RC_RX_LEVEL);
+  mPulses[(mPulseHead + mPulseCount) % RC_RX_BUFFER] = pulse;
+  ++mPulseCount;
+}
+
+/*
+ * Pulses were dropped while muted, a pulse too long for any frame takes
+ * their place so the decoder starts over there.
+ */
+void RCReceive::mute(bool on)
+{
+  noInterrupts();
+  if(!on && mMutedEdges){
+    if(mPulseCount < RC_RX_BUFFER){
+      mPulses[(mPulseHead + mPulseCount) % RC_RX_BUFFER] = RC_RX_LEVEL | (RC_RX_LEVEL - 1);
+      ++mPulseCount;
+    }
+    else
+      mOverrun = true;
+  }
+  mMuted = on;
+  mMutedEdges = false;
+  interrupts();
+}
+
+// Decode the pulses captured since the last call
+void RCReceive::poll()
+{
+  for(byte n = 0; n < RC_RX_BUFFER; ++n){
+    noInterrupts();
+    if(mOverrun){
+      mOverrun = false;
+      interrupts();
+      reset(); // The frame has a hole in it
+      continue;
+    }
+    if(mPulseCount == 0){
+      interrupts();
+      return;
+    }
+    unsigned int pulse = mPulses[mPulseHead];
+    mPulseHead = (mPulseHead + 1) % RC_RX_BUFFER;
+    --mPulseCount;
+    interrupts();
+    decode(pulse & RC_RX_LEVEL, pulse & ~RC_RX_LEVEL);
+  }
+}
+
+// Next received command, false if there is none
+bool RCReceive::read(RCCommand& command)
+{
+  if(mCount == 0)
+    return false;
+  command = mQueue[mHead];
+  mHead = (mHead + 1) % RC_RX_QUEUE;
+  --mCount;
+  return true;
+}
+
+void RCReceive::decode(bool high, unsigned int duration)
+{
+  if(high){
+    mHigh = duration >= RC_RX_HIGH_MIN && duration <= RC_RX_HIGH_MAX ? duration : 0;
+    if(!mHigh)
+      reset();
+    return;
+  }
+  if(!mHigh)
+    return;
+
+  // A low pulse ends a high/low pair
+  if(duration >= RC_RX_SYNC_MIN && duration <= RC_RX_SYNC_MAX){
+    if(mInFrame && mWireBits == wireBits())
+      frame(); // No pause before the next frame
+    reset();
+    mInFrame = true;
+    return;
+  }
+  if(!mInFrame)
+    return;
+  byte wire;
+  if(duration >= RC_RX_SHORT_MIN && duration <= RC_RX_SHORT_MAX)
+    wire = 0;
+  else if(duration >= RC_RX_LONG_MIN && duration <= RC_RX_LONG_MAX)
+    wire = 1;
+  else{
+    if(duration >= RC_RX_PAUSE_MIN && mWireBits == wireBits())
+      frame();
+    reset();
+    return;
+  }
+  if(mWireBits == wireBits()){
+    reset(); // Too long
+    return;
+  }
+  mHighSum += mHigh;
+  if(mWireBits & 1){
+    byte bit = mWireBits >> 1;
+    if(wire == mFirstWire){
+      if(!wire || bit != RC_RX_DIM_BIT){
+	reset(); // 00, or 11 elsewhere, is not a data bit
+	return;
+      }
+      mDim = true;
+    }
+    else if(mFirstWire){
+      if(bit < 32)
+	mCode |= 1UL << bit;
+      else
+	mLevel |= 1 << (bit - 32);
+    }
+  }
+  else{
+    mFirstWire = wire;
+  }
+  ++mWireBits;
+}
+
+// A whole frame was decoded, report it once per button press
+void RCReceive::frame()
+{
+  byte protocol = mHighSum / mWireBits < RC_RX_P2_HIGH ? 2 : 1;
+  byte level = mDim ? mLevel : RC_NO_LEVEL;
+  unsigned long now = millis();
+  if(mCode == mLastCode && level == mLastLevel && protocol == mLastProtocol
+     && now - mLastFrameAt <= RC_RX_BURST_GAP){
+    if(mRepeats < 255)
+      ++mRepeats;
+  }
+  else{
+    mLastCode = mCode;
+    mLastLevel = level;
+    mLastProtocol = protocol;
+    mRepeats = 1;
+  }
+  mLastFrameAt = now;
+  if(mRepeats != RC_RX_MIN_REPEATS || mCount >= RC_RX_QUEUE)
+    return;
+  RCCommand& command = mQueue[(mHead + mCount) % RC_RX_QUEUE];
+  command.controller = mCode & 0x3FFFFFFUL; // Bits 0-25
+  command.group = (mCode >> 26) & 1;
+  command.status = mDim || ((mCode >> 27) & 1);
+  command.device = (mCode >> 28) & 0xF;
+  command.protocol = protocol;
+  command.level = level;
+  ++mCount;
+  LOG_DEBUG(EV_RF_RECEIVED, command.controller);
+}
+
+void RCReceive::reset()
+{
+  mInFrame = false;
+  mWireBits = 0;
+  mFirstWire = 0;
+  mCode = 0;
+  mDim = false;
+  mLevel = 0;
+  mHighSum = 0;
+}
@@ -0,0 +1,115 @@
+#ifndef RCReceive_H
+#define RCReceive_H
+
+#include "Arduino.h"
+#include <RCTransmit.h>
+
+/**
+ *
+ * #### Receiving ####
+ *
+ * Decodes the frames RCTransmit sends (see RCTransmit.h), from remotes
+ * and wall switches speaking the same protocols.
+ *
+ * A pin change interrupt stores the length of every pulse in a ring
+ * buffer and returns. poll() moves the pulses through a decoder that
+ * does a fixed amount of work per pulse:
+ *   sync   high, then low RC_RX_SYNC_MIN..RC_RX_SYNC_MAX us
+ *   data   64 times high, then short (wire 0) or long (wire 1) low,
+ *          wire pairs 01 = data 0 and 10 = data 1
+ *   pause  high, then low of at least RC_RX_PAUSE_MIN us
+ * Anything else starts over from the next sync.
+ *
+ * poll() must run at least every 10 ms (RC_RX_BUFFER pulses) or pulses
+ * are lost, so no scheduler slice may take longer (see
+ * AVL_tree::FlushEEPROM()). Sending an RF frame takes up to 100 ms: the
+ * receiver is muted meanwhile, remotes can't be heard over our own
+ * transmitter anyway. A dim frame has wire 11
+ * in place of the on/off bit and 4 more data bits, the level, so 72
+ * wire bits (RC_RX_DIM_WIRE_BITS).
+ *
+ * The 32 data bits are read as protocol 1: 26 bit controller, group,
+ * on/off and 4 bit device (for protocol 2 channel and button code, 2
+ * bits each). Both protocols look the same on air except for the
+ * length of the high pulses, which tells them apart.
+ *
+ * Remotes repeat a frame several times. A command is reported once a
+ * frame has been seen RC_RX_MIN_REPEATS times in a row, and the rest of
+ * the repeats are ignored.
+ */
+#define RC_RX_BUFFER 32         // Pulses, about 10 ms of data
+#define RC_RX_QUEUE 4           // Decoded commands waiting for read()
+#define RC_RX_HIGH_MIN 100      // us
+#define RC_RX_HIGH_MAX 600
+#define RC_RX_SHORT_MIN 100     // Low of wire 0, P1_0_TIMING_LOW / P2_0_TIMING_LOW
+#define RC_RX_SHORT_MAX 600
+#define RC_RX_LONG_MIN 800      // Low of wire 1, P1_1_TIMING_LOW / P2_1_TIMING_LOW
+#define RC_RX_LONG_MAX 1900
+#define RC_RX_SYNC_MIN 2000     // P1_SYNC_LOW / P2_SYNC_LOW
+#define RC_RX_SYNC_MAX 3500
+#define RC_RX_PAUSE_MIN 5000    // P2_PAUSE_LOW
+#define RC_RX_MIN_REPEATS 2
+#define RC_RX_BURST_GAP 250     // ms between frames of one button press, at most
+#define RC_RX_WIRE_BITS 64
+#define RC_RX_DIM_WIRE_BITS 72
+#define RC_RX_DIM_BIT 27        // Data bit sent as wire 11 in dim frames
+// Average high pulse below this is protocol 2
+#define RC_RX_P2_HIGH ((P1_1_TIMING_HIGH + P2_1_TIMING_HIGH) / 2)
+
+#define RC_RX_LEVEL 0x8000      // Pulse was high, in the ring buffer
+
+class RCReceive
+{
+public:
+  RCReceive(int receivePin);
+
+  void begin();
+  void poll();
+  bool read(RCCommand& command);
+  bool pending(){return mPulseCount || mCount;} // Pulses to decode or commands to read
+  void decode(bool high, unsigned int duration); // One pulse, us
+  unsigned int overruns(){return mOverruns;}
+  void mute(bool on); // Drop what is heard while our transmitter sends
+
+private:
+  static void handleInterrupt();
+  void capture();
+  void frame();
+  void reset();
+  byte wireBits(){return mDim ? RC_RX_DIM_WIRE_BITS : RC_RX_WIRE_BITS;}
+
+  const int mReceivePin;
+
+  // Written by the interrupt
+  volatile unsigned int mPulses[RC_RX_BUFFER];
+  volatile byte mPulseHead;
+  volatile byte mPulseCount;
+  volatile unsigned long mLastEdge;
+  volatile unsigned int mOverruns;
+  volatile bool mOverrun; // Pulses were lost since poll() last ran
+  volatile bool mMuted;
+  volatile bool mMutedEdges; // Edges came while muted
+
+  // Decoder
+  bool mInFrame;
+  unsigned int mHigh;    // Last high pulse, 0 if not valid
+  byte mWireBits;
+  byte mFirstWire;       // First wire bit of the current pair
+  unsigned long mCode;
+  bool mDim;
+  byte mLevel;
+  unsigned long mHighSum;
+
+  // Repeats
+  unsigned long mLastCode;
+  byte mLastLevel;
+  byte mLastProtocol;
+  unsigned long mLastFrameAt;
+  byte mRepeats;
+
+  RCCommand mQueue[RC_RX_QUEUE];
+  byte mHead;
+  byte mCount;
+};
+
+#endif
@@ -1,10 +1,22 @@
 #include "RCTransmit.h"
+#include <PerfStats.h>
+#include <EventLog.h>
+#include <MemStats.h>
 
 RCTransmit::RCTransmit(int transmitPin)
   : mTransmitPin(transmitPin)
 {
   this->setProtocol(1);
   this->setRepeatTransmit(6);
+  mHead = 0;
+  mCount = 0;
+  mRepeatsLeft = 0;
+  memset(mSent, 0, sizeof(mSent));
+  mSentNext = 0;
+  mQueued = 0;
+  mMerged = 0;
+  mDropped = 0;
+  memset(mFades, 0, sizeof(mFades));
 }
 
 void RCTransmit::setProtocol(int protocol)
@@ -27,35 +39,270 @@ void RCTransmit::setRepeatTransmit(int repeat)
   this->mRepeatTransmit = repeat;
 }
 
-void RCTransmit::switchOn(int controller, byte protocol, bool group, int device, byte buttonCode)
+void RCTransmit::switchOn(unsigned long controller, byte protocol, bool group, int device)
 {
-  start(controller, protocol, true, group, device, buttonCode);
+  start(controller, protocol, true, group, device);
 }
 
-void RCTransmit::switchOff(int controller, byte protocol, bool group, int device, byte buttonCode)
+void RCTransmit::switchOff(unsigned long controller, byte protocol, bool group, int device)
 {
-  start(controller, protocol, false, group, device, buttonCode);
+  start(controller, protocol, false, group, device);
 }
 
-void RCTransmit::start(int controller, byte protocol, bool status, bool group, int device, byte buttonCode)
+void RCTransmit::start(unsigned long controller, byte protocol, bool status, bool group, int device)
 {
-  char* buffer = new char[40];
-  this->mProtocol = protocol;
-  if(this->mProtocol == 1)
+  char* buffer = new char[RC_CODE_SIZE];
+  MemStats::countAlloc(MEM_RF);
+  RCCommand command = { controller, protocol, status, group, device, RC_NO_LEVEL };
+  if(this->encode(buffer, command))
+    this->send(buffer);
+  delete[] buffer;
+  MemStats::countFree(MEM_RF);
+}
+
+/*
+ * Put a command in the send queue, merged with what is waiting or was
+ * just sent for the same switch. Returns false if the queue is full.
+ * Ends a fade of the switch.
+ */
+bool RCTransmit::queue(unsigned long controller, byte protocol, bool status, bool group, int device)
+{
+  RCCommand command = { controller, protocol, status, group, device, RC_NO_LEVEL };
+  endFade(controller, device);
+  return add(command);
+}
+
+// Set a protocol 2 dimmer to level (0 to RC_DIM_LEVELS - 1), ends a fade of it
+bool RCTransmit::queueDim(unsigned long controller, byte level, int device)
+{
+  RCCommand command = { controller, 2, true, false, device, level };
+  endFade(controller, device);
+  return add(command);
+}
+
+/*
+ * Dim from one level to another over duration ms, replacing a fade of
+ * the same switch. False if all fade slots are in use.
+ */
+bool RCTransmit::fade(unsigned long controller, byte from, byte to, unsigned long duration, int device)
+{
+  endFade(controller, device);
+  for(byte i = 0; i < RC_FADES; ++i){
+    RCFade& f = mFades[i];
+    if(f.controller == 0){
+      f.controller = controller;
+      f.device = device;
+      f.from = from;
+      f.to = to;
+      f.sent = RC_NO_LEVEL;
+      f.start = millis();
+      f.duration = duration;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Queue the level each fade has reached, if it changed
+void RCTransmit::stepFades()
+{
+  for(byte i = 0; i < RC_FADES; ++i){
+    RCFade& f = mFades[i];
+    if(f.controller == 0)
+      continue;
+    unsigned long elapsed = millis() - f.start;
+    unsigned long end = f.duration > RC_FADE_LEAD ? f.duration - RC_FADE_LEAD : 0;
+    byte level = f.to;
+    if(elapsed < end){
+      if(elapsed + RC_FADE_LEAD >= end)
+	continue; // Keep the channel free for the last level
+      level = f.from + ((long)f.to - f.from) * (long)elapsed / (long)end;
+    }
+    if(level != f.sent){
+      RCCommand command = { f.controller, 2, true, false, f.device, level };
+      if(add(command))
+	f.sent = level;
+    }
+    if(f.sent == f.to)
+      f.controller = 0;
+  }
+}
+
+void RCTransmit::endFade(unsigned long controller, int device)
+{
+  for(byte i = 0; i < RC_FADES; ++i)
+    if(mFades[i].controller == controller && mFades[i].device == device)
+      mFades[i].controller = 0;
+}
+
+bool RCTransmit::add(const RCCommand& command)
+{
+  int state = stateOf(command);
+  int sent = sentState(command);
+  // The command at the head is on air once its first frame is sent
+  for(byte i = mRepeatsLeft > 0 ? 1 : 0; i < mCount; ++i){
+    RCCommand& waiting = mQueue[(mHead + i) % RC_QUEUE_SIZE];
+    if(sameSwitch(waiting, command)){
+      if(sent == state)
+	removeAt(i); // Back to the state sent, nothing left to do
+      else
+	waiting = command;
+      ++mMerged;
+      return true;
+    }
+  }
+  if(sent == state){
+    ++mDropped;
+    return true;
+  }
+  if(mCount >= RC_QUEUE_SIZE)
+    return false;
+  mQueue[(mHead + mCount) % RC_QUEUE_SIZE] = command;
+  ++mCount;
+  ++mQueued;
+  return true;
+}
+
+bool RCTransmit::sameSwitch(const RCCommand& a, const RCCommand& b)
+{
+  return a.controller == b.controller && a.protocol == b.protocol
+    && a.group == b.group && a.device == b.device;
+}
+
+// 0 off, 1 on, from 2 up a dim level
+int RCTransmit::stateOf(const RCCommand& command)
+{
+  if(command.level != RC_NO_LEVEL)
+    return 2 + command.level;
+  return command.status ? 1 : 0;
+}
+
+/*
+ * State (see stateOf) the switch of command is being sent or was sent
+ * within RC_DEDUP_WINDOW, -1 if not known.
+ */
+int RCTransmit::sentState(const RCCommand& command)
+{
+  if(mRepeatsLeft > 0 && sameSwitch(mQueue[mHead], command))
+    return stateOf(mQueue[mHead]);
+  for(byte i = 0; i < RC_SENT_SIZE; ++i){
+    if(mSent[i].sentAt && sameSwitch(mSent[i].command, command)
+       && millis() - mSent[i].sentAt < RC_DEDUP_WINDOW)
+      return stateOf(mSent[i].command);
+  }
+  return -1;
+}
+
+// Take the command index places after the head out of the queue
+void RCTransmit::removeAt(byte index)
+{
+  for(byte i = index; i + 1 < mCount; ++i)
+    mQueue[(mHead + i) % RC_QUEUE_SIZE] = mQueue[(mHead + i + 1) % RC_QUEUE_SIZE];
+  --mCount;
+}
+
+void RCTransmit::remember(const RCCommand& command)
+{
+  RCSent* slot = &mSent[mSentNext];
+  for(byte i = 0; i < RC_SENT_SIZE; ++i){
+    if(mSent[i].sentAt && sameSwitch(mSent[i].command, command)){
+      slot = &mSent[i];
+      break;
+    }
+  }
+  if(slot == &mSent[mSentNext])
+    mSentNext = (mSentNext + 1) % RC_SENT_SIZE;
+  slot->command = command;
+  slot->sentAt = millis() | 1; // 0 marks a free slot
+}
+
+/*
+ * A code from a remote was heard for the switch. What was sent to it
+ * last no longer is its state, and a command back to that state must
+ * not be dropped as a repeat.
+ */
+void RCTransmit::forget(unsigned long controller, int device)
+{
+  for(byte i = 0; i < RC_SENT_SIZE; ++i){
+    if(mSent[i].command.controller == controller && mSent[i].command.device == device)
+      mSent[i].sentAt = 0;
+  }
+}
+
+/*
+ * Send the next frame of the command at the head of the queue.
+ * Returns false if there was nothing to send.
+ */
+bool RCTransmit::poll()
+{
+  stepFades();
+  if(mCount == 0)
+    return false;
+  if(mRepeatsLeft == 0){
+    if(!this->encode(mCode, mQueue[mHead])){
+      mHead = (mHead + 1) % RC_QUEUE_SIZE;
+      --mCount;
+      return false;
+    }
+    mRepeatsLeft = mRepeatTransmit;
+  }
+  this->mProtocol = mQueue[mHead].protocol;
+  this->sendFrame(mCode);
+  if(--mRepeatsLeft == 0){
+    remember(mQueue[mHead]);
+    mHead = (mHead + 1) % RC_QUEUE_SIZE;
+    --mCount;
+  }
+  return true;
+}
+
+byte RCTransmit::pending()
+{
+  return mCount;
+}
+
+bool RCTransmit::busy()
+{
+  if(mCount)
+    return true;
+  for(byte i = 0; i < RC_FADES; ++i)
+    if(mFades[i].controller)
+      return true;
+  return false;
+}
+
+// Commands that can still be queued
+byte RCTransmit::freeSlots()
+{
+  return RC_QUEUE_SIZE - mCount;
+}
+
+/*
+ * Select protocol and repeat count for the command and write its code
+ * into buffer. Returns false for unknown protocols.
+ */
+bool RCTransmit::encode(char* buffer, const RCCommand& command)
+{
+  this->mProtocol = command.protocol;
+  LOG_DEBUG(EV_RF_SEND, command.controller);
+  if(this->mProtocol == 1 && command.level == RC_NO_LEVEL)
     {
       this->setRepeatTransmit(6);
-      this->getCodeProtocol1(buffer, controller, group, status, device);
-      this->send(buffer);
+      this->getCodeProtocol1(buffer, command.controller, command.group, command.status, command.device);
+      return true;
     }
-  else if(protocol == 2)
+  else if(this->mProtocol == 2)
     {
       this->setRepeatTransmit(7);
-      this->getCodeProtocol2(buffer, controller, 0/*group*/, status, 3/*device*/, (byte)3/*buttonCode*/);
-      this->send(buffer);
+      // The device is channel (bits 0-1) and button code (bits 2-3)
+      this->getCodeProtocol2(buffer, command.controller, command.group, command.status,
+			     command.device & 3, (byte)(command.device >> 2), command.level);
+      return true;
     }
-  delete[] buffer;
+  return false;
 }
-void RCTransmit::getCodeProtocol1(char* &buffer, const int &controller, const bool &group, const bool &status,const int &device)
+
+void RCTransmit::getCodeProtocol1(char* &buffer, const unsigned long &controller, const bool &group, const bool &status,const int &device)
 {
   byte controllerBits = 26;
   byte deviceBits = 4;
@@ -87,22 +334,23 @@ void RCTransmit::getCodeProtocol1(char* &buffer, const int &controller, const bo
   buffer[resultPos] = '\0';
 }
 
-void RCTransmit::insert(char*& buffer, unsigned int& pos, const int& input, const byte& numofbits){
+void RCTransmit::insert(char*& buffer, unsigned int& pos, const unsigned long& input, const byte& numofbits){
 
   byte endpos = pos + numofbits;
   int i = 0;
   for(; pos < endpos; ++i)
     {
-      int mask = 1 << i;
-      int masked_n = input & mask;
+      unsigned long mask = 1UL << i;
+      unsigned long masked_n = input & mask;
       int thebit = masked_n >> i;
       buffer[pos++] = (char) thebit + 48;
     }
   buffer[pos] = '\0';
 }
 
-void RCTransmit::getCodeProtocol2(char* &buffer, const int &controller, const bool &group, 
-				  const bool &status,const int &channel, const byte &buttonCode)
+void RCTransmit::getCodeProtocol2(char* &buffer, const unsigned long &controller, const bool &group, 
+				  const bool &status,const int &channel, const byte &buttonCode,
+				  const byte &level)
 {
 
   byte controllerBits = 26; 
@@ -122,7 +370,11 @@ void RCTransmit::getCodeProtocol2(char* &buffer, const int &controller, const bo
       insert( buffer, resultPos, (byte)0, (byte)1 );
     }
   // Set status
-  if(status)
+  if(level != RC_NO_LEVEL)
+    {
+      buffer[resultPos++] = RC_CODE_DIM;
+    }
+  else if(status)
     {
       insert( buffer, resultPos, (byte)1, (byte)1 );
     }
@@ -131,50 +383,60 @@ void RCTransmit::getCodeProtocol2(char* &buffer, const int &controller, const bo
       insert( buffer, resultPos, (byte)0, (byte)1 );
     }
   // Set device
-  insert( buffer, resultPos, 3/*channel*/, deviceBits );
+  insert( buffer, resultPos, channel, deviceBits );
 
   // Set buttonCode
-  insert( buffer, resultPos, 3/*buttonCode*/, deviceBits );
+  insert( buffer, resultPos, buttonCode, deviceBits );
+
+  // Set dimmer grade
+  if(level != RC_NO_LEVEL)
+    insert( buffer, resultPos, level, 4 );
 
   buffer[resultPos] = '\0';
 }
 
 void RCTransmit::send(const char* code)
 {
-  Serial.print("Sending code:");
-  Serial.println(code);
   for(int repeat = 0; repeat < mRepeatTransmit; ++repeat)
     {
+      this->sendFrame(code);
+    } // Repeat-loop
+}
 
-      this->sendSync();
+// One sync, the code and the pause after it
+void RCTransmit::sendFrame(const char* code)
+{
+  PERF_PROBE(PERF_RF_SEND);
+  this->sendSync();
 
-      // Send startbit if protocol 2
-      //if(this->mProtocol == 2)
-      //	this->transmit(P2_0_TIMING_HIGH, P2_0_TIMING_LOW);
+  // Send startbit if protocol 2
+  //if(this->mProtocol == 2)
+  //	this->transmit(P2_0_TIMING_HIGH, P2_0_TIMING_LOW);
 
-      int i = 0;
-      while (code[i] != '\0') 
+  int i = 0;
+  while (code[i] != '\0') 
+    {
+      switch(code[i])
 	{
-	  switch(code[i])
-	    {
-	    case '0':
-	      this->send0();
-	      break;
-	    case '1':
-	      this->send1();
-	      break;
-	    }
-	  i++;
-	} // Code-loop
-      // PAUSE
-      // if(this->mProtocol == 2){
-      //	this->transmit(P2_0_TIMING_HIGH, P2_0_TIMING_LOW);
-      //}
-      this->transmit(P2_PAUSE_HIGH, P2_PAUSE_LOW);
-	// else
-	//	delay(10);
-
-    } // Repeat-loop
+	case '0':
+	  this->send0();
+	  break;
+	case '1':
+	  this->send1();
+	  break;
+	case RC_CODE_DIM:
+	  this->sendDim();
+	  break;
+	}
+      i++;
+    } // Code-loop
+  // PAUSE
+  // if(this->mProtocol == 2){
+  //	this->transmit(P2_0_TIMING_HIGH, P2_0_TIMING_LOW);
+  //}
+  this->transmit(P2_PAUSE_HIGH, P2_PAUSE_LOW);
+  // else
+  //	delay(10);
 }
 
 
@@ -232,6 +494,19 @@ void RCTransmit::send1()
     }
 }
 
+/**
+ * Sends the dim marker in place of the on/off bit, protocol 2 only
+ *
+ *                _       _
+ *     Waveform: | |_____| |_____
+ *     Bits: 11
+ */
+void RCTransmit::sendDim()
+{
+  this->transmit(P2_1_TIMING_HIGH, P2_1_TIMING_LOW);
+  this->transmit(P2_1_TIMING_HIGH, P2_1_TIMING_LOW);
+}
+
 void RCTransmit::transmit(const int &highPulses, const int &lowPulses)
 {
   digitalWrite(this->mTransmitPin, HIGH);
@@ -67,7 +67,7 @@
  * 56-57  29       10=On 01=Off 11=Dim
  * 58-61  30-31    Channel code
  * 62-65  32-33    Button code
- * 66-73  34-37    Dimmer grade, 16 stages
+ * 66-73  34-37    Dimmer grade, 16 stages, only in dim frames
  * 
  * Channel/button code:
  * 1010 = 1
@@ -91,8 +91,85 @@
 #define P2_SYNC_LOW 2700
 #define P2_PAUSE_HIGH 235
 #define P2_PAUSE_LOW 10000
+
+/*
+ * Dim frames: the on/off bit is sent as wire 11, which no data bit is,
+ * and the 4 bit level follows the button code (LSB first, like the
+ * rest of the code). Level 0 is the lowest step, not off.
+ */
+#define RC_DIM_LEVELS 16
+#define RC_NO_LEVEL 255  // RCCommand.level of an on/off command
+#define RC_P2_DEVICE 15  // Channel and button code 3, used unless a switch has an address
+#define RC_CODE_DIM 'D'  // In a code buffer: wire 11
 // #### END OF PROTOCOL 2 ####
 
+/*
+ * RF address of a switch in 32 bits: 26 bit group code, 4 bit device
+ * (unit) and the protocol, which is never 0, so address 0 means none.
+ */
+#define RC_ADDRESS(group, device, protocol) \
+  ((unsigned long)(group) | (unsigned long)(device) << 26 | (unsigned long)(protocol) << 30)
+#define RC_ADDRESS_GROUP(address) ((address) & 0x3FFFFFFUL)
+#define RC_ADDRESS_DEVICE(address) ((int)((address) >> 26) & 0xF)
+#define RC_ADDRESS_PROTOCOL(address) ((byte)((address) >> 30))
+
+/*
+ * Commands given to queue() are sent one frame per call to poll(), so a
+ * full command (all repeats) never blocks the caller for more than one
+ * frame at a time.
+ *
+ * Commands for a switch that already has one waiting are merged: the
+ * newer state replaces the waiting one, and if that is the state the
+ * switch is being sent or was sent within RC_DEDUP_WINDOW ms, the
+ * waiting command is dropped too. A command for the state just sent is
+ * dropped. Double taps, retries and a timer firing as a user switches
+ * the same switch then cost no extra air time.
+ */
+#define RC_QUEUE_SIZE 8
+#define RC_CODE_SIZE 40
+#define RC_SENT_SIZE 4        // Sent commands remembered for deduplication
+#define RC_DEDUP_WINDOW 2000  // ms
+
+/*
+ * A fade moves a protocol 2 dimmer from one level to another over a
+ * duration. poll() queues the level due at the time, and a level still
+ * waiting when the next is due is replaced (as above). A slow or busy
+ * channel skips steps. The last level is queued RC_FADE_LEAD before the
+ * end, and no step in the RC_FADE_LEAD before that, so it is on air by
+ * the end of the fade when nothing else is queued. An Uno has room for
+ * two at a time, see the RAM budget in smarthome.ino.
+ */
+#if RAMEND > 0x8FF
+#define RC_FADES 4
+#else
+#define RC_FADES 2
+#endif
+#define RC_FADE_LEAD 600 // ms, 7 protocol 2 frames
+
+typedef struct {
+  unsigned long controller;
+  byte protocol;
+  bool status;
+  bool group;
+  int device;
+  byte level;   // Dim level, RC_NO_LEVEL for on/off
+} RCCommand;
+
+typedef struct {
+  RCCommand command;
+  unsigned long sentAt; // millis() when the last frame went out
+} RCSent;
+
+typedef struct {
+  unsigned long controller;     // 0 if the slot is free
+  int device;
+  byte from;
+  byte to;
+  byte sent;          // Level queued last
+  unsigned long start;    // millis()
+  unsigned long duration; // ms
+} RCFade;
+
 class RCTransmit 
 {
 public:
@@ -104,29 +181,66 @@ public:
   void setRepeatTransmit(int repeat);
   //void switchOn(int controller, bool group, int device);
   //void switchOff(int controller, bool group, int device);
-  void switchOn(int controller, byte protocol, bool group, int device, byte buttonCode = 0);
-  void switchOff(int controller, byte protocol, bool group, int device, byte buttonCode = 0);
+  // Protocol 2 takes the button code in bits 2-3 of device, see RC_P2_DEVICE
+  void switchOn(unsigned long controller, byte protocol, bool group, int device);
+  void switchOff(unsigned long controller, byte protocol, bool group, int device);
+
+  bool queue(unsigned long controller, byte protocol, bool status, bool group = false, int device = 0);
+  bool queueDim(unsigned long controller, byte level, int device = RC_P2_DEVICE);
+  bool fade(unsigned long controller, byte from, byte to, unsigned long duration, int device = RC_P2_DEVICE);
+  void forget(unsigned long controller, int device); // The switch was set by a remote
+  bool poll();
+  byte pending();
+  bool busy(); // Something queued or fading, poll() has work
+  byte freeSlots();
+  unsigned int queued(){return mQueued;}   // Commands added to the queue
+  unsigned int merged(){return mMerged;}   // Replaced a waiting command
+  unsigned int dropped(){return mDropped;} // Same as the state sent
 
 private:
-  void start(int controller, byte protocol, bool status, bool group, int device, byte buttonCode);
+  void start(unsigned long controller, byte protocol, bool status, bool group, int device);
 
-  void insert(char*& buffer, unsigned int& pos, const int& input, const byte& numofbits);
+  void insert(char*& buffer, unsigned int& pos, const unsigned long& input, const byte& numofbits);
   //TODO: Change name when more protocols with same sending sequence are implemented. 
-  void getCodeProtocol1(char* &buffer, const int &controller, const bool &group, const bool &status, const int &device);
-  void getCodeProtocol2(char* &buffer, const int &controller, const bool &group, 
-			const bool &status,const int &channel, const byte &buttonCode);
+  void getCodeProtocol1(char* &buffer, const unsigned long &controller, const bool &group, const bool &status, const int &device);
+  void getCodeProtocol2(char* &buffer, const unsigned long &controller, const bool &group, 
+			const bool &status,const int &channel, const byte &buttonCode,
+			const byte &level = RC_NO_LEVEL);
   //TODO: Change name when more protocols with same sending sequence are implemented. 
   void send(const char* code);
+  void sendFrame(const char* code);
+  bool encode(char* buffer, const RCCommand& command);
+  bool add(const RCCommand& command);
+  static bool sameSwitch(const RCCommand& a, const RCCommand& b);
+  static int stateOf(const RCCommand& command);
+  int sentState(const RCCommand& command);
+  void stepFades();
+  void endFade(unsigned long controller, int device);
+  void removeAt(byte index);
+  void remember(const RCCommand& command);
 
   void sendSync();
   void send0();
   void send1();
+  void sendDim();
   void transmit(const int &highPulses, const int &lowPulses);
 
   int mProtocol;
   const int mTransmitPin;
   int mPulseLength;
   int mRepeatTransmit;
+
+  RCCommand mQueue[RC_QUEUE_SIZE];
+  byte mHead;
+  byte mCount;
+  int mRepeatsLeft; // Frames left of the command at mHead, 0 = not started
+  char mCode[RC_CODE_SIZE];
+  RCSent mSent[RC_SENT_SIZE];
+  byte mSentNext;       // Slot to reuse next in mSent
+  unsigned int mQueued;
+  unsigned int mMerged;
+  unsigned int mDropped;
+  RCFade mFades[RC_FADES];
 };
 
 #endif
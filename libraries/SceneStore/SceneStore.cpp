@@ -0,0 +1,109 @@
+#include "SceneStore.h"
+#include <EEPROM.h>
+#include <EventLog.h>
+
+SceneStore::SceneStore(unsigned int eepromAddr)
+  : mEepromAddr(eepromAddr)
+{
+}
+
+/*
+ * Store scene, replacing one with the same id. Returns false if it is
+ * new and all slots are taken. Only bytes that changed are written.
+ */
+boolean SceneStore::save(const Scene& scene)
+{
+  int slot = find(scene.id);
+  if(slot < 0)
+    slot = find(0);
+  if(slot < 0)
+    return false;
+  write(slot, scene);
+  LOG_INFO(EV_SCENE_SAVED, scene.id);
+  return true;
+}
+
+static void updateEEPROM(unsigned int addr, byte value)
+{
+  if(EEPROM.read(addr) != value)
+    EEPROM.write(addr, value);
+}
+
+void SceneStore::write(byte slot, const Scene& scene)
+{
+  unsigned int addr = slotAddr(slot);
+  const byte* p = (const byte*)&scene;
+  for(byte i = 0; i < SCENE_HEADER_SIZE; ++i)
+    updateEEPROM(addr++, p[i]);
+  for(byte i = 0; i < SCENE_MAX_SWITCHES; ++i){
+    uint16_t id = i < scene.count ? scene.switches[i] : 0; // The rest may be anything
+    updateEEPROM(addr++, id >> 8);
+    updateEEPROM(addr++, id & 0xFF);
+  }
+}
+
+/*
+ * Move the scenes saved with 8 bit switch ids at oldAddr here. Both
+ * areas end at the same address, so slot by slot from the first, each
+ * old record is read before a new one is written over it.
+ */
+void SceneStore::upgrade(unsigned int oldAddr)
+{
+  Scene scene;
+  byte* p = (byte*)&scene;
+  for(byte slot = 0; slot < SCENE_SLOTS; ++slot){
+    unsigned int addr = oldAddr + slot * SCENE_V1_RECORD_SIZE;
+    for(byte i = 0; i < SCENE_HEADER_SIZE; ++i)
+      p[i] = EEPROM.read(addr++);
+    for(byte i = 0; i < SCENE_MAX_SWITCHES; ++i)
+      scene.switches[i] = EEPROM.read(addr++);
+    write(slot, scene);
+  }
+}
+
+boolean SceneStore::remove(byte id)
+{
+  int slot = find(id);
+  if(slot < 0)
+    return false;
+  EEPROM.write(slotAddr(slot), 0);
+  LOG_INFO(EV_SCENE_REMOVED, id);
+  return true;
+}
+
+boolean SceneStore::load(byte id, Scene& scene)
+{
+  int slot = find(id);
+  return slot >= 0 && loadSlot(slot, scene);
+}
+
+boolean SceneStore::loadSlot(byte slot, Scene& scene)
+{
+  unsigned int addr = slotAddr(slot);
+  byte* p = (byte*)&scene;
+  for(byte i = 0; i < SCENE_HEADER_SIZE; ++i)
+    p[i] = EEPROM.read(addr++);
+  for(byte i = 0; i < SCENE_MAX_SWITCHES; ++i){
+    scene.switches[i] = EEPROM.read(addr) << 8 | EEPROM.read(addr + 1);
+    addr += 2;
+  }
+  if(scene.count > SCENE_MAX_SWITCHES)
+    scene.count = SCENE_MAX_SWITCHES;
+  return scene.id != 0 && scene.id != 255;
+}
+
+// id 0 finds a free slot
+int SceneStore::find(byte id)
+{
+  for(byte slot = 0; slot < SCENE_SLOTS; ++slot){
+    byte stored = EEPROM.read(slotAddr(slot));
+    if(stored == id || (id == 0 && stored == 255))
+      return slot;
+  }
+  return -1;
+}
+
+unsigned int SceneStore::slotAddr(byte slot)
+{
+  return mEepromAddr + slot * SCENE_RECORD_SIZE;
+}
@@ -0,0 +1,61 @@
+#ifndef _SCENE_STORE_
+#define _SCENE_STORE_
+
+#include "Arduino.h"
+
+/**
+ *
+ * #### Scenes ####
+ *
+ * A scene is a list of switches, each to be turned on or off, that is
+ * triggered as one command or at a time of day. Scenes live only in
+ * EEPROM and are read when needed, nothing is kept in RAM.
+ *
+ * EEPROM, SCENE_SLOTS records of SCENE_RECORD_SIZE bytes from the
+ * address given to the constructor:
+ * Byte 0:    Scene id, 0 or 255 if the slot is free
+ * Byte 1:    Number of switches
+ * Byte 2:    On/off, bit i for switch i
+ * Byte 3-4:  Hour and minute to trigger at, hour SCENE_NO_TIME if none
+ * Byte 5-20: Switch ids, 2 bytes each, high byte first
+ * Scenes saved with 8 bit switch ids had SCENE_V1_RECORD_SIZE bytes,
+ * see upgrade().
+ */
+#define SCENE_SLOTS 8
+#define SCENE_MAX_SWITCHES 8
+#define SCENE_HEADER_SIZE 5
+#define SCENE_RECORD_SIZE (SCENE_HEADER_SIZE + 2 * SCENE_MAX_SWITCHES)
+#define SCENE_AREA_SIZE (SCENE_SLOTS * SCENE_RECORD_SIZE)
+#define SCENE_V1_RECORD_SIZE (SCENE_HEADER_SIZE + SCENE_MAX_SWITCHES)
+#define SCENE_V1_AREA_SIZE (SCENE_SLOTS * SCENE_V1_RECORD_SIZE)
+#define SCENE_NO_TIME 255
+
+typedef struct {
+  byte id;
+  byte count;
+  byte onMask;
+  byte hour;
+  byte minute;
+  uint16_t switches[SCENE_MAX_SWITCHES]; // Switch ids
+} Scene;
+
+class SceneStore {
+ public:
+
+  SceneStore(unsigned int eepromAddr);
+
+  boolean save(const Scene& scene);
+  boolean remove(byte id);
+  boolean load(byte id, Scene& scene);
+  boolean loadSlot(byte slot, Scene& scene); // False if the slot is free
+  void upgrade(unsigned int oldAddr);
+
+ private:
+  int find(byte id); // Slot holding id, -1 if none
+  unsigned int slotAddr(byte slot);
+  void write(byte slot, const Scene& scene);
+
+  const unsigned int mEepromAddr;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#include "Snapshot.h"
+#include <EEPROM.h>
+#include <EventLog.h>
+#include <MemStats.h>
+
+// Passes bytes on and keeps their CRC
+class CrcPrint : public Print {
+ public:
+  CrcPrint(Print& out) : mOut(out) { crc = 0xFFFF; }
+  size_t write(uint8_t value){
+    crc = AVL_tree::Crc16(crc, value);
+    return mOut.write(value);
+  }
+  size_t write(const uint8_t* buffer, size_t size){
+    for(size_t i = 0; i < size; ++i)
+      crc = AVL_tree::Crc16(crc, buffer[i]);
+    return mOut.write(buffer, size);
+  }
+  using Print::write;
+  uint16_t crc;
+
+ private:
+  Print& mOut;
+};
+
+Snapshot::Snapshot(unsigned int ruleAddr)
+  : mRuleAddr(ruleAddr)
+{
+  mTree = NULL;
+  mRules = NULL;
+}
+
+// 'X': the image of the cache and the timer rules
+void Snapshot::send(AVL_tree* tree, Print& out)
+{
+  CrcPrint image(out);
+  image.write(SNAPSHOT_MAGIC);
+  image.write(SNAPSHOT_VERSION);
+  tree->WriteImage(image);
+  byte rule[TIMER_RULE_SIZE];
+  for(unsigned int addr = mRuleAddr; addr < mRuleAddr + TIMER_RULE_AREA_SIZE; addr += TIMER_RULE_SIZE){
+    for(byte i = 0; i < TIMER_RULE_SIZE; ++i)
+      rule[i] = EEPROM.read(addr + i);
+    image.write(rule, TIMER_RULE_SIZE);
+  }
+  byte check[SNAPSHOT_CRC_SIZE] = { (byte)(image.crc >> 8), (byte)(image.crc & 0xFF) };
+  out.write(check, SNAPSHOT_CRC_SIZE);
+  LOG_INFO(EV_SNAPSHOT_SENT, tree->Size());
+}
+
+/*
+ * 'Y': the image follows on the connection, pass it to read() until
+ * that is done. The cache must not be flushed to EEPROM meanwhile.
+ */
+boolean Snapshot::begin(AVL_tree* tree)
+{
+  if(tree->Unloaded())
+    return false; // A bad image could not be put back from RAM
+  mRules = new byte[TIMER_RULE_AREA_SIZE];
+  if(!mRules)
+    return false;
+  MemStats::countAlloc(MEM_SNAPSHOT);
+  mTree = tree;
+  mCount = 0;
+  mSize = SNAPSHOT_SIZE(0);
+  mPos = 0;
+  mCommit = 0;
+  mCrc = 0xFFFF;
+  mLast = millis();
+  return true;
+}
+
+// Take what has arrived of the image, write one byte of it at most
+byte Snapshot::read(EthernetClient& client)
+{
+  mWrote = false;
+  if(mPos == mSize) // Checked out
+    return commit() ? finish(true) : SNAPSHOT_MORE;
+  if(!client.available())
+    return millis() - mLast < SNAPSHOT_IDLE_TIMEOUT ? SNAPSHOT_MORE : finish(false);
+  mLast = millis();
+  while(!mWrote && mPos < mSize && client.available())
+    if(!take(client.read()))
+      return finish(false);
+  return SNAPSHOT_MORE;
+}
+
+// The next image byte, false if the image is bad
+boolean Snapshot::take(byte value)
+{
+  unsigned int pos = mPos++;
+  if(pos < mSize - SNAPSHOT_CRC_SIZE)
+    mCrc = AVL_tree::Crc16(mCrc, value);
+  if(pos == 0)
+    return value == SNAPSHOT_MAGIC;
+  if(pos == 1)
+    return value == SNAPSHOT_VERSION;
+  unsigned int addr = pos - SNAPSHOT_HEADER_SIZE; // In the cache image
+  if(addr < TREE_HEADER_SIZE){
+    mHeader[addr] = value;
+    if(addr == 0)
+      return value == TREE_FORMAT;
+    if(addr < TREE_HEADER_SIZE - 1)
+      return true;
+    mCount = mHeader[1] << 8 | mHeader[2];
+    mSize = SNAPSHOT_SIZE(mCount);
+    if(mCount > mTree->MaxSize())
+      return false;
+    update(0, 0xFF); // Never written, until the restore is through
+    return true;
+  }
+  if(addr < TREE_EEPROM_SIZE(mCount)){
+    update(addr, value);
+    return true;
+  }
+  addr -= TREE_EEPROM_SIZE(mCount);
+  if(addr < TIMER_RULE_AREA_SIZE){
+    mRules[addr] = value;
+    return true;
+  }
+  if(pos == mSize - SNAPSHOT_CRC_SIZE)
+    return value == mCrc >> 8;
+  return value == (mCrc & 0xFF);
+}
+
+// Write the rules, then the cache header with its format last. True when done.
+boolean Snapshot::commit()
+{
+  while(!mWrote && mCommit < TIMER_RULE_AREA_SIZE + TREE_HEADER_SIZE){
+    if(mCommit < TIMER_RULE_AREA_SIZE){
+      update(mRuleAddr + mCommit, mRules[mCommit]);
+    }
+    else{
+      byte addr = (mCommit - TIMER_RULE_AREA_SIZE + 1) % TREE_HEADER_SIZE;
+      update(addr, mHeader[addr]);
+    }
+    ++mCommit;
+  }
+  return mCommit == TIMER_RULE_AREA_SIZE + TREE_HEADER_SIZE;
+}
+
+byte Snapshot::finish(boolean ok)
+{
+  delete[] mRules;
+  MemStats::countFree(MEM_SNAPSHOT);
+  mRules = NULL;
+  if(!ok){
+    LOG_WARN(EV_SNAPSHOT_FAILED, mPos);
+    mTree->MarkDirty(); // Put back what was overwritten
+    return SNAPSHOT_FAILED;
+  }
+  mTree->Reload();
+  LOG_INFO(EV_SNAPSHOT_LOADED, mTree->Size());
+  return SNAPSHOT_DONE;
+}
+
+void Snapshot::update(unsigned int addr, byte value)
+{
+  if(EEPROM.read(addr) == value)
+    return;
+  EEPROM.write(addr, value);
+  mWrote = true;
+}
@@ -0,0 +1,72 @@
+#ifndef _SNAPSHOT_
+#define _SNAPSHOT_
+
+#include "Arduino.h"
+#include <Ethernet.h>
+#include <AVL_tree.h>
+#include <TimerSchedule.h>
+
+/**
+ *
+ * #### Snapshots ####
+ *
+ * The switch cache and the timer rules as one binary image, so a unit
+ * can be copied to a replacement in one round trip ('X' sends it, 'Y'
+ * followed by the image restores it) instead of replaying 'A' and 'T':
+ *   SNAPSHOT_MAGIC, SNAPSHOT_VERSION
+ *   The cache as in EEPROM: TREE_FORMAT, count, records, CRC (see AVL_tree.h)
+ *   The timer rule area, TIMER_RULE_AREA_SIZE bytes (see TimerSchedule.h)
+ *   CRC-16/CCITT of all the above, high byte first
+ * Scenes and the DHCP lease stay with the unit.
+ *
+ * A restore writes the records to EEPROM as they arrive, in one pass
+ * and only the bytes that differ, at most one write (3.3 ms) per call
+ * to read(). The cache header is cleared first, so a restore cut short
+ * by a reset loads no switches rather than a mix. The timer rules are
+ * held in RAM until the CRC has checked out, then written with the
+ * cache header last, and the cache is built from EEPROM in one pass
+ * (AVL_tree::Reload). After a bad image the rules are left alone and
+ * the cache is saved again from RAM.
+ */
+#define SNAPSHOT_MAGIC 0x5E
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 2
+#define SNAPSHOT_CRC_SIZE 2
+#define SNAPSHOT_SIZE(n) (SNAPSHOT_HEADER_SIZE + TREE_EEPROM_SIZE(n) + TIMER_RULE_AREA_SIZE + SNAPSHOT_CRC_SIZE)
+#define SNAPSHOT_IDLE_TIMEOUT 2000 // ms without image bytes before a restore is given up
+
+// Return codes from read()
+#define SNAPSHOT_MORE 0   // Call again
+#define SNAPSHOT_DONE 1   // Restored
+#define SNAPSHOT_FAILED 2 // Bad image or timed out
+
+class Snapshot {
+ public:
+
+  Snapshot(unsigned int ruleAddr);
+
+  void send(AVL_tree* tree, Print& out);
+  boolean begin(AVL_tree* tree); // False if there is no RAM for the rules, or not all switches are
+  byte read(EthernetClient& client);
+  boolean active(){return mRules != NULL;}
+
+ private:
+  boolean take(byte value);
+  boolean commit();
+  byte finish(boolean ok);
+  void update(unsigned int addr, byte value);
+
+  const unsigned int mRuleAddr;
+  AVL_tree* mTree;
+  byte* mRules;          // Timer rule area of the image, while restoring
+  byte mHeader[TREE_HEADER_SIZE];
+  unsigned int mCount;   // Switches in the image
+  unsigned int mSize;    // Bytes in the image, once mCount is known
+  unsigned int mPos;     // Bytes read
+  unsigned int mCommit;  // Bytes written after the CRC checked out
+  uint16_t mCrc;
+  boolean mWrote;        // An EEPROM cell was written in this call
+  unsigned long mLast;   // millis() of the last image bytes
+};
+
+#endif
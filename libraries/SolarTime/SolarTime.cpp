@@ -0,0 +1,80 @@
+#include "SolarTime.h"
+
+SolarTime::SolarTime(float latitude, float longitude)
+  : mLatitude(latitude), mLongitude(longitude)
+{
+  mDays = -1;
+  mSunrise = SOLAR_NONE;
+  mSunset = SOLAR_NONE;
+}
+
+// Compute the times of a new date, nothing is done for the date already held
+boolean SolarTime::update(unsigned int year, byte month, byte day)
+{
+  long days = daysSince2000(year, month, day);
+  if(days == mDays)
+    return false;
+  mDays = days;
+  unsigned int rise = event(days, true);
+  unsigned int set = event(days, false);
+  if(rise == SOLAR_NONE || set == SOLAR_NONE)
+    rise = set = SOLAR_NONE;
+  boolean changed = rise != mSunrise || set != mSunset;
+  mSunrise = rise;
+  mSunset = set;
+  return changed;
+}
+
+/*
+ * Minute (UTC) the sun rises or sets on the given day. The sun's
+ * position is first taken at noon, then once more at the time found.
+ */
+unsigned int SolarTime::event(long days, boolean rising)
+{
+  float minute = 720;
+  for(byte pass = 0; pass < SOLAR_PASSES; ++pass){
+    // Julian centuries since J2000.0 (2000-01-01 12:00 UTC)
+    float jc = (days - 0.5 + minute / 1440.0) / 36525.0;
+    float meanLong = fmod(280.46646 + jc * (36000.76983 + jc * 0.0003032), 360.0);
+    float meanAnomaly = (357.52911 + jc * (35999.05029 - 0.0001537 * jc)) * DEG_TO_RAD;
+    float eccentricity = 0.016708634 - jc * (0.000042037 + 0.0000001267 * jc);
+    float center = sin(meanAnomaly) * (1.914602 - jc * (0.004817 + 0.000014 * jc))
+      + sin(2 * meanAnomaly) * (0.019993 - 0.000101 * jc)
+      + sin(3 * meanAnomaly) * 0.000289;
+    float omega = (125.04 - 1934.136 * jc) * DEG_TO_RAD;
+    float apparentLong = (meanLong + center - 0.00569 - 0.00478 * sin(omega)) * DEG_TO_RAD;
+    float obliquity = (23.0 + (26.0 + (21.448 - jc * (46.815 + jc * (0.00059 - jc * 0.001813))) / 60.0) / 60.0
+		       + 0.00256 * cos(omega)) * DEG_TO_RAD;
+    float declination = asin(sin(obliquity) * sin(apparentLong));
+
+    // Equation of time, minutes
+    float y = tan(obliquity / 2);
+    y *= y;
+    float l0 = meanLong * DEG_TO_RAD;
+    float eqTime = 4 * RAD_TO_DEG * (y * sin(2 * l0) - 2 * eccentricity * sin(meanAnomaly)
+				     + 4 * eccentricity * y * sin(meanAnomaly) * cos(2 * l0)
+				     - 0.5 * y * y * sin(4 * l0)
+				     - 1.25 * eccentricity * eccentricity * sin(2 * meanAnomaly));
+
+    float latitude = mLatitude * DEG_TO_RAD;
+    float cosHourAngle = cos(SOLAR_ZENITH * DEG_TO_RAD) / (cos(latitude) * cos(declination))
+      - tan(latitude) * tan(declination);
+    if(cosHourAngle > 1 || cosHourAngle < -1)
+      return SOLAR_NONE;
+    float hourAngle = acos(cosHourAngle) * RAD_TO_DEG;
+    minute = 720 - 4 * (mLongitude + (rising ? hourAngle : -hourAngle)) - eqTime;
+  }
+  // East of Greenwich sunrise may be the evening before in UTC, and sunset
+  // west of it the morning after
+  long m = lround(minute) % 1440;
+  return m < 0 ? m + 1440 : m;
+}
+
+long SolarTime::daysSince2000(unsigned int year, byte month, byte day)
+{
+  unsigned int y = year - 2000;
+  boolean leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+  // Day of year (Meeus)
+  unsigned int yday = 275 * month / 9 - (leap ? 1 : 2) * ((month + 9) / 12) + day - 30;
+  return 365L * y + (y + 3) / 4 - (y + 99) / 100 + (y + 399) / 400 + yday - 1;
+}
@@ -0,0 +1,44 @@
+#ifndef _SOLAR_TIME_
+#define _SOLAR_TIME_
+
+#include "Arduino.h"
+
+/**
+ *
+ * #### Sunrise and sunset ####
+ *
+ * Sunrise and sunset at a fixed place, for timers that follow the sun.
+ * Both are computed when the date changes, with the equations of the
+ * NOAA solar calculator (Meeus), and kept for the rest of the day.
+ * Float is enough: up to about 60 degrees latitude the times are within
+ * a minute of a double precision calculation. Closer to the polar
+ * circles they get less exact as the sun barely crosses the horizon.
+ *
+ * Times are minutes after midnight UTC. A day without sunrise or sunset
+ * (polar night, midnight sun) has SOLAR_NONE for both.
+ */
+#define SOLAR_NONE 0xFFFF
+#define SOLAR_ZENITH 90.833 // Degrees, sun's upper edge on the horizon with refraction
+#define SOLAR_PASSES 2      // First at noon, then again at the time found
+
+class SolarTime {
+ public:
+
+  SolarTime(float latitude, float longitude); // Degrees, north and east positive
+
+  boolean update(unsigned int year, byte month, byte day); // True if the times changed
+  unsigned int sunrise(){return mSunrise;}
+  unsigned int sunset(){return mSunset;}
+
+ private:
+  unsigned int event(long days, boolean rising);
+  static long daysSince2000(unsigned int year, byte month, byte day);
+
+  const float mLatitude;
+  const float mLongitude;
+  long mDays;   // Date of the times below, days since 2000-01-01
+  unsigned int mSunrise;
+  unsigned int mSunset;
+};
+
+#endif
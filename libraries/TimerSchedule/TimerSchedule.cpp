@@ -0,0 +1,239 @@
+#include "TimerSchedule.h"
+#include <EEPROM.h>
+#include <EventLog.h>
+#include <MemStats.h>
+
+TimerSchedule::TimerSchedule(unsigned int eepromAddr)
+  : mEepromAddr(eepromAddr)
+{
+  mTable = NULL;
+  mSize = 0;
+  mCount = 0;
+  mCursor = 0;
+  mDay = 0;
+  mChanged = false;
+  mLastMinute = -1;
+  mSunrise = TIMER_NO_TIME;
+  mSunset = TIMER_NO_TIME;
+}
+
+/*
+ * A switch has one on and one off time, its timer's other switches
+ * share them or bring their own. Two transitions per switch are all a
+ * day can have, once for the life of the sketch.
+ */
+boolean TimerSchedule::begin(unsigned int switches)
+{
+  mTable = new Transition[2 * switches];
+  if(!mTable)
+    return false;
+  MemStats::countAlloc(MEM_SCHEDULE);
+  mSize = 2 * switches;
+  return true;
+}
+
+// Store rule, replacing the one of the same timer. Only changed bytes are written.
+boolean TimerSchedule::setRule(const TimerRule& rule)
+{
+  int slot = find(rule.timerid);
+  if(slot < 0)
+    slot = find(255);
+  if(slot < 0)
+    return false;
+  unsigned int addr = slotAddr(slot);
+  const byte* p = (const byte*)&rule;
+  for(byte i = 0; i < TIMER_RULE_SIZE; ++i){
+    if(EEPROM.read(addr + i) != p[i])
+      EEPROM.write(addr + i, p[i]);
+  }
+  invalidate();
+  return true;
+}
+
+boolean TimerSchedule::removeRule(byte timerid)
+{
+  int slot = find(timerid);
+  if(slot < 0)
+    return false;
+  EEPROM.write(slotAddr(slot), 255);
+  return true;
+}
+
+boolean TimerSchedule::loadRule(byte timerid, TimerRule& rule)
+{
+  int slot = find(timerid);
+  if(slot < 0)
+    return false;
+  unsigned int addr = slotAddr(slot);
+  byte* p = (byte*)&rule;
+  for(byte i = 0; i < TIMER_RULE_SIZE; ++i)
+    p[i] = EEPROM.read(addr + i);
+  return true;
+}
+
+void TimerSchedule::invalidate()
+{
+  mChanged = true;
+}
+
+// Timers following the sun move with it, compile again when it changed
+void TimerSchedule::setSunTimes(unsigned int sunrise, unsigned int sunset)
+{
+  if(sunrise == mSunrise && sunset == mSunset)
+    return;
+  mSunrise = sunrise;
+  mSunset = sunset;
+  invalidate();
+}
+
+/*
+ * Next transition due at or before minute (of day), in time order.
+ * Call until it returns false. Transitions before the first call after
+ * boot are skipped, a new day starts from midnight.
+ */
+boolean TimerSchedule::next(AVL_tree* tree, byte wday, byte month, byte day, unsigned int minute, Transition& due)
+{
+  boolean reposition = false;
+  if(day != mDay){
+    mLastMinute = mDay == 0 ? (int)minute - 1 : -1;
+    compile(tree, wday, month, day);
+    mDay = day;
+    reposition = true;
+  }
+  else if(mChanged){
+    compile(tree, wday, month, day);
+    reposition = true;
+  }
+  else if((int)minute < mLastMinute){ // Clock set back
+    mLastMinute = (int)minute - 1;
+    reposition = true;
+  }
+  if(reposition){
+    mCursor = 0;
+    while(mCursor < mCount && (int)(mTable[mCursor].minute & TRANSITION_MINUTE) <= mLastMinute)
+      ++mCursor;
+  }
+
+  if(mCursor < mCount && (mTable[mCursor].minute & TRANSITION_MINUTE) <= minute){
+    due = mTable[mCursor++];
+    return true;
+  }
+  mLastMinute = minute;
+  return false;
+}
+
+/*
+ * Build today's table: the on and off transitions of every timer that
+ * runs today, sorted by minute. A one-shot timer expires with the last
+ * of its transitions only.
+ */
+void TimerSchedule::compile(AVL_tree* tree, byte wday, byte month, byte day)
+{
+  mCount = 0;
+  mChanged = false;
+  tree->ForEach([&](Node& node){ compileNode(node, wday, month, day); });
+
+  // Insertion sort, the table is compiled rarely
+  for(unsigned int i = 1; i < mCount; ++i){
+    Transition t = mTable[i];
+    unsigned int j = i;
+    while(j > 0 && sortKey(mTable[j - 1]) > sortKey(t)){
+      mTable[j] = mTable[j - 1];
+      --j;
+    }
+    mTable[j] = t;
+  }
+  for(unsigned int i = 0; i < mCount; ++i){
+    for(unsigned int j = i + 1; j < mCount && (mTable[i].minute & TRANSITION_EXPIRES); ++j)
+      if(mTable[j].timerid == mTable[i].timerid)
+	mTable[i].minute &= ~TRANSITION_EXPIRES;
+  }
+}
+
+// Minute order, at the same minute the expiring transition last
+unsigned int TimerSchedule::sortKey(const Transition& t)
+{
+  return (t.minute & TRANSITION_MINUTE) << 1 | (t.minute & TRANSITION_EXPIRES ? 1 : 0);
+}
+
+void TimerSchedule::compileNode(Node node, byte wday, byte month, byte day)
+{
+  if(node->timerid == 255)
+    return;
+  TimerRule rule;
+  boolean once = false;
+  if(loadRule(node->timerid, rule)){
+    if(!runsOn(rule, wday, month, day))
+      return;
+    once = rule.days & TIMER_ONCE;
+  }
+  unsigned int on = minuteOf(node->onHour, node->onMinute);
+  unsigned int off = minuteOf(node->offHour, node->offMinute);
+  if(on == TIMER_NO_TIME || off == TIMER_NO_TIME)
+    return;
+  add(on | TRANSITION_ON | (once && on >= off ? TRANSITION_EXPIRES : 0), node->timerid);
+  add(off | (once && off > on ? TRANSITION_EXPIRES : 0), node->timerid);
+}
+
+// Minute of day of a timer's on or off time, TIMER_NO_TIME if it has none today
+unsigned int TimerSchedule::minuteOf(byte hour, byte minute)
+{
+  if(!validTime(hour, minute))
+    return TIMER_NO_TIME;
+  if(hour < 24)
+    return hour * 60 + minute;
+  unsigned int sun = hour <= TIMER_AFTER_SUNRISE ? mSunrise : mSunset;
+  if(sun == TIMER_NO_TIME)
+    return TIMER_NO_TIME;
+  // Offsets stay within the day, the table has no yesterday or tomorrow
+  if(hour == TIMER_BEFORE_SUNRISE || hour == TIMER_BEFORE_SUNSET)
+    return sun > minute ? sun - minute : 0;
+  return sun + minute < 1440 ? sun + minute : 1439;
+}
+
+// Transition unless the timer has it already, from another of its switches
+void TimerSchedule::add(unsigned int minute, byte timerid)
+{
+  for(unsigned int i = 0; i < mCount; ++i){
+    if(mTable[i].timerid == timerid && ((mTable[i].minute ^ minute) & ~TRANSITION_EXPIRES) == 0){
+      mTable[i].minute |= minute & TRANSITION_EXPIRES;
+      return;
+    }
+  }
+  if(mCount == mSize){ // Only without begin(), or switches beyond its count
+    LOG_WARN(EV_SCHEDULE_FULL, timerid);
+    return;
+  }
+  mTable[mCount].minute = minute;
+  mTable[mCount].timerid = timerid;
+  ++mCount;
+}
+
+boolean TimerSchedule::runsOn(const TimerRule& rule, byte wday, byte month, byte day)
+{
+  if(!(rule.days & (1 << (wday - 1))))
+    return false;
+  if(rule.fromMonth == 0)
+    return true;
+  unsigned int today = month * 32 + day;
+  unsigned int from = rule.fromMonth * 32 + rule.fromDay;
+  unsigned int to = rule.toMonth * 32 + rule.toDay;
+  if(from <= to)
+    return today >= from && today <= to;
+  return today >= from || today <= to; // Over new year
+}
+
+// Slot holding timerid, 255 finds a free slot
+int TimerSchedule::find(byte timerid)
+{
+  for(byte slot = 0; slot < TIMER_RULE_SLOTS; ++slot){
+    if(EEPROM.read(slotAddr(slot)) == timerid)
+      return slot;
+  }
+  return -1;
+}
+
+unsigned int TimerSchedule::slotAddr(byte slot)
+{
+  return mEepromAddr + slot * TIMER_RULE_SIZE;
+}
@@ -0,0 +1,112 @@
+#ifndef _TIMER_SCHEDULE_
+#define _TIMER_SCHEDULE_
+
+#include "Arduino.h"
+#include <AVL_tree.h>
+
+/**
+ *
+ * #### Timer schedule ####
+ *
+ * Switches carry a timer id and the daily on/off times of that timer
+ * ('T'). Rules stored here limit when a timer runs: on some weekdays,
+ * within a date range, or only once. A timer without a rule runs every
+ * day.
+ *
+ * Once a day, and whenever timers or rules change, the timers that run
+ * today are compiled into a table of transitions sorted by minute.
+ * Checking is then a cursor moving through the table, rules are not
+ * looked at again until the next compile. begin() allocates the table
+ * for two transitions per switch the cache holds, so every timer fits
+ * (SCHEDULE_RAM_PER_SWITCH, see AVL_tree::Capacity()). Switches of one timer may
+ * have been given different times by separate 'T's, each distinct time
+ * is a transition of its own and switches only the switches of the
+ * timer with that time (see minuteOf()).
+ *
+ * EEPROM, TIMER_RULE_SLOTS records of TIMER_RULE_SIZE bytes from the
+ * address given to the constructor:
+ * Byte 0:   Timer id, 255 if the slot is free
+ * Byte 1:   Weekdays, bit 0 Sunday to bit 6 Saturday. Bit 7: run once
+ * Byte 2-3: First month and day, month 0 for no date range
+ * Byte 4-5: Last month and day, may be before the first (over new year)
+ *
+ * Timer hours 24-27 follow the sun instead of the clock, the minute is
+ * then an offset of 0-63 minutes:
+ * 24: minutes before sunrise   25: minutes after sunrise
+ * 26: minutes before sunset    27: minutes after sunset
+ * Sun times are given with setSunTimes() once a day. A timer with a sun
+ * time is left out on days without one (polar night, midnight sun).
+ */
+#define TIMER_RULE_SLOTS 16
+#define TIMER_RULE_SIZE 6
+#define TIMER_RULE_AREA_SIZE (TIMER_RULE_SLOTS * TIMER_RULE_SIZE)
+#define TIMER_EVERY_DAY 0x7F
+#define TIMER_ONCE 0x80
+
+#define TIMER_BEFORE_SUNRISE 24
+#define TIMER_AFTER_SUNRISE 25
+#define TIMER_BEFORE_SUNSET 26
+#define TIMER_AFTER_SUNSET 27
+#define TIMER_NO_TIME 0xFFFF // Sun time of a day without sunrise or sunset
+
+typedef struct {
+  byte timerid;
+  byte days;       // Weekday mask, TIMER_ONCE
+  byte fromMonth;  // 0: no date range
+  byte fromDay;
+  byte toMonth;
+  byte toDay;
+} TimerRule;
+
+typedef struct {
+  unsigned int minute; // Minute of day, bit 15 on, bit 14 last of a one-shot timer
+  byte timerid;
+} Transition;
+
+#define TRANSITION_ON 0x8000
+#define TRANSITION_EXPIRES 0x4000
+#define TRANSITION_MINUTE 0x07FF
+
+#define SCHEDULE_RAM_PER_SWITCH (2 * sizeof(Transition)) // Its on and off transitions
+
+class TimerSchedule {
+ public:
+
+  TimerSchedule(unsigned int eepromAddr);
+  boolean begin(unsigned int switches); // Table for a cache of that many, false if out of RAM
+
+  boolean setRule(const TimerRule& rule);
+  boolean removeRule(byte timerid);
+  boolean loadRule(byte timerid, TimerRule& rule); // False if the timer has no rule
+  void invalidate(); // Timers or rules changed, compile again
+  void setSunTimes(unsigned int sunrise, unsigned int sunset); // Local minute of day or TIMER_NO_TIME
+  boolean next(AVL_tree* tree, byte wday, byte month, byte day, unsigned int minute, Transition& due);
+  unsigned int size(){return mCount;}
+  unsigned int minuteOf(byte hour, byte minute); // Today's minute of a timer time, TIMER_NO_TIME if none
+  // A clock time, or a sun hour code with an offset that fits 6 bits
+  static boolean validTime(byte hour, byte minute){
+    return hour < 24 ? minute < 60 : hour <= TIMER_AFTER_SUNSET && minute < 64;
+  }
+
+ private:
+  void compile(AVL_tree* tree, byte wday, byte month, byte day);
+  void compileNode(Node node, byte wday, byte month, byte day);
+  void add(unsigned int minute, byte timerid);
+  unsigned int sortKey(const Transition& t);
+  boolean runsOn(const TimerRule& rule, byte wday, byte month, byte day);
+  int find(byte timerid);
+  unsigned int slotAddr(byte slot);
+
+  const unsigned int mEepromAddr;
+  Transition* mTable;
+  unsigned int mSize;   // Transitions mTable has room for
+  unsigned int mCount;
+  unsigned int mCursor; // Next transition to run
+  byte mDay;        // Day of month compiled for, 0 if not compiled
+  boolean mChanged; // Compile before the next check
+  int mLastMinute;  // Minute checked last, -1 before midnight
+  unsigned int mSunrise;
+  unsigned int mSunset;
+};
+
+#endif
@@ -21,325 +21,990 @@
 *
 *
 * EEPROM
-* Address 0:
-* First address is for storing how many switch_cache there is
-* Address 1-400:
-* Max 200 switch_cache, each switch require two bytes 
+* Address 0-2:
+* Layout marker and how many switch_cache there is
+* From address 3:
+* switch_cache sorted by id, 10 bytes each, then a CRC (see AVL_tree.h)
+* TIMER_RULE_AREA_SIZE bytes before the scenes:
+* Weekday, date and one-shot rules of timers (see TimerSchedule.h)
+* SCENE_AREA_SIZE bytes before the DHCP lease:
+* Scenes (see SceneStore.h)
+* Last DHCP_LEASE_SIZE bytes:
+* Last leased IP, gateway, DNS and subnet (see DHCPLease.h)
 */
 
 #include <SPI.h>
 #include <Ethernet.h>
 #include <EEPROM.h>
 #include <RCTransmit.h>
+#include <RCReceive.h>
 #include <NTPRealTime.h>
 #include <AVL_tree.h>
+#include <DHCPLease.h>
+#include <CoopScheduler.h>
+#include <PerfStats.h>
+#include <EventLog.h>
+#include <MemStats.h>
+#include <ChangeNotify.h>
+#include <Federation.h>
+#include <Snapshot.h>
+#include <SceneStore.h>
+#include <TimerSchedule.h>
+#include <SolarTime.h>
 
 #define transmitPin 10
+#define receivePin 2  // Needs an external interrupt
+#define LEARN_WINDOW 30000 // ms 'L' listens for a remote
 
 /*
- * CACHE_SIZE can't be more than 550. If it is the cache 
- * won't fit in the EEPROM.
+ * The switch cache is sized at boot by AVL_tree::Capacity(), from the
+ * EEPROM below the timer rules and the free RAM less TREE_RAM_RESERVE
+ * (stack and the rest of the sketch, see 'M'). Each switch takes
+ * TREE_NODE_RAM and the SCHEDULE_RAM_PER_SWITCH of its timer. SwitchCache fails to
+ * compile unless MIN_SWITCHES fit in the EEPROM: 73 fit on an Uno, 381
+ * on a Mega.
+ */
+#define MIN_SWITCHES 40
+#define TREE_RAM_RESERVE 384
+
+/*
+ * RAM budget on an Uno (2048 bytes), static tables, about:
+ *   Core, Serial and Ethernet      250
+ *   CoopScheduler                  214
+ *   RCTransmit (2 fades)           225
+ *   TimerSchedule                   20
+ *   ChangeNotify                   100
+ *   DHCPLease                       80
+ *   Request line                    80
+ *   RCReceive                       70
+ *   EventLog                        68
+ *   NTPRealTime                     50
+ *   PerfStats                       84
+ *   The rest of the sketch          90
+ * That is about 1335, which leaves TREE_RAM_RESERVE and some 12 switches
+ * (TREE_NODE_RAM and SCHEDULE_RAM_PER_SWITCH each). Federation (265)
+ * does not fit and is left out of an Uno build, see Federation.h.
+ * 'make ramcheck' fails when the statics outgrow RAM_BUDGET.
  */
-#define CACHE_SIZE 40
 #define TIMER_CHECK_INTERVAL 30 // Seconds
-#define DHCP_RENEW_INTERVAL 60 // Seconds
+#define LATITUDE 59.33  // Degrees north, for timers following the sun
+#define LONGITUDE 18.07 // Degrees east
+#define DHCP_LEASE_ADDR (E2END + 1 - DHCP_LEASE_SIZE)
+#define SCENE_ADDR (DHCP_LEASE_ADDR - SCENE_AREA_SIZE)
+#define TIMER_RULE_ADDR (SCENE_ADDR - TIMER_RULE_AREA_SIZE)
+// Where scenes and timer rules were with 8 bit switch ids
+#define V1_SCENE_ADDR (DHCP_LEASE_ADDR - SCENE_V1_AREA_SIZE)
+#define V1_TIMER_RULE_ADDR (V1_SCENE_ADDR - TIMER_RULE_AREA_SIZE)
 #define EMPTY 255
+#define REQUEST_SIZE 80
+#define REQUEST_TIMEOUT 2000 // ms to wait for a whole request line
 
 byte mac[] = {  
   0x00, 0x26, 0x77, 0xA4, 0xF7, 0x4C };
 // IPAddress ip(192, 168, 1, 151);
 const unsigned int localPort = 8888;
+const unsigned int ntpPort = 8123; // UDP 8888 is for change notifications
 EthernetServer server(localPort);
+DHCPLease dhcp(mac, DHCP_LEASE_ADDR);
 
 AVL_tree* tree;
 RCTransmit transmit = RCTransmit(transmitPin);
+RCReceive receiver = RCReceive(receivePin);
 NTPRealTime ntp = NTPRealTime();
 IPAddress timeServer(132, 163, 4, 101);
+CoopScheduler scheduler;
+ChangeNotify notify;
+Federation federation; // Other units of the site, on the notify socket
+SceneStore scenes(SCENE_ADDR);
+TimerSchedule schedule(TIMER_RULE_ADDR);
+Snapshot snapshot(TIMER_RULE_ADDR); // 'X' and 'Y'
+SolarTime sun(LATITUDE, LONGITUDE);
+byte lastSceneMinute = 255; // Minute scenes were last triggered in, they run once per minute
+RCCommand learned;          // Code heard by 'L'
+boolean haveLearned = false;
+boolean learning = false;
+unsigned long learnStart;
+
+// Response tokens, kept in flash
+const char RESPONSE_OK[] PROGMEM = "OK";
+const char RESPONSE_NOK[] PROGMEM = "NOK";
+const char RESPONSE_UNKNOWN[] PROGMEM = "NO SUCH COMMAND EXIST";
 
-unsigned long lastTimerCheck; // Seconds
-unsigned long lastDHCPRenew; // Seconds
+// Client being served, its request line is read over several slices
+EthernetClient activeClient;
+char request[REQUEST_SIZE];
+byte requestLength;
+unsigned long requestStart;
+boolean forwarded = false; // Its reply waits for other units to ack, see Federation.h
 
-void readRequest(EthernetClient* client, char* request);
+boolean readRequest(EthernetClient* client, char* request, byte& length);
 void executeRequest(EthernetClient* client, char* request);
-void sendResponse(EthernetClient* client, String response);
+void sendResponse(EthernetClient* client, const char* response);
+void sendSchedulerStats(EthernetClient* client);
 boolean setTimer(char* request);
-void checkTimers(TreeNode*& node);
-boolean timeToCheckTimers();
-boolean maintainDHCP();
+boolean setTimerRule(char* request);
+boolean setScene(char* request);
+boolean triggerScene(const Scene& scene);
+boolean queueSwitch(data id, boolean on, byte protocol);
+boolean setSwitch(data id, boolean on);
+boolean applyTimer(byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute, data* ids);
+data toId(const char* token);
+void upgradeEEPROM();
+void checkScenes();
+void runTimer(Node node, const Transition& firing);
+void handleReceived(const RCCommand& command);
+data freeId(unsigned long preferred);
+unsigned int localMinute(unsigned int utcMinute);
+void maintainDHCP();
+boolean runSlice();
+
+// Scheduler tasks
+void networkTask();
+void timerTask();
+void ntpTask();
+void rfTask();
+void eepromTask();
+void logTask();
+void notifyTask();
+bool rfReady();
+bool eepromReady();
+bool logReady();
+void recordChange(data id);
+void federationDatagram(EthernetUDP& udp);
+unsigned int ipTail(IPAddress ip);
 
 void setup()
 {
   // EEPROM.write(0, 0);
-  Serial.println(F("Setup initialized!"));
    // Setup serial for debug
   Serial.begin(9600);
-  // Setup ethernet and server
-  // Ethernet.begin(mac,ip) ;
-  while( Ethernet.begin(mac) != 1 ){
-    delay(5000);
-  }
+  LOG_INFO(EV_SETUP_START, 0);
+  // Setup ethernet and server on the cached lease, DHCP runs from loop()
+  dhcp.begin();
   server.begin();
-  Serial.print(F("Server address:"));
-  Serial.println(Ethernet.localIP());
+  LOG_INFO(EV_SERVER_ADDRESS, ipTail(Ethernet.localIP()));
 
   // Setup RCtransmit
   transmit.setRepeatTransmit(5);
+  receiver.begin();
   // Setup NTP RealTime
-  ntp.init(timeServer, localPort);
+  ntp.init(timeServer, ntpPort);
   ntp.setSyncInterval(300);
   ntp.summertime(true);
   // Load avl-cache...
-  tree = new AVL_tree(CACHE_SIZE);
-  Serial.println(F("Cache initialized!"));
-  Serial.println(F("Setup finished!"));
+  tree = new SwitchCache<TIMER_RULE_ADDR, MIN_SWITCHES>(MemStats::freeRam(), TREE_RAM_RESERVE, SCHEDULE_RAM_PER_SWITCH);
+  if(!schedule.begin(tree->MaxSize()))
+    LOG_ERROR(EV_SCHEDULE_FULL, 255);
+  if(tree->Upgraded())
+    upgradeEEPROM();
+  LOG_INFO(EV_CACHE_LOADED, tree->Size());
+  tree->OnChange(recordChange);
+  notify.begin(tree);
+  notify.onDatagram(federationDatagram);
+  federation.begin(tree, notify.udp(), setSwitch, applyTimer);
+  // Tasks, in the order reported by 'P'. A task more than MAX_TASKS doesn't compile
+  const struct {
+    TaskFunction func;
+    unsigned long period;
+    unsigned long deadline;
+    ReadyFunction ready;
+  } tasks[] = {
+    { networkTask, 5, 5, NULL },
+    { timerTask, TIMER_CHECK_INTERVAL * 1000UL, 1000, NULL },
+    { ntpTask, 100, 500, NULL },
+    { maintainDHCP, 1000, 1000, NULL },
+    { rfTask, 0, 0, rfReady },
+    { eepromTask, 0, 0, eepromReady },
+    { logTask, 0, 0, logReady },
+    { notifyTask, 100, 500, NULL },
+  };
+  static_assert(sizeof(tasks) / sizeof(tasks[0]) <= MAX_TASKS, "More tasks than MAX_TASKS");
+  for(byte i = 0; i < sizeof(tasks) / sizeof(tasks[0]); ++i)
+    scheduler.add(tasks[i].func, tasks[i].period, tasks[i].deadline, tasks[i].ready);
+  LOG_INFO(EV_SETUP_DONE, 0);
 }
 
+/*
+ * One scheduler slice. With nothing due or ready the MCU sleeps until
+ * the next periodic task (network every 5 ms) or an interrupt (RF pulse,
+ * UART) gives a background task work, instead of spinning.
+ */
 void loop()
 {
-  EthernetClient client = server.available();
-  
-  // Check if any timers are go
-  if(timeToCheckTimers())
-    tree->ForEach(checkTimers);
+  if(!runSlice())
+    scheduler.idle();
+}
 
-  // Renew DHCP lease
-  maintainDHCP();
+boolean runSlice()
+{
+  PERF_PROBE(PERF_LOOP);
+  return scheduler.run();
+}
 
-  // Check if any requests
-  if(!client)
+/*
+ * Accept a client and serve it once its request line is complete. After
+ * 'Y' the snapshot image that follows the line is restored over as many
+ * slices as it takes.
+ */
+void networkTask()
+{
+  if(!activeClient)
   {
-    delay(100);
-    return ;
+    activeClient = server.available();
+    if(!activeClient)
+      return;
+    LOG_DEBUG(EV_CLIENT_CONNECTED, 0);
+    requestLength = 0;
+    requestStart = millis();
   }
-  
-  Serial.println(F("Client connected!"));
-  // Handle client
-  char request[80];
-  readRequest(&client, request);
-  executeRequest(&client, request);
+
+  if(forwarded){
+    if(federation.waiting() && activeClient.connected())
+      return; // Acks are read by notifyTask
+    forwarded = false;
+    sendResponse(&activeClient, federation.refused() ? RESPONSE_NOK : RESPONSE_OK);
+  }
+  else if(snapshot.active()){
+    byte state = snapshot.read(activeClient);
+    if(state == SNAPSHOT_MORE)
+      return;
+    if(state == SNAPSHOT_DONE){
+      schedule.invalidate();
+      notify.reset();
+    }
+    sendResponse(&activeClient, state == SNAPSHOT_DONE ? RESPONSE_OK : RESPONSE_NOK);
+  }
+  else if(readRequest(&activeClient, request, requestLength)){
+    federation.await();
+    executeRequest(&activeClient, request);
+    if(snapshot.active())
+      return; // 'Y', the image follows
+    if(forwarded)
+      return; // 'S' or 'T' for other units, answered once they ack
+  }
+  else if(activeClient.connected() && millis() - requestStart < REQUEST_TIMEOUT)
+    return; // Rest of the line comes in a later slice
 
   // Close connection
-  client.stop();
-  Serial.println(F("Client disconnected!"));
+  activeClient.stop();
+  LOG_DEBUG(EV_CLIENT_DISCONNECTED, 0);
 }
 
-// Read request line
-void readRequest(EthernetClient* client, char* request)
+// Check if any timers are go
+void timerTask()
 {
-  //String request = "";
-  //char request[80];
-  int i = 0;
-  //Loop while the client is connected
-  while(client->connected())
-  {
-    // Read available bytes
-     while(client->available())
-    {
-       // Read byte
-       char c = client->read();
-       
-       //Serial.write(c);
-       
-       // Exit if end of line
-       if('\n' == c || '\0' == c)
-       {
-         request[i] = '\0';
-         //char* d = request;
-         //return &request[0]; 
-	 return;
-       }
-       
-       // Add byte to request line
-       request[i] = c;
-       ++i;
-    } 
+  if(!ntp.isSynced())
+    return;
+  const tmElements_t& date = ntp.getDate();
+  LOG_DEBUG(EV_TIME, date.Hour * 100 + date.Minute);
+  PERF_PROBE(PERF_CHECK_TIMERS);
+  // Sun times change with the date, local ones also with summer time
+  sun.update(1970 + date.Year, date.Month, date.Day);
+  schedule.setSunTimes(localMinute(sun.sunrise()), localMinute(sun.sunset()));
+  Transition firing;
+  while(schedule.next(tree, date.Wday, date.Month, date.Day, date.Hour * 60 + date.Minute, firing)){
+    tree->ForEach([&](Node& node){ runTimer(node, firing); });
+    if(firing.minute & TRANSITION_EXPIRES){
+      // One-shot timer has run, today's table can stay as it is
+      tree->RemoveTimer(firing.timerid);
+      schedule.removeRule(firing.timerid);
+      LOG_INFO(EV_TIMER_EXPIRED, firing.timerid);
+    }
   }
+  checkScenes();
+}
+
+// UTC minute of day from SolarTime as local minute of day
+unsigned int localMinute(unsigned int utcMinute)
+{
+  if(utcMinute == SOLAR_NONE)
+    return TIMER_NO_TIME;
+  return (utcMinute + ntp.utcOffset() + 1440) % 1440;
+}
+
+void ntpTask()
+{
+  ntp.poll();
+}
+
+// Send one RF frame, when there is something queued, and decode what was received
+void rfTask()
+{
+  receiver.mute(true);
+  transmit.poll();
+  receiver.mute(false);
+  receiver.poll();
+  RCCommand command;
+  while(receiver.read(command)){
+    if(transmit.pending())
+      continue; // Our own frames
+    handleReceived(command);
+  }
+}
+
+bool rfReady()
+{
+  return transmit.busy() || receiver.pending();
+}
+
+// Write one changed node to EEPROM
+void eepromTask()
+{
+  tree->FlushEEPROM();
+}
+
+bool eepromReady()
+{
+  return tree->IsDirty() && !snapshot.active(); // A restore is writing the EEPROM
+}
+
+// Move buffered log records to the UART, as far as it takes them
+void logTask()
+{
+  EventLog::drain(Serial);
+}
+
+bool logReady()
+{
+  return EventLog::pending();
+}
+
+// Push changes to subscribed apps
+void notifyTask()
+{
+  notify.poll();
+  federation.poll();
+}
+
+void recordChange(data id)
+{
+  notify.record(id);
+}
+
+void federationDatagram(EthernetUDP& udp)
+{
+  federation.receive(udp);
+}
+
+/*
+ * The scenes and timer rules moved down when scenes got 16 bit switch
+ * ids. Both move the same distance, the rules first so the scenes can
+ * take their place. The move is not repeatable, so the switches are
+ * rewritten in the new layout right after it instead of in the
+ * background: the format byte, written last, tells the next boot it is
+ * done. All of them, also those that don't fit in RAM.
+ */
+void upgradeEEPROM()
+{
+  for(unsigned int i = 0; i < TIMER_RULE_AREA_SIZE; ++i)
+    EEPROM.write(TIMER_RULE_ADDR + i, EEPROM.read(V1_TIMER_RULE_ADDR + i));
+  scenes.upgrade(V1_SCENE_ADDR);
+  tree->ConvertEEPROM();
+  LOG_INFO(EV_EEPROM_MOVED, 0);
+}
+
+// Switch id of token, 0 if there is none
+data toId(const char* token)
+{
+  unsigned long id = token ? strtoul(token, NULL, 10) : 0;
+  return id <= TREE_MAX_ID ? id : 0;
+}
+
+/*
+ * Queue on or off for a switch, to its RF address if it has one,
+ * otherwise to its id as group code with the given protocol.
+ */
+boolean queueSwitch(data id, boolean on, byte protocol)
+{
+  Node node = tree->Find(id);
+  unsigned long address = node ? node->address : 0;
+  if(address == 0)
+    address = RC_ADDRESS(id, protocol == 2 ? RC_P2_DEVICE : 0, protocol);
+  return transmit.queue(RC_ADDRESS_GROUP(address), RC_ADDRESS_PROTOCOL(address), on,
+			false, RC_ADDRESS_DEVICE(address));
+}
+
+// Switch id as 'S' does, also for commands forwarded by another unit
+boolean setSwitch(data id, boolean on)
+{
+  if(!queueSwitch(id, on, 2))
+    return false;
+  tree->SetStatus(id, on ? 1 : 0);
+  return true;
+}
+
+// Enough of an address to tell units apart in the log
+unsigned int ipTail(IPAddress ip)
+{
+  return (ip[2] << 8) | ip[3];
+}
+
+/*
+ * Read what has arrived of the request line. Returns true when the line
+ * is complete, length keeps the position between calls. Characters that
+ * don't fit in REQUEST_SIZE are dropped.
+ */
+boolean readRequest(EthernetClient* client, char* request, byte& length)
+{
+  PERF_PROBE(PERF_READ_REQUEST);
+  // Read available bytes
+  while(client->available())
+    {
+      // Read byte
+      char c = client->read();
+
+      // Exit if end of line
+      if('\n' == c || '\0' == c)
+	{
+	  request[length] = '\0';
+	  return true;
+	}
+
+      // Add byte to request line
+      if(length < REQUEST_SIZE - 1)
+	request[length++] = c;
+    }
+  return false;
 }
 
 void executeRequest(EthernetClient* client, char* request)
 {
+  PERF_PROBE(PERF_EXECUTE_REQUEST);
   char* command  = strtok_r(request, ":", &request);
-  Serial.println(F("######### Serving client ############"));
-  Serial.print(F("Command: "));
-  Serial.println(command[0]);
+  LOG_INFO(EV_COMMAND, command[0]);
   switch(command[0])
     {
     case 'S': //Switch on/off
       {
 	// Get controller code
-	byte controller = 0;
-	byte on = 0;
-	controller = byte(atoi(strtok_r(request, ":", &request)));
-	on = atoi(strtok_r(request, ":", &request));
-	if(on == 1){
-	  transmit.switchOn(controller, 2, 0, 0);
-	  tree->SetStatus(controller, 1);
+	data controller = toId(strtok_r(request, ":", &request));
+	char* token = strtok_r(request, ":", &request);
+	if(controller == 0 || !token){
+	  sendResponse(client, RESPONSE_NOK);
+	  break;
 	}
-	else{
-	  transmit.switchOff(controller, 2, 0, 0);
-	  tree->SetStatus(controller, 0);
+	byte on = atoi(token);
+	if(federation.owner(controller) != FED_NONE){
+	  // Another unit's switch
+	  if(federation.forwardSwitch(controller, on == 1))
+	    forwarded = true;
+	  else
+	    sendResponse(client, RESPONSE_NOK);
+	  break;
 	}
-	sendResponse(client, "OK");
+	sendResponse(client, setSwitch(controller, on == 1) ? RESPONSE_OK : RESPONSE_NOK);
 	break;
       }
-    case 'G': // Send all saved nodes
+    case 'G': // Send all saved nodes and those of other units, or with G:<gen> only local ones changed since, see AVL_tree::SendChanges
+              // G:B local on/off as a bitmap, see AVL_tree::SendStatusBits
       {
-        tree->SendNodes(client);
+	char* token = strtok_r(request, ":", &request);
+	if(token && token[0] == 'B'){
+	  tree->SendStatusBits(*client);
+	}
+	else if(token){
+	  tree->SendChanges(strtoul(token, NULL, 10), client);
+	  client->println();
+	}
+	else{
+	  if(!tree->IsEmpty() || !federation.remoteSwitches())
+	    tree->SendNodes(client);
+	  federation.sendSwitches(*client);
+	}
 	break;
       } 
     case 'A': // Add switch
       {
-	byte id = byte(atoi(strtok_r(request, ":", &request)));
-	if( id > 0 && id < 255 && tree->Insert(id))
+	data id = toId(strtok_r(request, ":", &request));
+	if( id > 0 && tree->Insert(id))
 	  {
-	    sendResponse(client, "OK");
+	    sendResponse(client, RESPONSE_OK);
 	  }
 	else
 	  {
-	    sendResponse(client, "NOK");
+	    sendResponse(client, RESPONSE_NOK);
 	  }
 	break;
       } 
     case 'R': // Remove switch states
       {
-	byte id = byte(atoi(strtok_r(request, ":", &request)));
-	if( id > 0 && id < 255 && tree->Remove(id) )
+	data id = toId(strtok_r(request, ":", &request));
+	if( id > 0 && tree->Remove(id) )
 	  {
-	    sendResponse(client, "OK");
+	    schedule.invalidate();
+	    sendResponse(client, RESPONSE_OK);
 	  }
 	else
 	  {
-	    sendResponse(client, "NOK");
+	    sendResponse(client, RESPONSE_NOK);
 	  }
 	break;
       } 
       case 'C': // Check connectivity
       {
-         sendResponse(client, "OK");
+         sendResponse(client, RESPONSE_OK);
          break;
       }
       case 'T': // Set/Add Timer => timerid:onHour:onMinute:offHour:offMinute:switchidN:switchidK:....:switchidZ:
+                // Hours 24-27 are minutes before/after sunrise/sunset (see TimerSchedule.h)
       {
         if( setTimer(request) ){
-	  sendResponse(client, "OK");
+	  schedule.invalidate();
+	  if(federation.waiting())
+	    forwarded = true; // Some of the switches are other units'
+	  else
+	    sendResponse(client, RESPONSE_OK);
 	}else{
-	  sendResponse(client, "NOK");
+	  sendResponse(client, RESPONSE_NOK);
 	}
 	break;
       }
       case 'Q': // Remove Timer => timerid
       {
-	byte timerid = atoi(strtok_r(request, ":", &request));
+	char* token = strtok_r(request, ":", &request);
+	if(!token){
+	  sendResponse(client, RESPONSE_NOK);
+	  break;
+	}
+	byte timerid = atoi(token);
         tree->RemoveTimer(timerid);
-	sendResponse(client, "OK");
+	schedule.removeRule(timerid);
+	schedule.invalidate();
+	sendResponse(client, RESPONSE_OK);
+	break;
+      }
+      case 'W': // Timer days => timerid:weekdays:fromMonth:fromDay:toMonth:toDay, weekdays bit 0 Sunday..bit 6 Saturday, +128 run once
+      {
+	if( setTimerRule(request) ){
+	  sendResponse(client, RESPONSE_OK);
+	}else{
+	  sendResponse(client, RESPONSE_NOK);
+	}
+	break;
+      }
+      case 'D': // Changes since sequence => seq:D N then 'G' records, or seq:F N and all of them, see ChangeNotify.h
+      {
+	char* token = strtok_r(request, ":", &request);
+	unsigned int seq = token ? strtoul(token, NULL, 10) : 0;
+	notify.sendSince(seq, *client);
+	client->println();
+	break;
+      }
+      case 'E': // Set/Add Scene => sceneid:hour:minute:switchidN:onN:....:switchidZ:onZ, hour 255 = no time
+      {
+	if( setScene(request) ){
+	  sendResponse(client, RESPONSE_OK);
+	}else{
+	  sendResponse(client, RESPONSE_NOK);
+	}
+	break;
+      }
+      case 'F': // Trigger Scene => sceneid
+      {
+	Scene scene;
+	char* token = strtok_r(request, ":", &request);
+	byte id = token ? byte(atoi(token)) : 0;
+	if( scenes.load(id, scene) && triggerScene(scene) ){
+	  if(federation.waiting())
+	    forwarded = true; // Some of the switches are other units'
+	  else
+	    sendResponse(client, RESPONSE_OK);
+	}else{
+	  sendResponse(client, RESPONSE_NOK);
+	}
+	break;
+      }
+      case 'K': // Remove Scene => sceneid
+      {
+	char* token = strtok_r(request, ":", &request);
+	byte id = token ? byte(atoi(token)) : 0;
+	if( scenes.remove(id) ){
+	  sendResponse(client, RESPONSE_OK);
+	}else{
+	  sendResponse(client, RESPONSE_NOK);
+	}
+	break;
+      }
+      case 'P': // Scheduler stats => runs:overruns:maxMicros:maxLateMs per task, then maxSliceMicros:idleMs:dhcpBound
+      {
+	sendSchedulerStats(client);
+	break;
+      }
+      case 'M': // Memory => freeRam:stackHighWater:largestFreeBlock:fragmentation, then allocs:frees per subsystem, then switches:capacity
+      {
+	MemStats::print(*client);
+	client->print(tree->Size());
+	client->print(':');
+	client->print(tree->MaxSize());
+	client->println('N');
+	break;
+      }
+      case 'B': // RF address => id:group:device:protocol, group 0 to send to the id again; id alone replies group:device:protocol
+      {
+	data id = toId(strtok_r(request, ":", &request));
+	Node node = tree->Find(id);
+	char* token = strtok_r(request, ":", &request);
+	if(node && !token){
+	  client->print(RC_ADDRESS_GROUP(node->address));
+	  client->print(':');
+	  client->print(RC_ADDRESS_DEVICE(node->address));
+	  client->print(':');
+	  client->println(RC_ADDRESS_PROTOCOL(node->address));
+	  break;
+	}
+	unsigned long group = token ? strtoul(token, NULL, 10) : 0;
+	token = strtok_r(request, ":", &request);
+	int device = token ? atoi(token) : -1;
+	token = strtok_r(request, ":", &request);
+	int protocol = token ? atoi(token) : 0;
+	if(group == 0){
+	  device = 0;
+	  protocol = 0;
+	}
+	else if(group > RC_ADDRESS_GROUP(0xFFFFFFFFUL) || device < 0 || device > 15 || protocol < 1 || protocol > 2){
+	  node = NULL;
+	}
+	if(node && tree->SetAddress(id, RC_ADDRESS(group, device, protocol))){
+	  sendResponse(client, RESPONSE_OK);
+	}else{
+	  sendResponse(client, RESPONSE_NOK);
+	}
+	break;
+      }
+      case 'O': // RF queue => queued:merged:dropped:pending, see RCTransmit.h
+      {
+	client->print(transmit.queued());
+	client->print(':');
+	client->print(transmit.merged());
+	client->print(':');
+	client->print(transmit.dropped());
+	client->print(':');
+	client->println(transmit.pending());
+	break;
+      }
+      case 'V': // Dim => id:level[:seconds], level 0-15 faded to over seconds, protocol 2 dimmers only; id alone replies the level
+      {
+	data id = toId(strtok_r(request, ":", &request));
+	Node node = tree->Find(id);
+	char* token = strtok_r(request, ":", &request);
+	if(node && !token){
+	  client->println(node->level);
+	  break;
+	}
+	int level = token ? atoi(token) : -1;
+	token = strtok_r(request, ":", &request);
+	unsigned long seconds = token ? strtoul(token, NULL, 10) : 0;
+	unsigned long address = node && node->address ? node->address : RC_ADDRESS(id, RC_P2_DEVICE, 2);
+	if(node == NULL || level < 0 || level >= RC_DIM_LEVELS || seconds > 3600 || RC_ADDRESS_PROTOCOL(address) != 2){
+	  sendResponse(client, RESPONSE_NOK);
+	  break;
+	}
+	boolean queued;
+	if(seconds)
+	  queued = transmit.fade(RC_ADDRESS_GROUP(address), node->status ? node->level : 0, level, seconds * 1000,
+				 RC_ADDRESS_DEVICE(address));
+	else
+	  queued = transmit.queueDim(RC_ADDRESS_GROUP(address), level, RC_ADDRESS_DEVICE(address));
+	if(!queued){
+	  sendResponse(client, RESPONSE_NOK);
+	  break;
+	}
+	LOG_INFO(EV_DIM, id);
+	tree->SetLevel(id, level);
+	sendResponse(client, RESPONSE_OK);
+	break;
+      }
+      case 'L': // Learn => code heard since the last 'L' as controller:protocol:group:status:device, or -1, then listen LEARN_WINDOW ms for the next
+      {
+	if(haveLearned){
+	  client->print(learned.controller);
+	  client->print(':');
+	  client->print(learned.protocol);
+	  client->print(':');
+	  client->print(learned.group ? 1 : 0);
+	  client->print(':');
+	  client->print(learned.status ? 1 : 0);
+	  client->print(':');
+	  client->println(learned.device);
+	}
+	else{
+	  client->println(F("-1"));
+	}
+	haveLearned = false;
+	learning = true;
+	learnStart = millis();
+	break;
+      }
+      case 'X': // Export => binary image of the switches and timer rules, see Snapshot.h
+      {
+	if(tree->Unloaded())
+	  sendResponse(client, RESPONSE_NOK); // Not all switches are in RAM
+	else
+	  snapshot.send(tree, *client);
+	break;
+      }
+      case 'Y': // Import => the 'X' image follows the line, replies OK once it is restored
+      {
+	if(!snapshot.begin(tree))
+	  sendResponse(client, RESPONSE_NOK);
+	break;
+      }
+      case 'I': // Operation timing => count:max:b0,...,b7 per probe, see PerfStats.h
+      {
+	PerfStats::print(*client);
+	client->println();
+	PerfStats::reset();
 	break;
       }
     default:
       {
-	sendResponse(client, "NO SUCH COMMAND EXIST");
+	LOG_WARN(EV_UNKNOWN_COMMAND, command[0]);
+	sendResponse(client, RESPONSE_UNKNOWN);
 	break;
       }
     }
 }
 
-void sendResponse(EthernetClient* client, String response)
+// response is one of the RESPONSE_ tokens in flash
+void sendResponse(EthernetClient* client, const char* response)
 {
 	// Send response to client.
-	client->println(response);
-	// Debug print.
-	Serial.print(F("sendResponse: "));
-	Serial.println(response);
+	client->println((const __FlashStringHelper*)response);
+	LOG_DEBUG(response == RESPONSE_OK ? EV_RESPONSE_OK : EV_RESPONSE_NOK, 0);
+}
+
+// One runs:overruns:maxMicros:maxLateMs block per task and one for all of them, then reset
+void sendSchedulerStats(EthernetClient* client)
+{
+  for(byte i = 0; i < scheduler.count(); ++i){
+    const Task& task = scheduler.task(i);
+    client->print(task.runs);
+    client->print(':');
+    client->print(task.overruns);
+    client->print(':');
+    client->print(task.maxMicros);
+    client->print(':');
+    client->print(task.maxLate);
+    client->print('N');
+  }
+  // How long a slice may take, see RCReceive.h
+  client->print(scheduler.maxSlice());
+  client->print(':');
+  client->print(scheduler.idleMillis());
+  client->print(':');
+  client->print(dhcp.isBound() ? 1 : 0);
+  client->println('N');
+  scheduler.resetStats();
 }
 
 // Set Timer => timerid:onHour:onMinute:offHour:offMinute:switchidN:switchidK:....:switchidZ:
 boolean setTimer(char* request){
-  //byte(atoi());
-  byte timerid = atoi(strtok_r(request, ":", &request));
-  byte onHour = atoi(strtok_r(request, ":", &request));
-  byte onMinute = atoi(strtok_r(request, ":", &request));
-  byte offHour = atoi(strtok_r(request, ":", &request));
-  byte offMinute = atoi(strtok_r(request, ":", &request));
-  Serial.print(F("Adding timer with id: "));
-  Serial.print(timerid);
-  Serial.print(F(" onHour: "));
-  Serial.print(onHour);
-  Serial.print(F(" onMinute: "));
-  Serial.print(onMinute);
-  Serial.print(F(" offHour: "));
-  Serial.print(offHour);
-  Serial.print(F(" offMinute: "));
-  Serial.println(offMinute);
-  byte switchids[tree->Size()+1];
+  byte fields[5]; // timerid, onHour, onMinute, offHour, offMinute
+  char* token;
+  for(byte i = 0; i < 5; ++i){
+    token = strtok_r(request, ":", &request);
+    if(!token)
+      return false;
+    fields[i] = byte(atoi(token));
+  }
+  byte timerid = fields[0];
+  byte onHour = fields[1];
+  byte onMinute = fields[2];
+  byte offHour = fields[3];
+  byte offMinute = fields[4];
+  if(!TimerSchedule::validTime(onHour, onMinute) || !TimerSchedule::validTime(offHour, offMinute))
+    return false;
+  LOG_INFO(EV_TIMER_SET, timerid);
+  data switchids[REQUEST_SIZE / 2 + 1]; // Ids and separators fit the request
   byte i = 0;
-  while(request){
-    byte swId = byte(atoi(strtok_r(request, ":", &request)));
-    if(swId >= 10 && swId <= 250){
+  while(i < REQUEST_SIZE / 2 && (token = strtok_r(request, ":", &request))){
+    data swId = toId(token);
+    if(swId >= 10){
       switchids[i++] = swId;
-      Serial.print("Switch: ");
-      Serial.println(switchids[i-1]);
+      LOG_DEBUG(EV_TIMER_SWITCH, swId);
     }
   }
   switchids[i] = 0; // Mark end
-  byte * p = switchids;
-  tree->SetTimer(p, timerid, onHour, onMinute, offHour, offMinute);
-  return true;
+  if(!federation.forwardTimer(switchids, timerid, onHour, onMinute, offHour, offMinute))
+    return false;
+  return applyTimer(timerid, onHour, onMinute, offHour, offMinute, switchids);
 }
 
-boolean timeToCheckTimers()
+// Timer times for ids (ending with 0), from 'T' or forwarded by another unit
+boolean applyTimer(byte timerid, byte onHour, byte onMinute, byte offHour, byte offMinute, data* ids)
 {
-  if(!((millis()/1000)-lastTimerCheck >= TIMER_CHECK_INTERVAL))
+  if(!TimerSchedule::validTime(onHour, onMinute) || !TimerSchedule::validTime(offHour, offMinute))
     return false;
+  tree->SetTimer(ids, timerid, onHour, onMinute, offHour, offMinute);
+  schedule.invalidate();
+  return true;
+}
+
+// Timer days => timerid:weekdays:fromMonth:fromDay:toMonth:toDay
+boolean setTimerRule(char* request){
+  TimerRule rule;
+  byte* fields = &rule.timerid;
+  for(byte i = 0; i < TIMER_RULE_SIZE; ++i){
+    char* token = strtok_r(request, ":", &request);
+    if(!token)
+      return false;
+    fields[i] = byte(atoi(token));
+  }
+  if(rule.timerid == EMPTY || (rule.days & TIMER_EVERY_DAY) == 0 || rule.fromMonth > 12 || rule.toMonth > 12)
+    return false;
+  if(rule.days == TIMER_EVERY_DAY && rule.fromMonth == 0){
+    // Same as no rule
+    schedule.removeRule(rule.timerid);
+    schedule.invalidate();
+  }else if(!schedule.setRule(rule)){
+    return false;
+  }
+  tree->TimerChanged(rule.timerid);
+  return true;
+}
 
-  Serial.print(F("Time: "));
-  Serial.print(ntp.getHour());
-  Serial.print(F(":"));
-  Serial.println(ntp.getMin());
+// Set Scene => sceneid:hour:minute:switchidN:onN:....:switchidZ:onZ
+boolean setScene(char* request){
+  Scene scene = {};
+  char* token = strtok_r(request, ":", &request);
+  scene.id = token ? byte(atoi(token)) : 0;
+  if(scene.id == 0 || scene.id == 255)
+    return false;
+  token = strtok_r(request, ":", &request);
+  scene.hour = token ? byte(atoi(token)) : SCENE_NO_TIME;
+  token = strtok_r(request, ":", &request);
+  scene.minute = token ? byte(atoi(token)) : 0;
+  if(scene.hour > 23 || scene.minute > 59)
+    scene.hour = SCENE_NO_TIME;
+  scene.count = 0;
+  scene.onMask = 0;
+  while((token = strtok_r(request, ":", &request))){
+    data swId = toId(token);
+    token = strtok_r(request, ":", &request);
+    if(!token || scene.count == SCENE_MAX_SWITCHES || swId < 10)
+      return false;
+    if(atoi(token) == 1)
+      scene.onMask |= 1 << scene.count;
+    scene.switches[scene.count++] = swId;
+  }
+  return scene.count > 0 && scenes.save(scene);
+}
 
-  lastTimerCheck = millis()/1000;
+/*
+ * Queue all RF commands of the scene and update the cache, forwarding
+ * the switches of other units to them, or nothing at all if the RF
+ * queue or the federation outbox can't take the whole scene. The cache
+ * is saved once for the scene.
+ */
+boolean triggerScene(const Scene& scene){
+  byte remote = 0;
+  for(byte i = 0; i < scene.count; ++i)
+    if(federation.owner(scene.switches[i]) != FED_NONE)
+      ++remote;
+  if(transmit.freeSlots() < scene.count - remote || federation.freeSlots() < remote)
+    return false;
+  for(byte i = 0; i < scene.count; ++i){
+    byte on = (scene.onMask >> i) & 1;
+    if(federation.owner(scene.switches[i]) != FED_NONE){
+      federation.forwardSwitch(scene.switches[i], on == 1);
+      continue;
+    }
+    queueSwitch(scene.switches[i], on == 1, 2);
+    tree->SetStatus(scene.switches[i], on);
+  }
+  tree->MarkDirty();
+  LOG_INFO(EV_SCENE_TRIGGERED, scene.id);
   return true;
 }
 
-void checkTimers(TreeNode*& node){
-  Serial.print(F("Checking timer for id: "));
-  Serial.println(node->d);
-  // If not recent
-  if(node->timerid != EMPTY)
+// Trigger scenes set for the current minute
+void checkScenes(){
+  byte minute = ntp.getMin();
+  if(minute == lastSceneMinute)
+    return;
+  lastSceneMinute = minute;
+  Scene scene;
+  for(byte slot = 0; slot < SCENE_SLOTS; ++slot){
+    if(scenes.loadSlot(slot, scene) && scene.hour == ntp.getHour() && scene.minute == minute)
+      triggerScene(scene);
+  }
+}
+
+// Switch node if it belongs to the timer of the firing transition, with that time
+void runTimer(Node node, const Transition& firing){
+  if(node->timerid != firing.timerid)
+    return;
+  unsigned int minute = firing.minute & TRANSITION_ON ? schedule.minuteOf(node->onHour, node->onMinute)
+    : schedule.minuteOf(node->offHour, node->offMinute);
+  if(minute != (firing.minute & TRANSITION_MINUTE))
+    return; // Another time set of the same timer
+  LOG_DEBUG(EV_TIMER_CHECK, node->d);
+  if(firing.minute & TRANSITION_ON)
     {
-      Serial.print(F(" Had timer! Time on: "));
-      Serial.print(node->onHour);
-      Serial.print(F(":"));
-      Serial.print(node->onMinute);
-      Serial.print(F(" Time off: "));
-      Serial.print(node->offHour);
-      Serial.print(F(":"));
-      Serial.print(node->offMinute);
-      Serial.println(F("."));
-      if( int(node->offHour) == int(ntp.getHour()) &&  int(node->offMinute) == int(ntp.getMin()))
-	{
-	  transmit.switchOff(node->d,1, 0, 0);
-	  node->status = false;
-	}
-      else if( int(node->onHour) == int(ntp.getHour()) && int(node->onMinute) == int(ntp.getMin()))
-	{
-	  transmit.switchOn(node->d,1, 0, 0);
-	  node->status = true;
-	}
+      queueSwitch(node->d, true, 1);
+      tree->SetStatus(node->d, 1);
+      LOG_INFO(EV_TIMER_ON, node->d);
+    }
+  else
+    {
+      queueSwitch(node->d, false, 1);
+      tree->SetStatus(node->d, 0);
+      LOG_INFO(EV_TIMER_OFF, node->d);
     }
 }
 
-boolean maintainDHCP(){
-  if((millis()/1000)-lastDHCPRenew >= DHCP_RENEW_INTERVAL){
-    lastDHCPRenew = millis()/1000;
-    int returnCode = Ethernet.maintain();
-    while (!(returnCode == 0 || returnCode == 2)){
-      switch(returnCode) {
-      case 1:   Serial.print(F("\n\rDHCP: Renew failed")); break;
-      case 3:   Serial.print(F("\n\rDHCP: Rebind fail")); break;
-      case 4:   Serial.print(F("\n\rDHCP: Rebind success")); break;
-      }
-      delay(5000);
-      returnCode = Ethernet.maintain();
+/*
+ * A remote or wall switch was used. Known switches, found by RF address
+ * or, for those without one, by the group code as id, get their cached
+ * status updated. While learning, the code is kept for 'L' and a new
+ * one is added as a switch with its address, see freeId().
+ */
+void handleReceived(const RCCommand& command){
+  LOG_INFO(EV_RF_RECEIVED, command.controller);
+  transmit.forget(command.controller, command.device);
+  unsigned long address = RC_ADDRESS(command.controller, command.device, command.protocol);
+  Node node = tree->FindAddress(address);
+  if(node == NULL && command.controller <= TREE_MAX_ID){
+    node = tree->Find(command.controller);
+    if(node && node->address)
+      node = NULL; // Sent to another address
+  }
+  if(learning && millis() - learnStart < LEARN_WINDOW){
+    learned = command;
+    haveLearned = true;
+    learning = false;
+    data id = node ? 0 : freeId(command.controller);
+    if(id && tree->Insert(id) && tree->SetAddress(id, address)){
+      LOG_INFO(EV_RF_LEARNED, id);
+      node = tree->Find(id);
     }
   }
-  return true;
-}
\ No newline at end of file
+  if(node){
+    if(command.level != RC_NO_LEVEL)
+      tree->SetLevel(node->d, command.level);
+    else
+      tree->SetStatus(node->d, command.status ? 1 : 0);
+  }
+}
+
+// preferred if it is a free switch id, otherwise the lowest free one, 0 if none
+data freeId(unsigned long preferred){
+  if(preferred > 0 && preferred <= TREE_MAX_ID && !tree->Contains(preferred))
+    return preferred;
+  unsigned long id = 1;
+  TreeIterator it = tree->Range(1, TREE_MAX_ID);
+  Node node;
+  while((node = it.Next()) && node->d == id)
+    ++id;
+  return id <= TREE_MAX_ID ? id : 0;
+}
+
+void maintainDHCP(){
+  // A new address re-initializes the W5100, so the sockets must be reopened.
+  if(dhcp.maintain() == DHCP_CHANGED){
+    server.begin();
+    ntp.init(timeServer, ntpPort);
+    notify.begin(tree);
+    LOG_INFO(EV_SERVER_ADDRESS, ipTail(Ethernet.localIP()));
+  }
+}